@@ -14,6 +14,24 @@ pub fn build(b: *std.Build) void {
 }
 
 pub fn build_c_sources(b: *std.Build, name: []const u8, comptime dir: []const u8, target: std.Build.ResolvedTarget, optimize: std.builtin.OptimizeMode) void {
+    // the emulator core, shipped as libchip8 for embedding
+    const lib = b.addStaticLibrary(.{
+        .name = "chip8",
+        .target = target,
+        .optimize = optimize,
+    });
+    add_c_library_sources(b, lib, dir);
+    lib.installHeader(b.path(dir ++ "chip8.h"), "chip8.h");
+    b.installArtifact(lib);
+
+    const shared = b.addSharedLibrary(.{
+        .name = "chip8",
+        .target = target,
+        .optimize = optimize,
+    });
+    add_c_library_sources(b, shared, dir);
+    b.installArtifact(shared);
+
     const exe = b.addExecutable(.{
         .name = name,
         .target = target,
@@ -23,5 +41,57 @@ pub fn build_c_sources(b: *std.Build, name: []const u8, comptime dir: []const u8
     exe.linkLibC();
     exe.addIncludePath(b.path(dir));
     exe.addCSourceFile(.{ .file = b.path(dir ++ "main.c") });
+    exe.addCSourceFile(.{ .file = b.path(dir ++ "batch.c") });
+    exe.addCSourceFile(.{ .file = b.path(dir ++ "movie.c") });
+    exe.addCSourceFile(.{ .file = b.path(dir ++ "render.c") });
+    exe.addCSourceFile(.{ .file = b.path(dir ++ "bench.c") });
+    exe.addCSourceFile(.{ .file = b.path(dir ++ "check.c") });
+    exe.addCSourceFile(.{ .file = b.path(dir ++ "video.c") });
+    exe.addCSourceFile(.{ .file = b.path(dir ++ "metrics.c") });
+    exe.linkLibrary(lib);
     b.installArtifact(exe);
+
+    // chip8-top: watches the --metrics pages of running clients
+    const top = b.addExecutable(.{
+        .name = "chip8-top",
+        .target = target,
+        .optimize = optimize,
+    });
+    top.linkLibC();
+    top.addIncludePath(b.path(dir));
+    top.addCSourceFile(.{ .file = b.path(dir ++ "top.c") });
+    top.addCSourceFile(.{ .file = b.path(dir ++ "metrics.c") });
+    b.installArtifact(top);
+
+    // zig build bench: times the bundled programs, fails when -Dbench-baseline shows a regression
+    const bench_baseline = b.option([]const u8, "bench-baseline", "Bench results to compare against");
+    const bench_output = b.option([]const u8, "bench-output", "Where to write the bench results");
+    const bench = b.addRunArtifact(exe);
+    bench.has_side_effects = true;
+    bench.addArg("--bench");
+    bench.addDirectoryArg(b.path("chip8/programs"));
+    if (bench_baseline) |path| {
+        bench.addArg("--baseline");
+        bench.addFileArg(b.path(path));
+    }
+    if (bench_output) |path| {
+        bench.addArgs(&.{ "--output", path });
+    }
+    const bench_step = b.step("bench", "Benchmark the CHIP-8 engines and renderer");
+    bench_step.dependOn(&bench.step);
+
+    // zig build check: every engine against the switch interpreter, bundled and random ROMs
+    const check = b.addRunArtifact(exe);
+    check.has_side_effects = true;
+    check.addArg("--check");
+    check.addDirectoryArg(b.path("chip8/programs"));
+    check.addArgs(&.{ "--random", "1000" });
+    const check_step = b.step("check", "Check the CHIP-8 engines against the reference interpreter");
+    check_step.dependOn(&check.step);
+}
+
+fn add_c_library_sources(b: *std.Build, lib: *std.Build.Step.Compile, comptime dir: []const u8) void {
+    lib.linkLibC();
+    lib.addIncludePath(b.path(dir));
+    lib.addCSourceFile(.{ .file = b.path(dir ++ "chip8.c") });
 }
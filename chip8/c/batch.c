@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+
+// Batch Macros
+#define BATCH_STEP 4096
+#define BATCH_ROM_EXTENSION ".ch8"
+#define MANIFEST_LINE_SIZE (PATH_MAX + 64)
+
+typedef struct {
+	char path[PATH_MAX];
+	unsigned int cycles;
+	int profile;
+
+	int loaded;
+	unsigned char halted;
+	unsigned char quirks;
+	unsigned short int pc;
+	unsigned int executed;
+	double wallTime;
+	uint64_t screen[SCREEN_HEIGHT];
+	unsigned long long int screenHash;
+	unsigned long long int ramHash;
+	char error[MAX_STAT_WIDTH];
+} BatchJob;
+
+typedef struct {
+	BatchJob * jobs;
+	unsigned int count;
+	unsigned int capacity;
+} BatchJobList;
+
+struct BatchPool;
+
+// Each worker owns a contiguous range of jobs and eats it from the front. Once its own
+// range is empty it steals the back half of another worker's range, so a few slow ROMs
+// never leave the remaining cores idle.
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned int next;
+	unsigned int end;
+	unsigned int index;
+	pthread_t thread;
+	struct BatchPool * pool;
+} BatchWorker;
+
+typedef struct BatchPool {
+	const BatchOptions * options;
+	BatchJob * jobs;
+	BatchWorker * workers;
+	unsigned int workerCount;
+} BatchPool;
+
+static double batch_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static BatchJob * add_job(BatchJobList * list, const char * path, unsigned int cycles, int profile) {
+	if (list->count == list->capacity) {
+		unsigned int capacity = list->capacity ? list->capacity * 2 : 64;
+		BatchJob * jobs = realloc(list->jobs, capacity * sizeof(*jobs));
+		if (jobs == 0) {
+			return 0;
+		}
+		list->jobs = jobs;
+		list->capacity = capacity;
+	}
+	BatchJob * job = &list->jobs[list->count++];
+	memset(job, 0, sizeof(*job));
+	snprintf(job->path, sizeof(job->path), "%s", path);
+	job->cycles = cycles;
+	job->profile = profile;
+	return job;
+}
+
+static int compare_job_paths(const void * a, const void * b) {
+	return strcmp(((const BatchJob *)a)->path, ((const BatchJob *)b)->path);
+}
+
+static int collect_directory_jobs(BatchJobList * list, const char * directory, const BatchOptions * options) {
+	DIR * dir = opendir(directory);
+	if (dir == 0) {
+		perror("Could not open batch directory");
+		return 1;
+	}
+
+	size_t extensionSize = sizeof(BATCH_ROM_EXTENSION) - 1;
+	struct dirent * entry;
+	while ((entry = readdir(dir))) {
+		size_t size = strlen(entry->d_name);
+		if (size <= extensionSize || strcmp(entry->d_name + size - extensionSize, BATCH_ROM_EXTENSION) != 0) continue;
+
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		if (add_job(list, path, options->cycles, options->profile) == 0) {
+			closedir(dir);
+			perror("Cannot allocate the batch jobs");
+			return 3;
+		}
+	}
+	closedir(dir);
+
+	qsort(list->jobs, list->count, sizeof(*list->jobs), compare_job_paths);
+	return 0;
+}
+
+static int collect_manifest_jobs(BatchJobList * list, const char * manifest, const BatchOptions * options) {
+	FILE * file = fopen(manifest, "r");
+	if (file == 0) {
+		perror("Could not open batch manifest");
+		return 1;
+	}
+
+	int directorySize = 0;
+	const char * slash = strrchr(manifest, '/');
+	if (slash) directorySize = slash - manifest + 1;
+
+	char line[MANIFEST_LINE_SIZE];
+	unsigned int lineNumber = 0;
+	while (fgets(line, sizeof(line), file)) {
+		lineNumber++;
+		char * comment = strchr(line, '#');
+		if (comment) *comment = 0;
+
+		char name[PATH_MAX], cycles[32], profile[32];
+		int fields = sscanf(line, "%4095s %31s %31s", name, cycles, profile);
+		if (fields <= 0) continue;
+
+		char path[PATH_MAX];
+		int pathSize;
+		if (name[0] == '/') pathSize = snprintf(path, sizeof(path), "%s", name);
+		else pathSize = snprintf(path, sizeof(path), "%.*s%s", directorySize, manifest, name);
+
+		BatchJob * job = add_job(list, path, options->cycles, options->profile);
+		if (job == 0) {
+			fclose(file);
+			perror("Cannot allocate the batch jobs");
+			return 3;
+		}
+		// a cut path could name another file, so the entry is reported and never run
+		if (pathSize < 0 || (size_t)pathSize >= sizeof(path)) {
+			fprintf(stderr, "%s:%u: path of %s is too long\n", manifest, lineNumber, name);
+			snprintf(job->error, sizeof(job->error), "Program path too long");
+		}
+		if (fields >= 2 && strcmp(cycles, "-") != 0) {
+			job->cycles = strtoul(cycles, 0, 0);
+		}
+		if (fields >= 3 && strcmp(profile, "-") != 0) {
+			job->profile = chip8_parse_profile(profile);
+			if (job->profile < 0) {
+				fclose(file);
+				fprintf(stderr, "%s:%u: unknown quirk profile %s\n", manifest, lineNumber, profile);
+				return 1;
+			}
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+static int collect_jobs(BatchJobList * list, const BatchOptions * options) {
+	struct stat info;
+	if (stat(options->source, &info)) {
+		perror("Could not find batch source");
+		return 1;
+	}
+	if (S_ISDIR(info.st_mode)) {
+		return collect_directory_jobs(list, options->source, options);
+	}
+	return collect_manifest_jobs(list, options->source, options);
+}
+
+static void run_job(BatchJob * job, const BatchOptions * options) {
+	if (*job->error) {
+		return;
+	}
+	unsigned char program[MEMORY_LIMIT - PROGRAM_MEMORY_SECTOR + 1];
+	FILE * programFile = fopen(job->path, "rb");
+	if (programFile == 0) {
+		snprintf(job->error, sizeof(job->error), "Could not read program file");
+		return;
+	}
+	size_t programSize = fread(program, 1, sizeof(program), programFile);
+	fclose(programFile);
+
+	Chip8 * chip8 = chip8_create();
+	if (chip8 == 0) {
+		snprintf(job->error, sizeof(job->error), "Cannot allocate the machine");
+		return;
+	}
+	Machine * machine = chip8_machine(chip8);
+
+	// same setup as a --headless run, so the hashes can be compared with one
+	if (options->programName) {
+		memcpy(machine->ram.mem + NAME_MEMORY_SECTOR, options->programName, options->programNameSize);
+	}
+	machine->instructionRate = options->instructionRate;
+	chip8_set_engine(chip8, options->engine);
+	chip8_set_fast_forward(chip8, options->fastForward);
+
+	if (chip8_load(chip8, program, programSize)) {
+		snprintf(job->error, sizeof(job->error), "Program too large");
+		chip8_destroy(chip8);
+		return;
+	}
+	if (job->profile >= 0) {
+		machine->quirks = job->profile;
+	}
+	chip8_seed(chip8, options->seed);
+
+	double start = batch_seconds();
+	while (!machine->halted && machine->cycles < job->cycles) {
+		unsigned int count = BATCH_STEP;
+		if (job->cycles - machine->cycles < count) {
+			count = job->cycles - machine->cycles;
+		}
+		chip8_step(chip8, count);
+	}
+	job->wallTime = batch_seconds() - start;
+
+	job->loaded = 1;
+	job->halted = machine->halted;
+	job->quirks = machine->quirks;
+	job->pc = machine->pc;
+	job->executed = machine->cycles;
+	memcpy(job->screen, chip8_get_framebuffer(chip8), sizeof(job->screen));
+	job->screenHash = chip8_hash_bytes(HASH_SEED, &machine->screen, sizeof(machine->screen));
+	job->ramHash = chip8_hash_bytes(HASH_SEED, &machine->ram, sizeof(machine->ram));
+	snprintf(job->error, sizeof(job->error), "%s", machine->error);
+
+	chip8_destroy(chip8);
+}
+
+static int take_own_job(BatchWorker * worker, unsigned int * job) {
+	int found = 0;
+	pthread_mutex_lock(&worker->lock);
+	if (worker->next < worker->end) {
+		*job = worker->next++;
+		found = 1;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return found;
+}
+
+static int steal_jobs(BatchWorker * worker) {
+	BatchPool * pool = worker->pool;
+	for (unsigned int i = 1; i < pool->workerCount; i++) {
+		BatchWorker * victim = &pool->workers[(worker->index + i) % pool->workerCount];
+
+		pthread_mutex_lock(&victim->lock);
+		unsigned int remaining = victim->end - victim->next;
+		unsigned int begin = victim->end - (remaining + 1) / 2;
+		unsigned int end = victim->end;
+		victim->end = begin;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (begin < end) {
+			pthread_mutex_lock(&worker->lock);
+			worker->next = begin;
+			worker->end = end;
+			pthread_mutex_unlock(&worker->lock);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void * batch_worker(void * argument) {
+	BatchWorker * worker = argument;
+	BatchPool * pool = worker->pool;
+	unsigned int job;
+
+	// jobs only ever move between ranges, so once every range is empty the batch is done
+	while (take_own_job(worker, &job) || (steal_jobs(worker) && take_own_job(worker, &job))) {
+		run_job(&pool->jobs[job], pool->options);
+	}
+	return 0;
+}
+
+static void write_json_string(FILE * file, const char * text) {
+	fputc('"', file);
+	for (; *text; text++) {
+		unsigned char c = *text;
+		if (c == '"' || c == '\\') fprintf(file, "\\%c", c);
+		else if (c < 0x20) fprintf(file, "\\u%.4x", c);
+		else fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+static void write_csv_string(FILE * file, const char * text) {
+	fputc('"', file);
+	for (; *text; text++) {
+		if (*text == '"') fputc('"', file);
+		fputc(*text, file);
+	}
+	fputc('"', file);
+}
+
+static void write_framebuffer(FILE * file, const uint64_t * rows) {
+	for (int i = 0; i < SCREEN_HEIGHT; i++) {
+		fprintf(file, "%.16llx", (unsigned long long int)rows[i]);
+	}
+}
+
+static void write_result(FILE * file, const BatchJob * job, int format) {
+	if (format == BATCH_FORMAT_CSV) {
+		write_csv_string(file, job->path);
+		if (job->loaded) {
+			fprintf(file, ",%s,0x%.2x,%u,0x%.4x,%d,0x%.16llx,0x%.16llx,", chip8_profile_name(job->quirks), job->quirks, job->executed, job->pc, job->halted, job->screenHash, job->ramHash);
+			write_framebuffer(file, job->screen);
+		} else {
+			fprintf(file, ",,,,,1,,,");
+		}
+		fputc(',', file);
+		write_csv_string(file, job->error);
+		fprintf(file, ",%.6lf\n", job->wallTime);
+		return;
+	}
+
+	fprintf(file, "{\"rom\":");
+	write_json_string(file, job->path);
+	if (job->loaded) {
+		fprintf(file, ",\"profile\":\"%s\",\"quirks\":%u,\"cycles\":%u,\"pc\":%u,\"halted\":%s", chip8_profile_name(job->quirks), job->quirks, job->executed, job->pc, job->halted ? "true" : "false");
+		fprintf(file, ",\"screen_hash\":\"0x%.16llx\",\"ram_hash\":\"0x%.16llx\",\"framebuffer\":\"", job->screenHash, job->ramHash);
+		write_framebuffer(file, job->screen);
+		fputc('"', file);
+	} else {
+		fprintf(file, ",\"halted\":true");
+	}
+	fprintf(file, ",\"error\":");
+	write_json_string(file, job->error);
+	fprintf(file, ",\"seconds\":%.6lf}\n", job->wallTime);
+}
+
+int run_batch(const BatchOptions * options) {
+	BatchJobList list = {0};
+	int result = collect_jobs(&list, options);
+	if (result) {
+		free(list.jobs);
+		return result;
+	}
+
+	unsigned int workerCount = options->threads;
+	if (workerCount == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		workerCount = cores > 0 ? cores : 1;
+	}
+	if (workerCount > list.count) workerCount = list.count ? list.count : 1;
+
+	BatchPool pool = {options, list.jobs, calloc(workerCount, sizeof(BatchWorker)), workerCount};
+	if (pool.workers == 0) {
+		free(list.jobs);
+		perror("Cannot allocate the batch workers");
+		return 3;
+	}
+
+	double start = batch_seconds();
+	unsigned int started = 0;
+	for (unsigned int i = 0; i < workerCount; i++) {
+		BatchWorker * worker = &pool.workers[i];
+		pthread_mutex_init(&worker->lock, 0);
+		worker->next = (unsigned long long int)list.count * i / workerCount;
+		worker->end = (unsigned long long int)list.count * (i + 1) / workerCount;
+		worker->index = i;
+		worker->pool = &pool;
+	}
+	for (unsigned int i = 0; i < workerCount; i++) {
+		if (pthread_create(&pool.workers[i].thread, 0, batch_worker, &pool.workers[i])) break;
+		started++;
+	}
+	// with no thread at all the calling thread works through the batch by itself
+	if (started == 0) {
+		batch_worker(&pool.workers[0]);
+	}
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(pool.workers[i].thread, 0);
+	}
+	double wallTime = batch_seconds() - start;
+
+	FILE * output = stdout;
+	if (options->outputFile) {
+		output = fopen(options->outputFile, "w");
+		if (output == 0) {
+			perror("Could not write batch results");
+			output = stdout;
+		}
+	}
+	if (options->format == BATCH_FORMAT_CSV) {
+		fprintf(output, "rom,profile,quirks,cycles,pc,halted,screen_hash,ram_hash,framebuffer,error,seconds\n");
+	}
+
+	unsigned long long int instructions = 0;
+	unsigned int failures = 0;
+	for (unsigned int i = 0; i < list.count; i++) {
+		write_result(output, &list.jobs[i], options->format);
+		instructions += list.jobs[i].executed;
+		if (!list.jobs[i].loaded || list.jobs[i].halted) failures++;
+	}
+	if (output != stdout) fclose(output);
+
+	fprintf(stderr, "roms: %u (%u failed)\n", list.count, failures);
+	fprintf(stderr, "threads: %u\n", started ? started : 1);
+	fprintf(stderr, "instructions: %llu\n", instructions);
+	fprintf(stderr, "wall time: %.6lf s\n", wallTime);
+	fprintf(stderr, "instructions per second: %.0lf\n", wallTime > 0 ? instructions / wallTime : 0);
+
+	for (unsigned int i = 0; i < workerCount; i++) {
+		pthread_mutex_destroy(&pool.workers[i].lock);
+	}
+	free(pool.workers);
+	free(list.jobs);
+	return 0;
+}
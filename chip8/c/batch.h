@@ -0,0 +1,35 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "chip8.h"
+
+// Batch mode: runs every ROM of a directory or manifest headlessly on a thread pool and
+// writes one result per ROM.
+
+enum {
+	BATCH_FORMAT_JSONL,
+	BATCH_FORMAT_CSV
+};
+
+typedef struct {
+	const char * source;
+	const char * outputFile;
+	int format;
+	unsigned int threads;
+	unsigned int cycles;
+	unsigned int instructionRate;
+	int engine;
+	int profile;
+	unsigned long long int seed;
+	int fastForward;
+	const char * programName;
+	size_t programNameSize;
+} BatchOptions;
+
+// source is either a directory, whose *.ch8 files are run in name order, or a manifest with
+// one "path [cycles] [profile]" per line. Relative manifest paths start at the manifest's
+// directory, "-" keeps the default for a column and # starts a comment.
+// threads of 0 sizes the pool to the online cores. Returns 0 once every result is written.
+int run_batch(const BatchOptions * options);
+
+#endif
@@ -0,0 +1,525 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "bench.h"
+#include "render.h"
+
+// Bench Macros
+#define BENCH_STEP 4096
+#define BENCH_ROM_EXTENSION ".ch8"
+#define BENCH_KERNEL_LENGTH 256
+#define BENCH_KERNEL_CYCLES 2000000
+#define BENCH_RENDER_FRAMES_PER_ROM 600
+#define BENCH_RENDER_FULL_FRAMES 2000
+#define BENCH_ID_SIZE 128
+#define BENCH_DETAIL_SIZE 256
+#define BENCH_LINE_SIZE 1024
+#define BENCH_REGRESSION 8
+
+static const char * const engineNames[] = {"switch", "threaded", "jit"};
+
+#define BENCH_ENGINE_COUNT (sizeof(engineNames) / sizeof(*engineNames))
+
+// A kernel is a loop of BENCH_KERNEL_LENGTH instructions of one class, the body repeated to
+// fill it, after a short setup that keeps skips from being taken. Jumps go to the next
+// instruction and calls to a lone 00EE after the loop, so the loop only ever runs straight
+// through.
+#define KERNEL_JUMP_NEXT 0x1000
+#define KERNEL_OFFSET_JUMP_NEXT 0xb000
+#define KERNEL_CALL 0x2000
+
+typedef struct {
+	const char * name;
+	unsigned short int setup[4];
+	unsigned short int body[9];
+} BenchKernel;
+
+static const BenchKernel kernels[] = {
+	{"00E0", {0}, {0x00e0}},
+	{"1NNN", {0}, {KERNEL_JUMP_NEXT}},
+	{"2NNN+00EE", {0}, {KERNEL_CALL}},
+	{"3XNN", {0x6001}, {0x3000}},
+	{"4XNN", {0x6001}, {0x4001}},
+	{"5XY0", {0x6001, 0x6102}, {0x5010}},
+	{"6XNN", {0}, {0x6a12}},
+	{"7XNN", {0}, {0x7a01}},
+	{"8XYN", {0x6001, 0x6102}, {0x8010, 0x8011, 0x8012, 0x8013, 0x8014, 0x8015, 0x8016, 0x8017, 0x801e}},
+	{"9XY0", {0}, {0x9000}},
+	{"ANNN", {0}, {0xa300}},
+	{"BNNN", {0x6000, 0x6200, 0x6300}, {KERNEL_OFFSET_JUMP_NEXT}},
+	{"CXNN", {0}, {0xc0ff}},
+	{"DXY1", {0xa050}, {0xd011}},
+	{"DXY5", {0xa050}, {0xd015}},
+	{"DXYF", {0xa050}, {0xd01f}},
+	{"EXNN", {0x6001}, {0xe09e}},
+	{"FX07", {0}, {0xf007}},
+	{"FX15", {0}, {0xf015}},
+	{"FX18", {0}, {0xf018}},
+	{"FX1E", {0xae00}, {0xf01e}},
+	{"FX29", {0}, {0xf029}},
+	{"FX33", {0xae00}, {0xf033}},
+	{"FX55", {0xae00}, {0xf355}},
+	{"FX65", {0xae00}, {0xf365}},
+};
+
+#define BENCH_KERNEL_COUNT (sizeof(kernels) / sizeof(*kernels))
+
+typedef struct {
+	char id[BENCH_ID_SIZE];
+	// ns figures are compared against the baseline, lower is better
+	double ns;
+	int timed;
+	unsigned long long int hash;
+	int hashed;
+	char detail[BENCH_DETAIL_SIZE];
+} BenchRecord;
+
+typedef struct {
+	BenchRecord * records;
+	unsigned int count;
+	unsigned int capacity;
+} BenchReport;
+
+static double bench_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static BenchRecord * add_record(BenchReport * report, const char * id) {
+	if (report->count == report->capacity) {
+		unsigned int capacity = report->capacity ? report->capacity * 2 : 256;
+		BenchRecord * records = realloc(report->records, capacity * sizeof(*records));
+		if (records == 0) {
+			return 0;
+		}
+		report->records = records;
+		report->capacity = capacity;
+	}
+	BenchRecord * record = &report->records[report->count++];
+	memset(record, 0, sizeof(*record));
+	snprintf(record->id, sizeof(record->id), "%s", id);
+	return record;
+}
+
+static const BenchRecord * find_record(const BenchReport * report, const char * id) {
+	for (unsigned int i = 0; i < report->count; i++) {
+		if (strcmp(report->records[i].id, id) == 0) return &report->records[i];
+	}
+	return 0;
+}
+
+static Chip8 * create_machine(const BenchOptions * options, int engine, const unsigned char * program, size_t size) {
+	Chip8 * chip8 = chip8_create();
+	if (chip8 == 0) {
+		return 0;
+	}
+	Machine * machine = chip8_machine(chip8);
+	// same setup as a --headless run, so the state hashes can be compared with one
+	if (options->programName) {
+		memcpy(machine->ram.mem + NAME_MEMORY_SECTOR, options->programName, options->programNameSize);
+	}
+	machine->instructionRate = options->instructionRate;
+	chip8_set_engine(chip8, engine);
+	if (chip8_load(chip8, program, size)) {
+		chip8_destroy(chip8);
+		return 0;
+	}
+	return chip8;
+}
+
+// Best of options->repeat runs, in ns per instruction. Returns a negative time if the
+// machine cannot be set up.
+static double time_program(const BenchOptions * options, int engine, const unsigned char * program, size_t size, unsigned int cycles, unsigned int * executed, unsigned long long int * hash) {
+	double best = -1;
+	for (unsigned int run = 0; run < options->repeat; run++) {
+		Chip8 * chip8 = create_machine(options, engine, program, size);
+		if (chip8 == 0) {
+			return -1;
+		}
+		Machine * machine = chip8_machine(chip8);
+
+		double start = bench_seconds();
+		while (!machine->halted && machine->cycles < cycles) {
+			unsigned int count = cycles - machine->cycles < BENCH_STEP ? cycles - machine->cycles : BENCH_STEP;
+			chip8_step(chip8, count);
+		}
+		double wallTime = bench_seconds() - start;
+
+		double ns = machine->cycles ? wallTime * 1e9 / machine->cycles : 0;
+		if (best < 0 || ns < best) best = ns;
+		*executed = machine->cycles;
+		*hash = chip8_state_hash(chip8);
+		chip8_destroy(chip8);
+	}
+	return best;
+}
+
+static size_t build_kernel(const BenchKernel * kernel, unsigned char * program) {
+	unsigned int setupLength = 0;
+	while (setupLength < 4 && kernel->setup[setupLength]) setupLength++;
+	unsigned int bodyLength = 0;
+	while (bodyLength < 9 && kernel->body[bodyLength]) bodyLength++;
+
+	unsigned int loop = PROGRAM_MEMORY_SECTOR + 2 * setupLength;
+	unsigned int subroutine = loop + 2 * (BENCH_KERNEL_LENGTH + 1);
+	size_t size = 0;
+	for (unsigned int i = 0; i < setupLength; i++) {
+		program[size++] = kernel->setup[i] >> 8;
+		program[size++] = kernel->setup[i];
+	}
+	for (unsigned int i = 0; i < BENCH_KERNEL_LENGTH; i++) {
+		unsigned int address = PROGRAM_MEMORY_SECTOR + size;
+		unsigned short int opcode = kernel->body[i % bodyLength];
+		if (opcode == KERNEL_JUMP_NEXT || opcode == KERNEL_OFFSET_JUMP_NEXT) opcode |= address + 2;
+		if (opcode == KERNEL_CALL) opcode |= subroutine;
+		program[size++] = opcode >> 8;
+		program[size++] = opcode;
+	}
+	program[size++] = 0x10 | loop >> 8;
+	program[size++] = loop;
+	program[size++] = 0x00;
+	program[size++] = 0xee;
+	return size;
+}
+
+static int bench_kernels(BenchReport * report, const BenchOptions * options) {
+	unsigned char program[2 * (BENCH_KERNEL_LENGTH + 8)];
+	for (unsigned int e = 0; e < BENCH_ENGINE_COUNT; e++) {
+		double sprite[3] = {0};
+		unsigned int sprites = 0;
+		for (unsigned int k = 0; k < BENCH_KERNEL_COUNT; k++) {
+			size_t size = build_kernel(&kernels[k], program);
+			unsigned int executed;
+			unsigned long long int hash;
+			double ns = time_program(options, e, program, size, BENCH_KERNEL_CYCLES, &executed, &hash);
+
+			char id[BENCH_ID_SIZE];
+			snprintf(id, sizeof(id), "class/%s/%s", kernels[k].name, engineNames[e]);
+			BenchRecord * record = add_record(report, id);
+			if (record == 0 || ns < 0) {
+				return 3;
+			}
+			record->ns = ns;
+			record->timed = 1;
+			snprintf(record->detail, sizeof(record->detail), "\"instructions\":%u", executed);
+			if (kernels[k].name[0] == 'D') sprite[sprites++] = ns;
+		}
+
+		// DXY1 and DXYF bracket the row count, DXY5 is the size of a font glyph
+		char id[BENCH_ID_SIZE];
+		snprintf(id, sizeof(id), "draw_sprite/%s", engineNames[e]);
+		BenchRecord * record = add_record(report, id);
+		if (record == 0) {
+			return 3;
+		}
+		record->ns = sprite[1];
+		record->timed = 1;
+		snprintf(record->detail, sizeof(record->detail), "\"ns_per_row\":%.3lf", (sprite[2] - sprite[0]) / 14);
+	}
+	return 0;
+}
+
+typedef struct {
+	Frame * frames;
+	unsigned int count;
+	unsigned int capacity;
+} FrameList;
+
+// Counts the instruction mix of a ROM on the switch engine, one instruction at a time, and
+// keeps a frame of every 60th of a second for the renderer to draw later.
+static int count_mix(BenchReport * report, FrameList * frames, const BenchOptions * options, const char * name, const unsigned char * program, size_t size) {
+	Chip8 * chip8 = create_machine(options, ENGINE_SWITCH, program, size);
+	if (chip8 == 0) {
+		return 3;
+	}
+	Machine * machine = chip8_machine(chip8);
+	unsigned long long int counts[OPCODE_FAMILY_COUNT] = {0};
+	unsigned int frameCycles = options->instructionRate / TIMER_RATE ? options->instructionRate / TIMER_RATE : 1;
+	unsigned int captured = 0;
+
+	while (!machine->halted && machine->cycles < options->cycles) {
+		unsigned short int pc = machine->pc;
+		unsigned short int opcode = pc < MEMORY_LIMIT - 1 ? machine->ram.mem[pc] << 8 | machine->ram.mem[pc + 1] : 0;
+		if (chip8_step(chip8, 1) == 0) break;
+		counts[chip8_opcode_family(opcode)]++;
+
+		if (machine->cycles % frameCycles == 0 && captured < BENCH_RENDER_FRAMES_PER_ROM && frames->count < frames->capacity) {
+			Frame * frame = &frames->frames[frames->count++];
+			memset(frame, 0, sizeof(*frame));
+			memcpy(frame->screen, machine->screen.rows, sizeof(frame->screen));
+			snprintf(frame->programName, sizeof(frame->programName), "%.*s", MAX_STAT_WIDTH - 1, name);
+			frame->cycles = machine->cycles;
+			frame->pc = machine->pc;
+			frame->keyBuffer = machine->keyBuffer;
+			frame->quirks = machine->quirks;
+			frame->soundTimer = machine->soundTimer;
+			frame->frameTime = 1.0 / TIMER_RATE;
+			frame->speed = 1;
+			captured++;
+		}
+	}
+
+	for (int c = 0; c < OPCODE_FAMILY_COUNT; c++) {
+		if (counts[c] == 0) continue;
+		char id[BENCH_ID_SIZE];
+		snprintf(id, sizeof(id), "mix/%s/%s", name, chip8_opcode_family_name(c));
+		BenchRecord * record = add_record(report, id);
+		if (record == 0) {
+			chip8_destroy(chip8);
+			return 3;
+		}
+		snprintf(record->detail, sizeof(record->detail), "\"count\":%llu,\"share\":%.6lf", counts[c], (double)counts[c] / machine->cycles);
+	}
+	chip8_destroy(chip8);
+	return 0;
+}
+
+static int bench_rom(BenchReport * report, FrameList * frames, const BenchOptions * options, const char * directory, const char * name) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+	FILE * programFile = fopen(path, "rb");
+	if (programFile == 0) {
+		perror("Could not read program file");
+		return 4;
+	}
+	unsigned char program[MEMORY_LIMIT - PROGRAM_MEMORY_SECTOR + 1];
+	size_t size = fread(program, 1, sizeof(program), programFile);
+	fclose(programFile);
+
+	for (unsigned int e = 0; e < BENCH_ENGINE_COUNT; e++) {
+		unsigned int executed;
+		unsigned long long int hash;
+		double ns = time_program(options, e, program, size, options->cycles, &executed, &hash);
+		if (ns < 0) {
+			fprintf(stderr, "Could not load %s\n", path);
+			return 5;
+		}
+
+		char id[BENCH_ID_SIZE];
+		snprintf(id, sizeof(id), "rom/%s/%s", name, engineNames[e]);
+		BenchRecord * record = add_record(report, id);
+		if (record == 0) {
+			return 3;
+		}
+		record->ns = ns;
+		record->timed = 1;
+		record->hash = hash;
+		record->hashed = 1;
+		snprintf(record->detail, sizeof(record->detail), "\"instructions\":%u,\"instructions_per_second\":%.0lf", executed, ns > 0 ? 1e9 / ns : 0);
+	}
+	return count_mix(report, frames, options, name, program, size);
+}
+
+// Draws every captured frame in order, as the terminal would see them, then every one of
+// them from scratch, as after a resize, and a full redraw of a checkerboard, the worst case
+// for the cell diff and for runs, with full or half blocks.
+static int bench_render(BenchReport * report, const FrameList * frames, const BenchOptions * options, int halfBlocks) {
+	Renderer renderer;
+	if (initialize_renderer(&renderer, halfBlocks)) {
+		return 3;
+	}
+	const char * prefix = halfBlocks ? "render/half" : "render";
+	char id[BENCH_ID_SIZE];
+
+	BenchRecord * record;
+	double best;
+	size_t bytes = 0;
+	for (int redraw = 0; redraw < 2; redraw++) {
+		best = -1;
+		for (unsigned int run = 0; run < options->repeat && frames->count; run++) {
+			renderer.presentedValid = 0;
+			memset(renderer.presentedStats, 0, sizeof(renderer.presentedStats));
+			bytes = 0;
+			double start = bench_seconds();
+			for (unsigned int i = 0; i < frames->count; i++) {
+				if (redraw) {
+					renderer.presentedValid = 0;
+					memset(renderer.presentedStats, 0, sizeof(renderer.presentedStats));
+				}
+				draw_frame(&renderer, &frames->frames[i], 0, TIMER_RATE);
+				bytes += renderer.length;
+				renderer.length = 0;
+			}
+			double ns = (bench_seconds() - start) * 1e9 / frames->count;
+			if (best < 0 || ns < best) best = ns;
+		}
+		snprintf(id, sizeof(id), redraw ? "%s/redraw" : "%s/frames", prefix);
+		record = add_record(report, id);
+		if (record == 0) {
+			free_renderer(&renderer);
+			return 3;
+		}
+		record->ns = best > 0 ? best : 0;
+		record->timed = frames->count != 0;
+		snprintf(record->detail, sizeof(record->detail), "\"frames\":%u,\"bytes_per_frame\":%.1lf", frames->count, frames->count ? (double)bytes / frames->count : 0);
+	}
+
+	uint64_t checkerboard[SCREEN_HEIGHT];
+	for (int i = 0; i < SCREEN_HEIGHT; i++) {
+		checkerboard[i] = i & 1 ? 0xaaaaaaaaaaaaaaaaULL : 0x5555555555555555ULL;
+	}
+	best = -1;
+	for (unsigned int run = 0; run < options->repeat; run++) {
+		double start = bench_seconds();
+		for (unsigned int i = 0; i < BENCH_RENDER_FULL_FRAMES; i++) {
+			renderer.presentedValid = 0;
+			if (halfBlocks) draw_half_blocks(&renderer, checkerboard, 0);
+			else draw_screen(&renderer, checkerboard);
+			bytes = renderer.length;
+			renderer.length = 0;
+		}
+		double ns = (bench_seconds() - start) * 1e9 / BENCH_RENDER_FULL_FRAMES;
+		if (best < 0 || ns < best) best = ns;
+	}
+	free_renderer(&renderer);
+	snprintf(id, sizeof(id), "%s/full", prefix);
+	record = add_record(report, id);
+	if (record == 0) {
+		return 3;
+	}
+	record->ns = best;
+	record->timed = 1;
+	snprintf(record->detail, sizeof(record->detail), "\"bytes_per_frame\":%zu", bytes);
+	return 0;
+}
+
+static int is_rom(const struct dirent * entry) {
+	size_t size = strlen(entry->d_name);
+	size_t extensionSize = sizeof(BENCH_ROM_EXTENSION) - 1;
+	return size > extensionSize && strcmp(entry->d_name + size - extensionSize, BENCH_ROM_EXTENSION) == 0;
+}
+
+static void write_report(FILE * file, const BenchReport * report) {
+	for (unsigned int i = 0; i < report->count; i++) {
+		const BenchRecord * record = &report->records[i];
+		fprintf(file, "{\"id\":\"%s\"", record->id);
+		if (record->timed) fprintf(file, ",\"ns\":%.3lf", record->ns);
+		if (record->hashed) fprintf(file, ",\"state_hash\":\"0x%.16llx\"", record->hash);
+		if (*record->detail) fprintf(file, ",%s", record->detail);
+		fprintf(file, "}\n");
+	}
+}
+
+// Reads back the id, ns and state_hash of every line written by write_report.
+static int read_baseline(BenchReport * baseline, const char * path) {
+	FILE * file = fopen(path, "r");
+	if (file == 0) {
+		perror("Could not read the bench baseline");
+		return 1;
+	}
+	char line[BENCH_LINE_SIZE];
+	while (fgets(line, sizeof(line), file)) {
+		const char * id = strstr(line, "\"id\":\"");
+		if (id == 0) continue;
+		id += 6;
+		const char * end = strchr(id, '"');
+		if (end == 0 || end - id >= BENCH_ID_SIZE) continue;
+
+		char name[BENCH_ID_SIZE];
+		memcpy(name, id, end - id);
+		name[end - id] = 0;
+		BenchRecord * record = add_record(baseline, name);
+		if (record == 0) {
+			fclose(file);
+			return 3;
+		}
+		const char * ns = strstr(line, "\"ns\":");
+		if (ns) {
+			record->ns = strtod(ns + 5, 0);
+			record->timed = 1;
+		}
+		const char * hash = strstr(line, "\"state_hash\":\"");
+		if (hash) {
+			record->hash = strtoull(hash + 14, 0, 16);
+			record->hashed = 1;
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+// Returns how many figures regressed or changed state.
+static unsigned int compare_baseline(const BenchReport * report, const BenchReport * baseline, double tolerance) {
+	unsigned int failures = 0;
+	unsigned int compared = 0;
+	for (unsigned int i = 0; i < report->count; i++) {
+		const BenchRecord * record = &report->records[i];
+		const BenchRecord * base = find_record(baseline, record->id);
+		if (base == 0) continue;
+		if (record->hashed && base->hashed && record->hash != base->hash) {
+			fprintf(stderr, "CHANGED %s: state hash 0x%.16llx, baseline 0x%.16llx\n", record->id, record->hash, base->hash);
+			failures++;
+		}
+		if (record->timed && base->timed && base->ns > 0) {
+			compared++;
+			double change = record->ns / base->ns - 1;
+			if (change > tolerance) {
+				fprintf(stderr, "REGRESSION %s: %.3lf ns, baseline %.3lf ns (%+.1lf%%)\n", record->id, record->ns, base->ns, change * 100);
+				failures++;
+			}
+		}
+	}
+	fprintf(stderr, "bench: %u figures compared against the baseline, %u failed\n", compared, failures);
+	return failures;
+}
+
+int run_bench(const BenchOptions * options) {
+	struct dirent ** entries;
+	int romCount = scandir(options->source, &entries, is_rom, alphasort);
+	if (romCount < 0) {
+		perror("Could not open bench directory");
+		return 1;
+	}
+
+	BenchReport report = {0};
+	FrameList frames = {0};
+	frames.capacity = romCount * BENCH_RENDER_FRAMES_PER_ROM;
+	frames.frames = malloc((frames.capacity ? frames.capacity : 1) * sizeof(Frame));
+	int result = frames.frames == 0 ? 3 : 0;
+
+	for (int i = 0; i < romCount; i++) {
+		if (result == 0) result = bench_rom(&report, &frames, options, options->source, entries[i]->d_name);
+		free(entries[i]);
+	}
+	free(entries);
+	if (result == 0) result = bench_kernels(&report, options);
+	if (result == 0) result = bench_render(&report, &frames, options, 0);
+	if (result == 0) result = bench_render(&report, &frames, options, 1);
+	free(frames.frames);
+	if (result) {
+		if (result == 3) perror("Cannot allocate the bench results");
+		free(report.records);
+		return result;
+	}
+
+	FILE * output = stdout;
+	if (options->outputFile) {
+		output = fopen(options->outputFile, "w");
+		if (output == 0) {
+			perror("Could not write bench results");
+			output = stdout;
+		}
+	}
+	write_report(output, &report);
+	if (output != stdout) fclose(output);
+
+	for (unsigned int i = 0; i < report.count; i++) {
+		if (report.records[i].timed) fprintf(stderr, "%-40s %12.3lf ns\n", report.records[i].id, report.records[i].ns);
+	}
+
+	if (options->baselineFile) {
+		BenchReport baseline = {0};
+		result = read_baseline(&baseline, options->baselineFile);
+		if (result == 0 && compare_baseline(&report, &baseline, options->tolerance)) {
+			result = BENCH_REGRESSION;
+		}
+		free(baseline.records);
+	}
+	free(report.records);
+	return result;
+}
@@ -0,0 +1,28 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "chip8.h"
+
+// Bench mode: times every ROM of a directory on every engine, the cost of each opcode class
+// and of the terminal renderer, and writes one JSON line per measurement. Lines carry an id
+// and, when lower is better, an "ns" figure, so the output of one build serves as the
+// baseline of the next.
+
+typedef struct {
+	const char * source;
+	const char * outputFile;
+	const char * baselineFile;
+	// slowdown over the baseline that counts as a regression, 0.1 for 10%
+	double tolerance;
+	unsigned int repeat;
+	unsigned int cycles;
+	unsigned int instructionRate;
+	const char * programName;
+	size_t programNameSize;
+} BenchOptions;
+
+// Returns 0 when every figure is within tolerance of the baseline, 8 when any regressed or a
+// ROM ended in another state than it did in the baseline.
+int run_bench(const BenchOptions * options);
+
+#endif
@@ -0,0 +1,560 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "check.h"
+
+// Check Macros
+#define CHECK_ROM_EXTENSION ".ch8"
+#define CHECK_NAME_SIZE 256
+#define CHECK_LANES 4
+// key presses change every CHECK_KEY_PERIOD instructions whatever the interval, so a run
+// checked at any interval sees the same input
+#define CHECK_KEY_PERIOD 2000
+#define CHECK_DIVERGED 9
+// frames the rewind check records, with a keyframe every CHECK_REWIND_KEYFRAME_INTERVAL
+#define CHECK_REWIND_FRAMES 64
+#define CHECK_REWIND_KEYFRAME_INTERVAL 8
+
+static const char * const candidateNames[] = {"threaded", "jit", "lockstep"};
+
+typedef struct {
+	char name[CHECK_NAME_SIZE];
+	unsigned char program[MEMORY_LIMIT - PROGRAM_MEMORY_SECTOR];
+	size_t size;
+} CheckRom;
+
+typedef struct {
+	unsigned int rom;
+	unsigned char quirks;
+	int candidate;
+} CheckJob;
+
+// The reference lanes run on the switch interpreter, the candidate lanes on the engine being
+// checked; lane i of both is seeded with seed + i.
+typedef struct {
+	unsigned int lanes;
+	Chip8 * reference[CHECK_LANES];
+	Chip8 * candidate;
+	Chip8Lockstep * lockstep;
+	unsigned long long int seed;
+} CheckRun;
+
+typedef struct {
+	const CheckOptions * options;
+	const CheckRom * roms;
+	const CheckJob * jobs;
+	unsigned int jobCount;
+	atomic_uint next;
+	atomic_int diverged;
+	atomic_ullong instructions;
+	pthread_mutex_t reportLock;
+} CheckPool;
+
+static double check_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static unsigned long long int check_random(unsigned long long int * state) {
+	unsigned long long int z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// Random words folded onto valid opcodes, so a random ROM runs until it jumps somewhere odd
+// or unbalances the stack rather than stopping at its first unknown instruction. One word in
+// 64 starts an idle block instead: a timer set from a random value followed by one of the
+// waits the engines fast forward, a jump to itself, FX0A or a delay timer poll. Another one in
+// 64 starts a far block: I set near the top of RAM and pushed past it by FX1E steps of up to
+// 0xff, then FX55, FX65, FX33 or DXYN through it, so accesses that wrap are compared too.
+static void generate_rom(CheckRom * rom, unsigned long long int seed, unsigned int index) {
+	static const unsigned char arithmetic[] = {0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xe};
+	static const unsigned char misc[] = {0x07, 0x0a, 0x15, 0x18, 0x1e, 0x29, 0x33, 0x55, 0x65};
+	unsigned long long int state = seed ^ (0x52414e44ULL + index) * 0x9e3779b97f4a7c15ULL;
+	snprintf(rom->name, sizeof(rom->name), "random-%u", index);
+	rom->size = sizeof(rom->program);
+	for (size_t i = 0; i < rom->size; i += 2) {
+		unsigned long long int value = check_random(&state);
+		unsigned short int opcode = value;
+		unsigned int pick = value >> 32;
+		if ((pick & 63) == 0 && i + 10 <= rom->size) {
+			unsigned int x = pick >> 8 & 15;
+			unsigned int address = PROGRAM_MEMORY_SECTOR + i + 4;
+			unsigned short int block[5] = {0x6000 | x << 8 | (pick >> 16 & 0xff), (pick & 64 ? 0xf018 : 0xf015) | x << 8};
+			unsigned int length = 3;
+			switch (pick >> 12 & 3) {
+				case 0: block[2] = 0x1000 | address; break;
+				case 1: block[2] = 0xf00a | x << 8; break;
+				default:
+					block[2] = 0xf007 | x << 8;
+					block[3] = 0x3000 | x << 8 | (pick >> 24 & 3);
+					block[4] = 0x1000 | address;
+					length = 5;
+			}
+			for (unsigned int j = 0; j < length; j++) {
+				rom->program[i + 2 * j] = block[j] >> 8;
+				rom->program[i + 2 * j + 1] = block[j];
+			}
+			i += 2 * (length - 1);
+			continue;
+		}
+		if ((pick & 63) == 1 && i + 14 <= rom->size) {
+			unsigned int x = pick >> 8 & 15;
+			unsigned int r = pick >> 12 & 15;
+			unsigned short int block[7] = {0xa000 | 0xf00 | (pick >> 16 & 0xff), 0x6000 | x << 8 | (pick >> 24 & 0xff)};
+			unsigned int steps = 1 + (pick >> 6 & 3);
+			for (unsigned int j = 0; j < steps; j++) {
+				block[2 + j] = 0xf01e | x << 8;
+			}
+			switch (value >> 12 & 3) {
+				case 0: block[2 + steps] = 0xf055 | r << 8; break;
+				case 1: block[2 + steps] = 0xf065 | r << 8; break;
+				case 2: block[2 + steps] = 0xf033 | r << 8; break;
+				default: block[2 + steps] = 0xd000 | r << 8 | (value & 0xff);
+			}
+			unsigned int length = 3 + steps;
+			for (unsigned int j = 0; j < length; j++) {
+				rom->program[i + 2 * j] = block[j] >> 8;
+				rom->program[i + 2 * j + 1] = block[j];
+			}
+			i += 2 * (length - 1);
+			continue;
+		}
+		switch (opcode >> 12) {
+			case 0x0: opcode = pick & 1 ? 0x00e0 : 0x00ee; break;
+			case 0x5: case 0x9: opcode &= 0xfff0; break;
+			case 0x8: opcode = (opcode & 0xfff0) | arithmetic[pick % sizeof(arithmetic)]; break;
+			case 0xe: opcode = (opcode & 0xff00) | (pick & 1 ? 0x9e : 0xa1); break;
+			case 0xf: opcode = (opcode & 0xff00) | misc[pick % sizeof(misc)]; break;
+		}
+		rom->program[i] = opcode >> 8;
+		rom->program[i + 1] = opcode;
+	}
+}
+
+static void close_run(CheckRun * run) {
+	for (unsigned int i = 0; i < CHECK_LANES; i++) {
+		if (run->reference[i]) chip8_destroy(run->reference[i]);
+	}
+	if (run->candidate) chip8_destroy(run->candidate);
+	if (run->lockstep) chip8_lockstep_destroy(run->lockstep);
+	memset(run, 0, sizeof(*run));
+}
+
+static Chip8 * candidate_lane(CheckRun * run, unsigned int lane) {
+	return run->lockstep ? chip8_lockstep_lane(run->lockstep, lane) : run->candidate;
+}
+
+static void setup_lane(Chip8 * chip8, const CheckOptions * options, const CheckJob * job, unsigned long long int seed) {
+	Machine * machine = chip8_machine(chip8);
+	if (options->programName) {
+		memcpy(machine->ram.mem + NAME_MEMORY_SECTOR, options->programName, options->programNameSize);
+	}
+	machine->instructionRate = options->instructionRate;
+	machine->quirks = job->quirks;
+	chip8_seed(chip8, seed);
+}
+
+// Returns 3 when out of memory.
+static int open_run(CheckRun * run, const CheckOptions * options, const CheckJob * job, const CheckRom * rom) {
+	memset(run, 0, sizeof(*run));
+	run->lanes = job->candidate == CHECK_LOCKSTEP ? CHECK_LANES : 1;
+	run->seed = options->seed ^ (unsigned long long int)job->quirks << 32;
+
+	for (unsigned int i = 0; i < run->lanes; i++) {
+		run->reference[i] = chip8_create();
+		if (run->reference[i] == 0 || chip8_load(run->reference[i], rom->program, rom->size)) {
+			close_run(run);
+			return 3;
+		}
+		chip8_set_engine(run->reference[i], ENGINE_SWITCH);
+		// the reference runs every instruction, the candidates fast forward idle loops
+		chip8_set_fast_forward(run->reference[i], 0);
+		setup_lane(run->reference[i], options, job, run->seed + i);
+	}
+
+	if (job->candidate == CHECK_LOCKSTEP) {
+		run->lockstep = chip8_lockstep_create(run->lanes);
+		if (run->lockstep == 0 || chip8_lockstep_load(run->lockstep, rom->program, rom->size)) {
+			close_run(run);
+			return 3;
+		}
+		for (unsigned int i = 0; i < run->lanes; i++) {
+			setup_lane(chip8_lockstep_lane(run->lockstep, i), options, job, run->seed + i);
+		}
+		chip8_lockstep_memory_changed(run->lockstep);
+	} else {
+		run->candidate = chip8_create();
+		if (run->candidate == 0 || chip8_load(run->candidate, rom->program, rom->size)) {
+			close_run(run);
+			return 3;
+		}
+		chip8_set_engine(run->candidate, job->candidate == CHECK_JIT ? ENGINE_JIT : ENGINE_THREADED);
+		setup_lane(run->candidate, options, job, run->seed);
+	}
+	return 0;
+}
+
+// Roughly one period in four holds a single key down.
+static void apply_keys(CheckRun * run, unsigned int period) {
+	for (unsigned int i = 0; i < run->lanes; i++) {
+		unsigned long long int state = run->seed + i + (unsigned long long int)period * 0x100000001ULL;
+		unsigned long long int value = check_random(&state);
+		unsigned short int keys = value & 3 ? 0 : 1 << (value >> 8 & 15);
+		chip8_set_keys(run->reference[i], keys);
+		chip8_set_keys(candidate_lane(run, i), keys);
+	}
+}
+
+static int run_halted(CheckRun * run) {
+	for (unsigned int i = 0; i < run->lanes; i++) {
+		if (!chip8_machine(run->reference[i])->halted) return 0;
+	}
+	return 1;
+}
+
+static const char * compare_machines(const Machine * reference, const Machine * candidate) {
+	if (reference->pc != candidate->pc) return "pc";
+	if (reference->regI != candidate->regI) return "I";
+	if (memcmp(&reference->registers, &candidate->registers, sizeof(reference->registers))) return "registers";
+	if (memcmp(&reference->stack, &candidate->stack, sizeof(reference->stack))) return "stack";
+	if (reference->delayTimer != candidate->delayTimer || reference->soundTimer != candidate->soundTimer) return "timers";
+	if (reference->timerPhase != candidate->timerPhase) return "timer phase";
+	if (memcmp(&reference->ram, &candidate->ram, sizeof(reference->ram))) return "ram";
+	if (memcmp(&reference->screen, &candidate->screen, sizeof(reference->screen))) return "screen";
+	if (memcmp(reference->randomState, candidate->randomState, sizeof(reference->randomState))) return "random state";
+	if (reference->keyBuffer != candidate->keyBuffer) return "key buffer";
+	if (reference->cycles != candidate->cycles) return "cycles";
+	if (reference->halted != candidate->halted || strcmp(reference->error, candidate->error)) return "error";
+	return 0;
+}
+
+static const char * compare_run(CheckRun * run, unsigned int * lane) {
+	for (unsigned int i = 0; i < run->lanes; i++) {
+		const char * field = compare_machines(chip8_machine(run->reference[i]), chip8_machine(candidate_lane(run, i)));
+		if (field) {
+			*lane = i;
+			return field;
+		}
+	}
+	return 0;
+}
+
+// Runs from *position to end, comparing every interval instructions and at end. On a
+// divergence returns the field that differs and leaves *position at the comparison that
+// caught it and *agreed at the one before.
+static const char * advance(CheckRun * run, unsigned int * position, unsigned int * agreed, unsigned int end, unsigned int interval, unsigned int * lane) {
+	while (*position < end && !run_halted(run)) {
+		if (*position % CHECK_KEY_PERIOD == 0) apply_keys(run, *position / CHECK_KEY_PERIOD);
+		unsigned int count = interval - *position % interval;
+		unsigned int untilKeys = CHECK_KEY_PERIOD - *position % CHECK_KEY_PERIOD;
+		if (untilKeys < count) count = untilKeys;
+		if (end - *position < count) count = end - *position;
+
+		for (unsigned int i = 0; i < run->lanes; i++) {
+			chip8_step(run->reference[i], count);
+		}
+		if (run->lockstep) chip8_lockstep_step(run->lockstep, count);
+		else chip8_step(run->candidate, count);
+		*position += count;
+
+		if (*position % interval == 0 || *position == end) {
+			const char * field = compare_run(run, lane);
+			if (field) return field;
+			*agreed = *position;
+		}
+	}
+	return compare_run(run, lane);
+}
+
+static void print_machine(FILE * file, const char * label, const Machine * machine) {
+	fprintf(file, "%-10s pc=0x%.4x I=0x%.4x sp=%u DT=%.2x ST=%.2x cycles=%u key=%d halted=%u V=", label, machine->pc, machine->regI,
+			machine->stack.sp, machine->delayTimer, machine->soundTimer, machine->cycles, machine->keyBuffer, machine->halted);
+	for (int r = 0; r < REGISTER_COUNT; r++) {
+		fprintf(file, "%.2x", machine->registers.reg[r]);
+	}
+	fputc('\n', file);
+	if (*machine->error) fprintf(file, "%-10s error: %s\n", "", machine->error);
+}
+
+static void print_difference(FILE * file, const Machine * reference, const Machine * candidate) {
+	for (unsigned int i = 0; i < MEMORY_LIMIT; i++) {
+		if (reference->ram.mem[i] != candidate->ram.mem[i]) {
+			fprintf(file, "first ram difference at 0x%.3x: reference %.2x, candidate %.2x\n", i, reference->ram.mem[i], candidate->ram.mem[i]);
+			break;
+		}
+	}
+	for (unsigned int y = 0; y < SCREEN_HEIGHT; y++) {
+		if (reference->screen.rows[y] != candidate->screen.rows[y]) {
+			fprintf(file, "first screen difference on row %u: reference %.16llx, candidate %.16llx\n", y,
+					(unsigned long long int)reference->screen.rows[y], (unsigned long long int)candidate->screen.rows[y]);
+			break;
+		}
+	}
+	for (unsigned int i = 0; i < STACK_LIMIT; i++) {
+		if (reference->stack.mem[i] != candidate->stack.mem[i]) {
+			fprintf(file, "first stack difference at %u: reference %.4x, candidate %.4x\n", i, reference->stack.mem[i], candidate->stack.mem[i]);
+			break;
+		}
+	}
+}
+
+// Replays the job from the start on fresh instances up to the last agreeing comparison,
+// then one instruction at a time until the machines part.
+static void report_divergence(const CheckOptions * options, const CheckJob * job, const CheckRom * rom, unsigned int agreed, unsigned int caught, const char * field, unsigned int lane) {
+	fprintf(stderr, "DIVERGED %s, profile %s (0x%.2x), %s engine, lane %u: %s differs between instructions %u and %u\n", rom->name,
+			chip8_profile_name(job->quirks), job->quirks, candidateNames[job->candidate], lane, field, agreed, caught);
+
+	CheckRun replay;
+	if (open_run(&replay, options, job, rom)) {
+		perror("Cannot allocate the replay");
+		return;
+	}
+	unsigned int position = 0;
+	unsigned int replayAgreed = 0;
+	unsigned int replayLane = 0;
+	const char * replayField = advance(&replay, &position, &replayAgreed, agreed, options->interval, &replayLane);
+	if (replayField == 0) {
+		replayField = advance(&replay, &position, &replayAgreed, caught, 1, &replayLane);
+	}
+
+	if (replayField == 0) {
+		// stepping one at a time hides it, show the machines as the check caught them
+		fprintf(stderr, "the divergence only shows when running %u instructions at a time\n", options->interval);
+		close_run(&replay);
+		if (open_run(&replay, options, job, rom)) {
+			perror("Cannot allocate the replay");
+			return;
+		}
+		position = 0;
+		advance(&replay, &position, &replayAgreed, caught, options->interval, &replayLane);
+	} else {
+		fprintf(stderr, "first differing instruction: %u (%s)\n", position, replayField);
+	}
+	const Machine * reference = chip8_machine(replay.reference[replayLane]);
+	const Machine * candidate = chip8_machine(candidate_lane(&replay, replayLane));
+	print_machine(stderr, "reference", reference);
+	print_machine(stderr, "candidate", candidate);
+	print_difference(stderr, reference, candidate);
+	fprintf(stderr, "last %u instructions on the reference:\n", options->window);
+	chip8_dump_trace(replay.reference[replayLane], stderr, options->window);
+	if (rom->name[0] == 'r' && strncmp(rom->name, "random-", 7) == 0) {
+		fprintf(stderr, "rerun with --seed 0x%llx to reproduce %s\n", options->seed, rom->name);
+	}
+	close_run(&replay);
+}
+
+static void * check_worker(void * argument) {
+	CheckPool * pool = argument;
+	const CheckOptions * options = pool->options;
+	while (!atomic_load(&pool->diverged)) {
+		unsigned int index = atomic_fetch_add(&pool->next, 1);
+		if (index >= pool->jobCount) break;
+		const CheckJob * job = &pool->jobs[index];
+		const CheckRom * rom = &pool->roms[job->rom];
+
+		CheckRun run;
+		if (open_run(&run, options, job, rom)) {
+			perror("Cannot allocate a check run");
+			atomic_store(&pool->diverged, 3);
+			break;
+		}
+		unsigned int position = 0;
+		unsigned int agreed = 0;
+		unsigned int lane = 0;
+		const char * field = advance(&run, &position, &agreed, options->cycles, options->interval, &lane);
+		for (unsigned int i = 0; i < run.lanes; i++) {
+			atomic_fetch_add(&pool->instructions, chip8_machine(run.reference[i])->cycles);
+		}
+		close_run(&run);
+
+		int first = 0;
+		if (field && atomic_compare_exchange_strong(&pool->diverged, &first, CHECK_DIVERGED)) {
+			pthread_mutex_lock(&pool->reportLock);
+			report_divergence(options, job, rom, agreed, position, field, lane);
+			pthread_mutex_unlock(&pool->reportLock);
+		}
+	}
+	return 0;
+}
+
+static int is_rom(const struct dirent * entry) {
+	size_t size = strlen(entry->d_name);
+	size_t extensionSize = sizeof(CHECK_ROM_EXTENSION) - 1;
+	return size > extensionSize && strcmp(entry->d_name + size - extensionSize, CHECK_ROM_EXTENSION) == 0;
+}
+
+static int load_roms(CheckRom ** roms, unsigned int * count, const CheckOptions * options) {
+	struct dirent ** entries = 0;
+	int fileCount = 0;
+	if (options->source) {
+		fileCount = scandir(options->source, &entries, is_rom, alphasort);
+		if (fileCount < 0) {
+			perror("Could not open check directory");
+			return 1;
+		}
+	}
+
+	*count = fileCount + options->randomCount;
+	*roms = calloc(*count ? *count : 1, sizeof(CheckRom));
+	int result = *roms == 0 ? 3 : 0;
+	for (int i = 0; i < fileCount; i++) {
+		if (result == 0) {
+			CheckRom * rom = &(*roms)[i];
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", options->source, entries[i]->d_name);
+			snprintf(rom->name, sizeof(rom->name), "%s", entries[i]->d_name);
+			FILE * programFile = fopen(path, "rb");
+			if (programFile == 0) {
+				perror("Could not read program file");
+				result = 4;
+			} else {
+				rom->size = fread(rom->program, 1, sizeof(rom->program), programFile);
+				fclose(programFile);
+			}
+		}
+		free(entries[i]);
+	}
+	free(entries);
+	if (result == 0) {
+		for (unsigned int i = 0; i < options->randomCount; i++) {
+			generate_rom(&(*roms)[fileCount + i], options->seed, i);
+		}
+	}
+	return result;
+}
+
+// Records frames in which every word of the machine changes, the most a delta or keyframe
+// can hold, then rewinds them one at a time and compares each with the machine as recorded.
+// Returns 0 when every frame comes back byte for byte, 3 when out of memory and
+// CHECK_DIVERGED otherwise.
+static int check_rewind(const CheckOptions * options) {
+	static const unsigned char program[] = {0x12, 0x00};
+	Machine * history = malloc(CHECK_REWIND_FRAMES * sizeof(Machine));
+	Chip8 * chip8 = chip8_create();
+	// room for a delta and a keyframe per frame, so no frame is dropped
+	size_t budget = 2 * CHECK_REWIND_FRAMES * (2 * sizeof(Machine) + 8);
+	if (history == 0 || chip8 == 0 || chip8_load(chip8, program, sizeof(program)) || chip8_rewind_enable(chip8, budget, CHECK_REWIND_KEYFRAME_INTERVAL)) {
+		perror("Cannot allocate the rewind check");
+		if (chip8) chip8_destroy(chip8);
+		free(history);
+		return 3;
+	}
+
+	Machine * machine = chip8_machine(chip8);
+	unsigned char * bytes = (unsigned char *)machine;
+	unsigned long long int state = options->seed;
+	for (unsigned int f = 0; f < CHECK_REWIND_FRAMES; f++) {
+		for (size_t i = 0; i + 8 <= sizeof(Machine); i += 8) {
+			unsigned long long int word;
+			memcpy(&word, bytes + i, 8);
+			word ^= check_random(&state) | 1;
+			memcpy(bytes + i, &word, 8);
+		}
+		memcpy(&history[f], machine, sizeof(Machine));
+		chip8_rewind_record(chip8);
+	}
+
+	int result = 0;
+	RewindStats stats;
+	chip8_rewind_stats(chip8, &stats);
+	if (stats.frames != CHECK_REWIND_FRAMES) {
+		fprintf(stderr, "check: rewind kept %u of %u frames\n", stats.frames, CHECK_REWIND_FRAMES);
+		result = CHECK_DIVERGED;
+	}
+	for (unsigned int f = CHECK_REWIND_FRAMES - 1; !result && f-- > 0;) {
+		if (chip8_rewind(chip8, 1) != 1 || memcmp(machine, &history[f], sizeof(Machine))) {
+			fprintf(stderr, "check: rewinding to frame %u of %u does not restore the machine\n", f, CHECK_REWIND_FRAMES);
+			result = CHECK_DIVERGED;
+		}
+	}
+
+	chip8_destroy(chip8);
+	free(history);
+	return result;
+}
+
+int run_check(const CheckOptions * options) {
+	CheckRom * roms;
+	unsigned int romCount;
+	int result = load_roms(&roms, &romCount, options);
+	if (result) {
+		if (result == 3) perror("Cannot allocate the check ROMs");
+		free(roms);
+		return result;
+	}
+
+	// ROMs of the directory under every profile, random ROMs under one each
+	unsigned int randomStart = romCount - options->randomCount;
+	unsigned int candidateCount = options->candidate == CHECK_ALL ? CHECK_ALL : 1;
+	unsigned int profileCount = options->profile >= 0 ? 1 : QUIRK_PROFILE_COUNT;
+	unsigned int jobCount = (randomStart * profileCount + options->randomCount) * candidateCount;
+	CheckJob * jobs = calloc(jobCount ? jobCount : 1, sizeof(CheckJob));
+	if (jobs == 0) {
+		perror("Cannot allocate the check jobs");
+		free(roms);
+		return 3;
+	}
+	unsigned int count = 0;
+	for (unsigned int r = 0; r < romCount; r++) {
+		unsigned int profiles = r < randomStart ? profileCount : 1;
+		for (unsigned int p = 0; p < profiles; p++) {
+			for (unsigned int c = 0; c < candidateCount; c++) {
+				CheckJob * job = &jobs[count++];
+				job->rom = r;
+				if (options->profile >= 0) job->quirks = options->profile;
+				else job->quirks = r < randomStart ? p : (r - randomStart) % QUIRK_PROFILE_COUNT;
+				job->candidate = options->candidate == CHECK_ALL ? (int)c : options->candidate;
+			}
+		}
+	}
+
+	unsigned int workerCount = options->threads;
+	if (workerCount == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		workerCount = cores > 0 ? cores : 1;
+	}
+	if (workerCount > jobCount) workerCount = jobCount ? jobCount : 1;
+	pthread_t * threads = calloc(workerCount, sizeof(pthread_t));
+
+	CheckPool pool = {.options = options, .roms = roms, .jobs = jobs, .jobCount = jobCount};
+	atomic_init(&pool.next, 0);
+	atomic_init(&pool.diverged, 0);
+	atomic_init(&pool.instructions, 0);
+	pthread_mutex_init(&pool.reportLock, 0);
+
+	double start = check_seconds();
+	unsigned int started = 0;
+	for (unsigned int i = 0; threads && i < workerCount; i++) {
+		if (pthread_create(&threads[i], 0, check_worker, &pool)) break;
+		started++;
+	}
+	if (started == 0) {
+		check_worker(&pool);
+	}
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(threads[i], 0);
+	}
+	double wallTime = check_seconds() - start;
+
+	result = atomic_load(&pool.diverged);
+	if (result == 0) result = check_rewind(options);
+	unsigned long long int instructions = atomic_load(&pool.instructions);
+	fprintf(stderr, "check: %u runs over %u ROMs, %llu reference instructions compared every %u in %.2lfs (%.0lf per second), %s\n", jobCount,
+			romCount, instructions, options->interval, wallTime, wallTime > 0 ? instructions / wallTime : 0, result ? "FAILED" : "no divergence");
+
+	pthread_mutex_destroy(&pool.reportLock);
+	free(threads);
+	free(jobs);
+	free(roms);
+	return result;
+}
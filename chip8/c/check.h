@@ -0,0 +1,39 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "chip8.h"
+
+// Check mode: runs every ROM on the switch interpreter, without fast forwarding, and on a
+// candidate engine side by side, with the same seeds and key presses, and compares the whole
+// machines every interval instructions. The first divergence is narrowed down to the
+// instruction that caused it and reported with the reference trace leading up to it.
+// Once the engines agree, rewind is checked on frames that change the whole machine.
+
+enum {
+	CHECK_THREADED,
+	CHECK_JIT,
+	CHECK_LOCKSTEP,
+	CHECK_ALL
+};
+
+typedef struct {
+	// directory of *.ch8 files, may be 0 when only random ROMs are checked
+	const char * source;
+	unsigned int randomCount;
+	int candidate;
+	// -1 checks the ROMs of the directory under every quirk profile
+	int profile;
+	unsigned int interval;
+	unsigned int cycles;
+	unsigned int instructionRate;
+	unsigned int threads;
+	unsigned int window;
+	unsigned long long int seed;
+	const char * programName;
+	size_t programNameSize;
+} CheckOptions;
+
+// Returns 0 when every candidate matched the reference and 9 on the first divergence.
+int run_check(const CheckOptions * options);
+
+#endif
@@ -0,0 +1,2906 @@
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chip8.h"
+
+// Configuration Settings
+// Quirks used when neither the client nor the ROM table picks a profile
+#define SUPER_CHIP_SHIFT_CONFIGURATION 1
+#define SUPER_CHIP_JUMP_CONFIGURATION 1
+#define AMIGA_INDEX_OVERFLOW_CONFIGURATION 1
+#define COSMAC_INDEX_INCREMENT_CONFIGURATION 0
+#define COSMAC_VF_RESET_CONFIGURATION 0
+
+#define DEFAULT_QUIRKS ( \
+	(SUPER_CHIP_SHIFT_CONFIGURATION ? QUIRK_SUPER_CHIP_SHIFT : 0) | \
+	(SUPER_CHIP_JUMP_CONFIGURATION ? QUIRK_SUPER_CHIP_JUMP : 0) | \
+	(AMIGA_INDEX_OVERFLOW_CONFIGURATION ? QUIRK_AMIGA_INDEX_OVERFLOW : 0) | \
+	(COSMAC_INDEX_INCREMENT_CONFIGURATION ? QUIRK_COSMAC_INDEX_INCREMENT : 0) | \
+	(COSMAC_VF_RESET_CONFIGURATION ? QUIRK_COSMAC_VF_RESET : 0))
+
+static const unsigned char font[] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+};
+
+static void initialize_font_memory(Machine * machine, const unsigned char * font_start, ssize_t size) {
+	void * dest = machine->ram.mem + FONT_MEMORY_SECTOR;
+	memcpy(dest, font_start, size);
+}
+
+static void seed_random(Machine * machine, unsigned long long int seed) {
+	// splitmix64 spreads any seed, 0 included, over the whole state
+	for (int i = 0; i < 4; i += 2) {
+		seed += 0x9e3779b97f4a7c15ULL;
+		unsigned long long int z = seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= z >> 31;
+		machine->randomState[i] = z;
+		machine->randomState[i + 1] = z >> 32;
+	}
+}
+
+static uint32_t rotate_left(uint32_t value, int amount) {
+	return (value << amount) | (value >> (32 - amount));
+}
+
+// xoshiro128**, one byte per CXNN from the top of the output
+static unsigned char next_random(Machine * machine) {
+	uint32_t * s = machine->randomState;
+	uint32_t result = rotate_left(s[1] * 5, 7) * 9;
+	uint32_t t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotate_left(s[3], 11);
+	return result >> 24;
+}
+
+static void initialize_machine(Machine * machine) {
+	*machine->error = 0;
+	machine->halted = 0;
+	machine->cycles = 0;
+	machine->instructionRate = DEFAULT_INSTRUCTION_RATE;
+	machine->timerPhase = 0;
+	machine->quirks = DEFAULT_QUIRKS;
+	machine->pc = PROGRAM_MEMORY_SECTOR;
+	machine->stack.sp = 0;
+	machine->delayTimer = 0;
+	machine->soundTimer = 0;
+	machine->keyBuffer = -1;
+
+	memset(machine->registers.reg, 0, REGISTER_COUNT);
+	seed_random(machine, DEFAULT_RANDOM_SEED);
+	memset(machine->ram.mem, 0, MEMORY_LIMIT);
+	memset(machine->screen.rows, 0xff, sizeof(machine->screen.rows));
+
+	initialize_font_memory(machine, font, sizeof(font) / sizeof(*font));
+}
+
+static void unsafe_write_machine_error(Machine * machine, const char * restrict format, ...) {
+	va_list args;
+	va_start(args, format);
+	vsprintf(machine->error, format, args);
+}
+
+static void vunsafe_write_machine_error(Machine * machine, const char * restrict format, va_list args) {
+	vsprintf(machine->error, format, args);
+}
+
+// a halted machine runs nothing more until it is restored from a save state
+static void fatal_unsafe_write_machine_error(Machine * machine, const char * restrict format, ...) {
+	if (machine->halted) return;
+	va_list args;
+	va_start(args, format);
+	vunsafe_write_machine_error(machine, format, args);
+	machine->halted = 1;
+}
+
+static void update_machine_time(Machine * machine) {
+    if (machine->delayTimer > 0) machine->delayTimer--;
+    if (machine->soundTimer > 0) machine->soundTimer--;
+}
+
+static void draw_sprite(Machine * machine, unsigned short int size, unsigned short int sprite, unsigned char x, unsigned char y) {
+	unsigned char px = x % SCREEN_WIDTH;
+	unsigned char py = y % SCREEN_HEIGHT;
+
+	machine->registers.reg[15] = 0;
+	for (int i = 0; i < size; i++) {
+		if (py + i > SCREEN_HEIGHT - 1) break;
+		// shifting right past the last column clips the sprite at the right edge
+		uint64_t spriteRow = ((uint64_t)machine->ram.mem[MEMORY_ADDRESS(sprite + i)] << 56) >> px;
+		uint64_t * row = &machine->screen.rows[py + i];
+		if ((*row & spriteRow) != 0) machine->registers.reg[15] = 1;
+		*row ^= spriteRow;
+	}
+	
+	machine->screen.rows[py] |= SCREEN_BIT(px);
+}
+
+// Every address a program can execute from gets a slot holding the decoded form of the
+// instruction starting there. Slots are decoded lazily and reset to INSTRUCTION_UNDECODED
+// whenever the bytes under them are written.
+enum {
+	INSTRUCTION_UNDECODED = 0,
+	INSTRUCTION_CLEAR,
+	INSTRUCTION_RETURN,
+	INSTRUCTION_EMPTY,
+	INSTRUCTION_IGNORED,
+	INSTRUCTION_JUMP,
+	INSTRUCTION_CALL,
+	INSTRUCTION_SKIP_EQUAL_IMMEDIATE,
+	INSTRUCTION_SKIP_NOT_EQUAL_IMMEDIATE,
+	INSTRUCTION_SKIP_EQUAL,
+	INSTRUCTION_LOAD_IMMEDIATE,
+	INSTRUCTION_ADD_IMMEDIATE,
+	INSTRUCTION_MOVE,
+	INSTRUCTION_OR,
+	INSTRUCTION_AND,
+	INSTRUCTION_XOR,
+	INSTRUCTION_ADD,
+	INSTRUCTION_SUBTRACT,
+	INSTRUCTION_SHIFT_RIGHT,
+	INSTRUCTION_SUBTRACT_REVERSE,
+	INSTRUCTION_SHIFT_LEFT,
+	INSTRUCTION_SKIP_NOT_EQUAL,
+	INSTRUCTION_LOAD_INDEX,
+	INSTRUCTION_JUMP_OFFSET,
+	INSTRUCTION_RANDOM,
+	INSTRUCTION_DRAW,
+	INSTRUCTION_SKIP_KEY,
+	INSTRUCTION_SKIP_NOT_KEY,
+	INSTRUCTION_LOAD_DELAY,
+	INSTRUCTION_SET_DELAY,
+	INSTRUCTION_SET_SOUND,
+	INSTRUCTION_ADD_INDEX,
+	INSTRUCTION_WAIT_KEY,
+	INSTRUCTION_FONT,
+	INSTRUCTION_DECIMAL,
+	INSTRUCTION_STORE,
+	INSTRUCTION_LOAD,
+	INSTRUCTION_UNKNOWN,
+	INSTRUCTION_KIND_COUNT
+};
+
+#define DECODE_CACHE_SIZE (MEMORY_LIMIT - PROGRAM_MEMORY_SECTOR)
+
+typedef struct {
+	unsigned char kind;
+	unsigned char x;
+	unsigned char y;
+	unsigned char n;
+	unsigned char nn;
+	unsigned short int nnn;
+} DecodedInstruction;
+
+typedef struct {
+	DecodedInstruction slots[DECODE_CACHE_SIZE];
+} DecodeCache;
+
+
+static void decode_instruction(DecodedInstruction * instruction, unsigned char p1, unsigned char p2) {
+	unsigned char op = (p1 & 240) >> 4;
+	instruction->x = p1 & 15;
+	instruction->y = (p2 & 240) >> 4;
+	instruction->n = p2 & 15;
+	instruction->nn = p2;
+	instruction->nnn = ((unsigned short int)(p1 & 15) << 8) + p2;
+
+	unsigned char kind = INSTRUCTION_UNKNOWN;
+	switch (op) {
+	case 0:
+		if (p2 == 0xe0) kind = INSTRUCTION_CLEAR;
+		else if (p2 == 0xee) kind = INSTRUCTION_RETURN;
+		else if (p1 + p2 == 0) kind = INSTRUCTION_EMPTY;
+		else kind = INSTRUCTION_IGNORED;
+		break;
+	case 1: kind = INSTRUCTION_JUMP; break;
+	case 2: kind = INSTRUCTION_CALL; break;
+	case 3: kind = INSTRUCTION_SKIP_EQUAL_IMMEDIATE; break;
+	case 4: kind = INSTRUCTION_SKIP_NOT_EQUAL_IMMEDIATE; break;
+	case 5: kind = INSTRUCTION_SKIP_EQUAL; break;
+	case 6: kind = INSTRUCTION_LOAD_IMMEDIATE; break;
+	case 7: kind = INSTRUCTION_ADD_IMMEDIATE; break;
+	case 8:
+		switch (p2 & 15) {
+		case 0: kind = INSTRUCTION_MOVE; break;
+		case 1: kind = INSTRUCTION_OR; break;
+		case 2: kind = INSTRUCTION_AND; break;
+		case 3: kind = INSTRUCTION_XOR; break;
+		case 4: kind = INSTRUCTION_ADD; break;
+		case 5: kind = INSTRUCTION_SUBTRACT; break;
+		case 6: kind = INSTRUCTION_SHIFT_RIGHT; break;
+		case 7: kind = INSTRUCTION_SUBTRACT_REVERSE; break;
+		case 14: kind = INSTRUCTION_SHIFT_LEFT; break;
+		}
+		break;
+	case 9: kind = INSTRUCTION_SKIP_NOT_EQUAL; break;
+	case 10: kind = INSTRUCTION_LOAD_INDEX; break;
+	case 11: kind = INSTRUCTION_JUMP_OFFSET; break;
+	case 12: kind = INSTRUCTION_RANDOM; break;
+	case 13: kind = INSTRUCTION_DRAW; break;
+	case 14:
+		if (p2 == 0x9e) kind = INSTRUCTION_SKIP_KEY;
+		else if (p2 == 0xa1) kind = INSTRUCTION_SKIP_NOT_KEY;
+		break;
+	case 15:
+		switch (p2) {
+		case 0x07: kind = INSTRUCTION_LOAD_DELAY; break;
+		case 0x15: kind = INSTRUCTION_SET_DELAY; break;
+		case 0x18: kind = INSTRUCTION_SET_SOUND; break;
+		case 0x1e: kind = INSTRUCTION_ADD_INDEX; break;
+		case 0x0a: kind = INSTRUCTION_WAIT_KEY; break;
+		case 0x29: kind = INSTRUCTION_FONT; break;
+		case 0x33: kind = INSTRUCTION_DECIMAL; break;
+		case 0x55: kind = INSTRUCTION_STORE; break;
+		case 0x65: kind = INSTRUCTION_LOAD; break;
+		}
+		break;
+	}
+	instruction->kind = kind;
+}
+
+// The interpreters append a fixed-size record per instruction, holding the state it ran
+// against. Nothing is formatted until the stat pane is drawn or the trace is dumped; the
+// registers an instruction changed are found by comparing with the record after it.
+#define TRACE_LENGTH 1024
+
+typedef struct {
+	TraceRecord records[TRACE_LENGTH];
+	unsigned int next;
+} TraceBuffer;
+
+_Static_assert(offsetof(Machine, halted) < CACHE_LINE_SIZE, "the CPU state must fit in the first cache line of a machine");
+
+// Everything an instance owns. The machine comes first so a Machine * handed to the jit
+// is also the start of its instance, and instances start on a cache line.
+struct Chip8 {
+	Machine machine;
+	int engine;
+	DecodeCache decodeCache;
+	TraceBuffer trace;
+	struct JitState * jit;
+	// memory as the program was loaded, save states only keep what differs from it
+	RandomAccessMemory image;
+	unsigned long long int imageHash;
+	struct RewindBuffer * rewind;
+	struct Profile * profile;
+	int fastForward;
+};
+
+static void jit_flush(struct JitState * jit);
+static void jit_invalidate(struct JitState * jit, unsigned int address, unsigned int size);
+static void jit_destroy(struct JitState * jit);
+static void rewind_free(struct RewindBuffer * rewind);
+static void rewind_clear(struct RewindBuffer * rewind);
+
+static void clear_code_caches(Chip8 * chip8) {
+	memset(chip8->decodeCache.slots, 0, sizeof(chip8->decodeCache.slots));
+	jit_flush(chip8->jit);
+}
+
+// an instruction starting one byte before a write overlaps it too
+// Any I may be passed. The part of a write that wraps past the end of RAM lands below the
+// program, where nothing is cached.
+static void invalidate_code(Chip8 * chip8, unsigned int address, unsigned int size) {
+	address = MEMORY_ADDRESS(address);
+	unsigned int start = address > PROGRAM_MEMORY_SECTOR ? address - 1 : PROGRAM_MEMORY_SECTOR;
+	unsigned int end = address + size < MEMORY_LIMIT ? address + size : MEMORY_LIMIT;
+	for (unsigned int i = start; i < end; i++) {
+		chip8->decodeCache.slots[i - PROGRAM_MEMORY_SECTOR].kind = INSTRUCTION_UNDECODED;
+	}
+	jit_invalidate(chip8->jit, start, end > start ? end - start : 0);
+}
+
+static void trace_instruction(Chip8 * chip8, unsigned short int pc, unsigned int cycle) {
+	Machine * machine = &chip8->machine;
+	TraceRecord * record = &chip8->trace.records[chip8->trace.next++ & (TRACE_LENGTH - 1)];
+	record->cycle = cycle;
+	record->pc = pc;
+	// pc is traced before anything checks it is inside RAM
+	record->opcode = (machine->ram.mem[MEMORY_ADDRESS(pc)] << 8) | machine->ram.mem[MEMORY_ADDRESS(pc + 1)];
+	record->regI = machine->regI;
+	memcpy(record->registers, machine->registers.reg, REGISTER_COUNT);
+}
+
+const TraceRecord * chip8_latest_trace_record(const Chip8 * chip8) {
+	const TraceBuffer * trace = &chip8->trace;
+	if (trace->next == 0) return 0;
+	return &trace->records[(trace->next - 1) & (TRACE_LENGTH - 1)];
+}
+
+void chip8_describe_trace_record(const TraceRecord * record, char * text) {
+	unsigned char p1 = record->opcode >> 8;
+	unsigned char p2 = record->opcode & 255;
+	unsigned char x = p1 & 15;
+	unsigned char y = (p2 & 240) >> 4;
+
+	sprintf(text, "(%.2x%.2x @ %.4x)  %.1x(%.1x,%.1x) 0=%.2x 1=%.2x | 0x%.4x 0x%.4x 0x%.4x", p1, p2, record->pc, (p1 & 240) >> 4, x, y,
+			record->registers[x], record->registers[y], p2 & 15, p2, ((p1 & 15) << 8) + p2);
+}
+
+// prints the newest records, oldest first; limit 0 dumps the whole buffer
+void chip8_dump_trace(const Chip8 * chip8, FILE * file, unsigned int limit) {
+	const Machine * machine = &chip8->machine;
+	const TraceBuffer * trace = &chip8->trace;
+	unsigned int count = trace->next < TRACE_LENGTH ? trace->next : TRACE_LENGTH;
+	if (limit && limit < count) count = limit;
+
+	char text[MAX_STAT_WIDTH];
+	for (unsigned int i = trace->next - count; i != trace->next; i++) {
+		const TraceRecord * record = &trace->records[i & (TRACE_LENGTH - 1)];
+		const unsigned char * after = 0;
+		if (i + 1 != trace->next) {
+			const TraceRecord * next = &trace->records[(i + 1) & (TRACE_LENGTH - 1)];
+			if (next->cycle == record->cycle + 1) after = next->registers;
+		} else if (machine->cycles == record->cycle) {
+			after = machine->registers.reg;
+		}
+
+		chip8_describe_trace_record(record, text);
+		fprintf(file, "%10u  %s  I=0x%.4x", record->cycle, text, record->regI);
+		if (after) {
+			for (int r = 0; r < REGISTER_COUNT; r++) {
+				if (after[r] != record->registers[r]) fprintf(file, " V%X=%.2x", r, after[r]);
+			}
+		} else {
+			// the jit does not trace the instructions it runs natively
+			fprintf(file, " (untraced instructions follow)");
+		}
+		fputc('\n', file);
+	}
+}
+
+int chip8_dump_trace_file(const Chip8 * chip8, const char * path) {
+	FILE * traceFile = fopen(path, "w");
+	if (traceFile == 0) {
+		return 1;
+	}
+	chip8_dump_trace(chip8, traceFile, 0);
+	fclose(traceFile);
+	return 0;
+}
+
+static void execute_instruction(Chip8 * chip8) {
+	Machine * machine = &chip8->machine;
+	// every engine hands a pc outside RAM to this function
+	if (machine->pc >= MEMORY_LIMIT - 1) {
+		fatal_unsafe_write_machine_error(machine, "Error: program counter 0x%.4x is outside memory", machine->pc);
+		return;
+	}
+	unsigned char p1 = machine->ram.mem[machine->pc];
+	unsigned char p2 = machine->ram.mem[machine->pc + 1];
+
+	unsigned char op   = (p1 & 240) >> 4;
+	unsigned char x = p1 & 15;
+	unsigned char y = (p2 & 240) >> 4;
+	unsigned char reg1 = machine->registers.reg[x];
+	unsigned char reg2 = machine->registers.reg[y];
+
+	unsigned short int num  = p2 & 15;
+	unsigned short int nnum  = p2;
+	
+	unsigned short int nnnum  = ((unsigned short int)(p1 & 15)  << 8) + p2;
+	
+	switch(op) {
+	case 0:
+		if (p2 == 0xe0) {
+			memset(machine->screen.rows, 0, sizeof(machine->screen.rows));
+			break;
+		} else if (p2 == 0xee) {
+			if (machine->stack.sp == 0) {
+				fatal_unsafe_write_machine_error(machine, "Error: cannot return out of an empty stack");
+				return;
+			}
+			machine->stack.sp--;
+			machine->pc = machine->stack.mem[machine->stack.sp];
+			break;
+		} else if (p1 + p2 == 0) return; // stop executing empty space
+		
+		
+		unsafe_write_machine_error(machine, "Warning: ignored instruction 0x%.2x%2.2x", p1, p2);
+		break;
+	case 1:
+		machine->pc = nnnum;
+		return;
+	case 2:
+		if (machine->stack.sp >= STACK_LIMIT) {
+			fatal_unsafe_write_machine_error(machine, "Error: cannot call past a full stack");
+			return;
+		}
+		machine->stack.mem[machine->stack.sp] = machine->pc;
+		machine->stack.sp++;
+		machine->pc = nnnum;
+		return;
+	case 3:
+		if (reg1 == nnum) machine->pc += 2;
+		break;
+	case 4:
+		if (reg1 != nnum) machine->pc += 2;
+		break;
+	case 5:
+		if (reg1 == reg2) machine->pc += 2;
+		break;
+	case 6:
+			machine->registers.reg[x] = nnum;
+			break;
+	case 7:
+		machine->registers.reg[x] += nnum;
+		break;
+	case 8:
+		switch(num) {
+		case 0:
+			machine->registers.reg[x] = reg2;
+			break;
+		case 1:
+			machine->registers.reg[x] |= reg2;
+			if (machine->quirks & QUIRK_COSMAC_VF_RESET) machine->registers.reg[15] = 0;
+			break;
+		case 2:
+			machine->registers.reg[x] &= reg2;
+			if (machine->quirks & QUIRK_COSMAC_VF_RESET) machine->registers.reg[15] = 0;
+			break;
+		case 3:
+			machine->registers.reg[x] ^= reg2;
+			if (machine->quirks & QUIRK_COSMAC_VF_RESET) machine->registers.reg[15] = 0;
+			break;
+		case 4:
+			machine->registers.reg[x] = reg1 + reg2;
+			if (reg1 + reg2 > 255) machine->registers.reg[15] = 1;
+			else machine->registers.reg[15] = 0;
+			break;
+		case 5:
+			machine->registers.reg[x] = reg1 - reg2;
+			if (reg1 >= reg2) machine->registers.reg[15] = 1;
+			else machine->registers.reg[15] = 0;
+			break;
+		case 6:
+			if (!(machine->quirks & QUIRK_SUPER_CHIP_SHIFT)) {
+				machine->registers.reg[x] = reg2;
+				machine->registers.reg[x] >>= 1;
+				machine->registers.reg[15] = reg2 & 1;
+			} else {
+				machine->registers.reg[x] >>= 1;
+				machine->registers.reg[15] = reg1 & 1;
+			}
+			break;
+		case 7:
+			machine->registers.reg[x] = reg2 - reg1;
+			if (reg2 >= reg1) machine->registers.reg[15] = 1;
+			else machine->registers.reg[15] = 0;
+			break;
+		case 14:
+			if (!(machine->quirks & QUIRK_SUPER_CHIP_SHIFT)) {
+				machine->registers.reg[x] = reg2;
+				machine->registers.reg[x] <<= 1;
+				machine->registers.reg[15] = reg2 & 8;
+			} else {
+				machine->registers.reg[x] <<= 1;
+				machine->registers.reg[15] = (reg1 & 8) >> 3;
+			}
+			
+			break;
+		default:
+			fatal_unsafe_write_machine_error(machine, "Error: unknown instruction 0x%.2x%2.2x at address 0x%.4x", p1, p2, machine->pc);
+			return;
+		}
+		break;
+	case 9:
+		if (reg1 != reg2) machine->pc += 2;
+		break;
+	case 10:
+		machine->regI = nnnum;
+		break;
+	case 11:
+		if (machine->quirks & QUIRK_SUPER_CHIP_JUMP) {
+			machine->pc = nnnum + reg1;
+		} else {
+			machine->pc = nnnum + machine->registers.reg[0];
+		}
+		return;
+	case 12:
+		machine->registers.reg[x] = next_random(machine) & nnum;
+		break;
+	case 13:
+		draw_sprite(machine, num, machine->regI, reg1, reg2);
+		break;
+	case 14:
+		switch (nnum) {
+		case 0x9e:
+			if (machine->keyBuffer == (reg1 & 15)) {
+					machine->pc += 2;
+					machine->keyBuffer = -1;
+				}
+			break;
+		case 0xa1:
+			if (machine->keyBuffer != (reg1 & 15)) {
+				machine->pc += 2;
+				machine->keyBuffer = -1;
+			}
+			machine->keyBuffer = -1;
+			break;
+		default:
+			fatal_unsafe_write_machine_error(machine, "Error: unknown instruction 0x%.2x%2.2x at address 0x%.4x", p1, p2, machine->pc);
+			return;
+		}
+		break;
+	case 15:
+		switch (nnum) {
+		case 0x07:
+			machine->registers.reg[x] = machine->delayTimer;
+			break;
+		case 0x15:
+			machine->delayTimer = machine->registers.reg[x];
+			break;
+		case 0x18:
+			machine->soundTimer = machine->registers.reg[x];
+			break;
+		case 0x1e:
+			machine->regI += reg1;
+			if (machine->quirks & QUIRK_AMIGA_INDEX_OVERFLOW) {
+				if (machine->regI > 0x1000) {
+					machine->registers.reg[15] = 1;
+				} else machine->registers.reg[15] = 0;
+			}
+			break;
+		case 0x0a:
+			if (machine->keyBuffer > -1) {
+				machine->registers.reg[x] = machine->keyBuffer;
+				machine->keyBuffer = -1;
+			} else machine->pc -= 2;
+			break;
+		case 0x29:
+			machine->regI = FONT_MEMORY_SECTOR + (reg1 * 5);
+			break;
+		case 0x33:
+			machine->ram.mem[MEMORY_ADDRESS(machine->regI + 2)] = reg1 % 10;
+			machine->ram.mem[MEMORY_ADDRESS(machine->regI + 1)] = (reg1 / 10) % 10;
+			machine->ram.mem[MEMORY_ADDRESS(machine->regI)] = (reg1 / 100);
+			invalidate_code(chip8, machine->regI, 3);
+			break;
+		case 0x55:
+			for (int i = 0; i < x + 1; i++) {
+				machine->ram.mem[MEMORY_ADDRESS(machine->regI + i)] = machine->registers.reg[i];
+			}
+			invalidate_code(chip8, machine->regI, x + 1);
+			if (machine->quirks & QUIRK_COSMAC_INDEX_INCREMENT) {
+				machine->regI += x + 1;
+			}
+			break;
+		case 0x65:
+			for (int i = 0; i < x + 1; i++) {
+				machine->registers.reg[i] = machine->ram.mem[MEMORY_ADDRESS(machine->regI + i)];	
+			}
+			if (machine->quirks & QUIRK_COSMAC_INDEX_INCREMENT) {
+				machine->regI += x + 1;
+			}
+			break;
+		default:
+			fatal_unsafe_write_machine_error(machine, "Error: unknown instruction 0x%.2x%2.2x at address 0x%.4x", p1, p2, machine->pc);
+			return;
+		}
+		break;
+	default:
+		fatal_unsafe_write_machine_error(machine, "Error: unknown instruction 0x%.2x%2.2x at address 0x%.4x", p1, p2, machine->pc);
+		return;
+	}
+
+	machine->pc += 2;
+}
+
+#define RUN_DECODED_VARIANT(quirks) RUN_DECODED_VARIANT_NAME(quirks)
+#define RUN_DECODED_VARIANT_NAME(quirks) run_decoded_##quirks
+#define QUIRKS 0
+#include "run_decoded.h"
+#define QUIRKS 1
+#include "run_decoded.h"
+#define QUIRKS 2
+#include "run_decoded.h"
+#define QUIRKS 3
+#include "run_decoded.h"
+#define QUIRKS 4
+#include "run_decoded.h"
+#define QUIRKS 5
+#include "run_decoded.h"
+#define QUIRKS 6
+#include "run_decoded.h"
+#define QUIRKS 7
+#include "run_decoded.h"
+#define QUIRKS 8
+#include "run_decoded.h"
+#define QUIRKS 9
+#include "run_decoded.h"
+#define QUIRKS 10
+#include "run_decoded.h"
+#define QUIRKS 11
+#include "run_decoded.h"
+#define QUIRKS 12
+#include "run_decoded.h"
+#define QUIRKS 13
+#include "run_decoded.h"
+#define QUIRKS 14
+#include "run_decoded.h"
+#define QUIRKS 15
+#include "run_decoded.h"
+#define QUIRKS 16
+#include "run_decoded.h"
+#define QUIRKS 17
+#include "run_decoded.h"
+#define QUIRKS 18
+#include "run_decoded.h"
+#define QUIRKS 19
+#include "run_decoded.h"
+#define QUIRKS 20
+#include "run_decoded.h"
+#define QUIRKS 21
+#include "run_decoded.h"
+#define QUIRKS 22
+#include "run_decoded.h"
+#define QUIRKS 23
+#include "run_decoded.h"
+#define QUIRKS 24
+#include "run_decoded.h"
+#define QUIRKS 25
+#include "run_decoded.h"
+#define QUIRKS 26
+#include "run_decoded.h"
+#define QUIRKS 27
+#include "run_decoded.h"
+#define QUIRKS 28
+#include "run_decoded.h"
+#define QUIRKS 29
+#include "run_decoded.h"
+#define QUIRKS 30
+#include "run_decoded.h"
+#define QUIRKS 31
+#include "run_decoded.h"
+
+typedef unsigned int (*RunDecoded)(Chip8 * chip8, unsigned int count);
+
+static const RunDecoded runDecodedVariants[QUIRK_PROFILE_COUNT] = {
+	run_decoded_0, run_decoded_1, run_decoded_2, run_decoded_3, run_decoded_4, run_decoded_5, run_decoded_6, run_decoded_7,
+	run_decoded_8, run_decoded_9, run_decoded_10, run_decoded_11, run_decoded_12, run_decoded_13, run_decoded_14, run_decoded_15,
+	run_decoded_16, run_decoded_17, run_decoded_18, run_decoded_19, run_decoded_20, run_decoded_21, run_decoded_22, run_decoded_23,
+	run_decoded_24, run_decoded_25, run_decoded_26, run_decoded_27, run_decoded_28, run_decoded_29, run_decoded_30, run_decoded_31,
+};
+
+// picks the dispatch loop once per batch, never per instruction
+static unsigned int run_decoded(Chip8 * chip8, unsigned int count) {
+	return runDecodedVariants[chip8->machine.quirks](chip8, count);
+}
+
+#if defined(__x86_64__)
+// Dynamic recompiler: straight-line runs of ROM code are translated to x86-64 basic blocks,
+// ended by jumps, calls, returns and skips. Blocks run with rbx = Machine *, r12 = instructions
+// left to run, and touch machine state in place. A block charges its whole length up front and
+// bails back to run_jit when the budget cannot cover it, so a run stops on the exact instruction
+// the interpreters would. Everything else (DXYN, FX0A, memory writes...) is left to run_decoded.
+#define JIT_ARENA_SIZE (1 << 20)
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+#define JIT_MAX_BLOCK_BYTES 4096
+#define JIT_MAX_LINKS 4096
+#define JIT_PAGE_SHIFT 8
+
+enum {
+	JIT_UNCOMPILED = 0,
+	JIT_COMPILED,
+	JIT_INTERPRETED
+};
+
+typedef unsigned long long int (*JitEntry)(Machine * machine, unsigned long long int budget, const unsigned char * block);
+
+typedef struct {
+	unsigned char * site;
+	unsigned short int target;
+} JitLink;
+
+typedef struct JitState {
+	unsigned char * arena;
+	size_t used;
+	size_t blocksStart;
+	JitEntry enter;
+	unsigned char * epilogue;
+	unsigned char * code;
+	unsigned char state[MEMORY_LIMIT];
+	unsigned short int lengths[MEMORY_LIMIT];
+	unsigned char * entries[MEMORY_LIMIT];
+	unsigned char pages[MEMORY_LIMIT >> JIT_PAGE_SHIFT];
+	JitLink links[JIT_MAX_LINKS];
+	unsigned int linkCount;
+	unsigned char quirks;
+} JitState;
+
+
+#define JIT_REGISTER(x) ((int)offsetof(Machine, registers.reg) + (x))
+#define JIT_PC ((int)offsetof(Machine, pc))
+#define JIT_INDEX ((int)offsetof(Machine, regI))
+#define JIT_SP ((int)offsetof(Machine, stack.sp))
+#define JIT_STACK ((int)offsetof(Machine, stack.mem))
+#define JIT_DELAY ((int)offsetof(Machine, delayTimer))
+#define JIT_SOUND ((int)offsetof(Machine, soundTimer))
+
+// host registers by their encoding
+#define JIT_EAX 0
+#define JIT_ECX 1
+#define JIT_EDX 2
+
+static void jit_byte(JitState * jit, unsigned char byte) {
+	*jit->code++ = byte;
+}
+
+static void jit_bytes(JitState * jit, int size, ...) {
+	va_list args;
+	va_start(args, size);
+	for (int i = 0; i < size; i++) {
+		jit_byte(jit, va_arg(args, int));
+	}
+	va_end(args);
+}
+
+static void jit_u16(JitState * jit, unsigned short int value) {
+	memcpy(jit->code, &value, 2);
+	jit->code += 2;
+}
+
+static void jit_u32(JitState * jit, unsigned int value) {
+	memcpy(jit->code, &value, 4);
+	jit->code += 4;
+}
+
+// writes a rel32 at site that lands on target
+static void jit_patch(unsigned char * site, const unsigned char * target) {
+	int relative = (int)(target - (site + 4));
+	memcpy(site, &relative, 4);
+}
+
+// movzx r32, byte [rbx + offset]
+static void jit_load(JitState * jit, int reg, int offset) {
+	jit_bytes(jit, 3, 0x0f, 0xb6, 0x83 | (reg << 3));
+	jit_u32(jit, offset);
+}
+
+// mov byte [rbx + offset], r8
+static void jit_store(JitState * jit, int reg, int offset) {
+	jit_bytes(jit, 2, 0x88, 0x83 | (reg << 3));
+	jit_u32(jit, offset);
+}
+
+// mov byte [rbx + offset], imm8
+static void jit_store_immediate(JitState * jit, int offset, unsigned char value) {
+	jit_bytes(jit, 2, 0xc6, 0x83);
+	jit_u32(jit, offset);
+	jit_byte(jit, value);
+}
+
+// mov word [rbx + offset], imm16
+static void jit_store_immediate16(JitState * jit, int offset, unsigned short int value) {
+	jit_bytes(jit, 3, 0x66, 0xc7, 0x83);
+	jit_u32(jit, offset);
+	jit_u16(jit, value);
+}
+
+// jmp rel32 to the epilogue
+static void jit_exit(JitState * jit) {
+	jit_byte(jit, 0xe9);
+	jit_patch(jit->code, jit->epilogue);
+	jit->code += 4;
+}
+
+// leaves the block for a pc known at compile time, chained directly to its block once it exists
+static void jit_exit_to(JitState * jit, unsigned short int target) {
+	jit_store_immediate16(jit, JIT_PC, target);
+	jit_byte(jit, 0xe9);
+	unsigned char * site = jit->code;
+	jit->code += 4;
+	if (target < MEMORY_LIMIT && jit->state[target] == JIT_COMPILED) {
+		jit_patch(site, jit->entries[target]);
+		return;
+	}
+	jit_patch(site, jit->epilogue);
+	if (jit->linkCount < JIT_MAX_LINKS) {
+		jit->links[jit->linkCount].site = site;
+		jit->links[jit->linkCount].target = target;
+		jit->linkCount++;
+	}
+}
+
+static void jit_flush(JitState * jit) {
+	if (!jit) return;
+	jit->used = jit->blocksStart;
+	jit->linkCount = 0;
+	memset(jit->state, JIT_UNCOMPILED, sizeof(jit->state));
+	memset(jit->pages, 0, sizeof(jit->pages));
+}
+
+// Blocks chain into each other, so dropping one means dropping them all. Only writes to
+// pages holding translated code pay for it.
+static void jit_invalidate(JitState * jit, unsigned int address, unsigned int size) {
+	if (!jit || size == 0) return;
+	for (unsigned int page = address >> JIT_PAGE_SHIFT; page <= (address + size - 1) >> JIT_PAGE_SHIFT; page++) {
+		if (jit->pages[page]) {
+			jit_flush(jit);
+			return;
+		}
+	}
+}
+
+// Each instance gets its own arena on first use, so machines that never run the jit pay nothing.
+static JitState * jit_initialize() {
+	JitState * jit = calloc(1, sizeof(*jit));
+	if (jit == 0) {
+		return 0;
+	}
+	void * arena = mmap(0, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED) {
+		free(jit);
+		return 0;
+	}
+	jit->arena = arena;
+	jit->code = jit->arena;
+
+	// enter(machine, budget, block): save callee-saved registers, set up rbx/r12, jump in
+	jit->enter = (JitEntry)jit->code;
+	jit_bytes(jit, 3, 0x53, 0x41, 0x54);       // push rbx; push r12
+	jit_bytes(jit, 3, 0x48, 0x89, 0xfb);       // mov rbx, rdi
+	jit_bytes(jit, 3, 0x49, 0x89, 0xf4);       // mov r12, rsi
+	jit_bytes(jit, 2, 0xff, 0xe2);             // jmp rdx
+
+	// every exit returns what is left of the budget
+	jit->epilogue = jit->code;
+	jit_bytes(jit, 3, 0x4c, 0x89, 0xe0);       // mov rax, r12
+	jit_bytes(jit, 4, 0x41, 0x5c, 0x5b, 0xc3); // pop r12; pop rbx; ret
+
+	jit->blocksStart = jit->code - jit->arena;
+	jit_flush(jit);
+	return jit;
+}
+
+static void jit_destroy(JitState * jit) {
+	if (!jit) return;
+	munmap(jit->arena, JIT_ARENA_SIZE);
+	free(jit);
+}
+
+// Emits one instruction that stays inside the block. Returns 0 for anything the block
+// has to stop before.
+static int jit_emit_instruction(JitState * jit, const DecodedInstruction * instruction, unsigned char quirks) {
+	int x = JIT_REGISTER(instruction->x);
+	int y = JIT_REGISTER(instruction->y);
+	int vf = JIT_REGISTER(15);
+
+	switch (instruction->kind) {
+	case INSTRUCTION_LOAD_IMMEDIATE:
+		jit_store_immediate(jit, x, instruction->nn);
+		return 1;
+	case INSTRUCTION_ADD_IMMEDIATE:
+		jit_bytes(jit, 2, 0x80, 0x83);                 // add byte [rbx + x], imm8
+		jit_u32(jit, x);
+		jit_byte(jit, instruction->nn);
+		return 1;
+	case INSTRUCTION_MOVE:
+		jit_load(jit, JIT_EAX, y);
+		jit_store(jit, JIT_EAX, x);
+		return 1;
+	case INSTRUCTION_OR:
+	case INSTRUCTION_AND:
+	case INSTRUCTION_XOR:
+		jit_load(jit, JIT_EAX, x);
+		jit_load(jit, JIT_ECX, y);
+		if (instruction->kind == INSTRUCTION_OR) jit_bytes(jit, 2, 0x08, 0xc8);       // or al, cl
+		else if (instruction->kind == INSTRUCTION_AND) jit_bytes(jit, 2, 0x20, 0xc8); // and al, cl
+		else jit_bytes(jit, 2, 0x30, 0xc8);                                           // xor al, cl
+		jit_store(jit, JIT_EAX, x);
+		if (quirks & QUIRK_COSMAC_VF_RESET) jit_store_immediate(jit, vf, 0);
+		return 1;
+	case INSTRUCTION_ADD:
+		jit_load(jit, JIT_EAX, x);
+		jit_load(jit, JIT_ECX, y);
+		jit_bytes(jit, 2, 0x01, 0xc8);                 // add eax, ecx
+		jit_store(jit, JIT_EAX, x);
+		jit_bytes(jit, 3, 0xc1, 0xe8, 0x08);           // shr eax, 8
+		jit_store(jit, JIT_EAX, vf);
+		return 1;
+	case INSTRUCTION_SUBTRACT:
+	case INSTRUCTION_SUBTRACT_REVERSE:
+		if (instruction->kind == INSTRUCTION_SUBTRACT) {
+			jit_load(jit, JIT_EAX, x);
+			jit_load(jit, JIT_ECX, y);
+		} else {
+			jit_load(jit, JIT_EAX, y);
+			jit_load(jit, JIT_ECX, x);
+		}
+		jit_bytes(jit, 2, 0x38, 0xc8);                 // cmp al, cl
+		jit_bytes(jit, 3, 0x0f, 0x93, 0xc2);           // setae dl
+		jit_bytes(jit, 2, 0x28, 0xc8);                 // sub al, cl
+		jit_store(jit, JIT_EAX, x);
+		jit_store(jit, JIT_EDX, vf);
+		return 1;
+	case INSTRUCTION_SHIFT_RIGHT:
+		jit_load(jit, JIT_EAX, quirks & QUIRK_SUPER_CHIP_SHIFT ? x : y);
+		jit_bytes(jit, 2, 0x89, 0xc2);                 // mov edx, eax
+		jit_bytes(jit, 3, 0x83, 0xe2, 0x01);           // and edx, 1
+		jit_bytes(jit, 2, 0xd0, 0xe8);                 // shr al, 1
+		jit_store(jit, JIT_EAX, x);
+		jit_store(jit, JIT_EDX, vf);
+		return 1;
+	case INSTRUCTION_SHIFT_LEFT:
+		jit_load(jit, JIT_EAX, quirks & QUIRK_SUPER_CHIP_SHIFT ? x : y);
+		jit_bytes(jit, 2, 0x89, 0xc2);                 // mov edx, eax
+		if (quirks & QUIRK_SUPER_CHIP_SHIFT) {
+			jit_bytes(jit, 3, 0xc1, 0xea, 0x03);       // shr edx, 3
+			jit_bytes(jit, 3, 0x83, 0xe2, 0x01);       // and edx, 1
+		} else {
+			jit_bytes(jit, 3, 0x83, 0xe2, 0x08);       // and edx, 8
+		}
+		jit_bytes(jit, 2, 0xd0, 0xe0);                 // shl al, 1
+		jit_store(jit, JIT_EAX, x);
+		jit_store(jit, JIT_EDX, vf);
+		return 1;
+	case INSTRUCTION_LOAD_INDEX:
+		jit_store_immediate16(jit, JIT_INDEX, instruction->nnn);
+		return 1;
+	case INSTRUCTION_LOAD_DELAY:
+		jit_load(jit, JIT_EAX, JIT_DELAY);
+		jit_store(jit, JIT_EAX, x);
+		return 1;
+	case INSTRUCTION_SET_DELAY:
+		jit_load(jit, JIT_EAX, x);
+		jit_store(jit, JIT_EAX, JIT_DELAY);
+		return 1;
+	case INSTRUCTION_SET_SOUND:
+		jit_load(jit, JIT_EAX, x);
+		jit_store(jit, JIT_EAX, JIT_SOUND);
+		return 1;
+	case INSTRUCTION_ADD_INDEX:
+		jit_load(jit, JIT_EAX, x);
+		jit_bytes(jit, 3, 0x66, 0x01, 0x83);           // add word [rbx + I], ax
+		jit_u32(jit, JIT_INDEX);
+		if (quirks & QUIRK_AMIGA_INDEX_OVERFLOW) {
+			jit_bytes(jit, 3, 0x0f, 0xb7, 0x83);       // movzx eax, word [rbx + I]
+			jit_u32(jit, JIT_INDEX);
+			jit_byte(jit, 0x3d);                       // cmp eax, 0x1000
+			jit_u32(jit, 0x1000);
+			jit_bytes(jit, 3, 0x0f, 0x97, 0xc0);       // seta al
+			jit_store(jit, JIT_EAX, vf);
+		}
+		return 1;
+	case INSTRUCTION_FONT:
+		jit_load(jit, JIT_EAX, x);
+		jit_bytes(jit, 3, 0x8d, 0x04, 0x80);           // lea eax, [rax + rax * 4]
+		jit_bytes(jit, 3, 0x83, 0xc0, FONT_MEMORY_SECTOR); // add eax, FONT_MEMORY_SECTOR
+		jit_bytes(jit, 3, 0x66, 0x89, 0x83);           // mov word [rbx + I], ax
+		jit_u32(jit, JIT_INDEX);
+		return 1;
+	}
+	return 0;
+}
+
+// Emits the control transfer that ends a block. Returns 0 if the instruction is not one.
+static int jit_emit_terminator(JitState * jit, const DecodedInstruction * instruction, unsigned short int pc, unsigned char quirks) {
+	unsigned char * site;
+	switch (instruction->kind) {
+	case INSTRUCTION_JUMP:
+		jit_exit_to(jit, instruction->nnn);
+		return 1;
+	case INSTRUCTION_CALL:
+		jit_bytes(jit, 3, 0x0f, 0xb7, 0x83);           // movzx eax, word [rbx + sp]
+		jit_u32(jit, JIT_SP);
+		jit_byte(jit, 0x3d);                           // cmp eax, STACK_LIMIT
+		jit_u32(jit, STACK_LIMIT);
+		jit_bytes(jit, 2, 0x0f, 0x83);                 // jae full
+		site = jit->code;
+		jit->code += 4;
+		jit_bytes(jit, 4, 0x66, 0xc7, 0x84, 0x43);     // mov word [rbx + rax * 2 + stack], pc
+		jit_u32(jit, JIT_STACK);
+		jit_u16(jit, pc);
+		jit_bytes(jit, 3, 0x66, 0xff, 0x83);           // inc word [rbx + sp]
+		jit_u32(jit, JIT_SP);
+		jit_exit_to(jit, instruction->nnn);
+		// full stack: refund the instruction and let the interpreter raise the error
+		jit_patch(site, jit->code);
+		jit_store_immediate16(jit, JIT_PC, pc);
+		jit_bytes(jit, 3, 0x49, 0xff, 0xc4);           // inc r12
+		jit_exit(jit);
+		return 1;
+	case INSTRUCTION_RETURN:
+		jit_bytes(jit, 3, 0x0f, 0xb7, 0x83);           // movzx eax, word [rbx + sp]
+		jit_u32(jit, JIT_SP);
+		jit_bytes(jit, 2, 0x85, 0xc0);                 // test eax, eax
+		jit_bytes(jit, 2, 0x0f, 0x84);                 // jz empty
+		site = jit->code;
+		jit->code += 4;
+		jit_bytes(jit, 2, 0xff, 0xc8);                 // dec eax
+		jit_bytes(jit, 3, 0x66, 0x89, 0x83);           // mov word [rbx + sp], ax
+		jit_u32(jit, JIT_SP);
+		jit_bytes(jit, 4, 0x0f, 0xb7, 0x84, 0x43);     // movzx eax, word [rbx + rax * 2 + stack]
+		jit_u32(jit, JIT_STACK);
+		jit_bytes(jit, 3, 0x83, 0xc0, 0x02);           // add eax, 2
+		jit_bytes(jit, 3, 0x66, 0x89, 0x83);           // mov word [rbx + pc], ax
+		jit_u32(jit, JIT_PC);
+		jit_exit(jit);
+		// empty stack: refund the instruction and let the interpreter raise the error
+		jit_patch(site, jit->code);
+		jit_store_immediate16(jit, JIT_PC, pc);
+		jit_bytes(jit, 3, 0x49, 0xff, 0xc4);           // inc r12
+		jit_exit(jit);
+		return 1;
+	case INSTRUCTION_SKIP_EQUAL_IMMEDIATE:
+	case INSTRUCTION_SKIP_NOT_EQUAL_IMMEDIATE:
+	case INSTRUCTION_SKIP_EQUAL:
+	case INSTRUCTION_SKIP_NOT_EQUAL:
+		if (instruction->kind == INSTRUCTION_SKIP_EQUAL_IMMEDIATE || instruction->kind == INSTRUCTION_SKIP_NOT_EQUAL_IMMEDIATE) {
+			jit_bytes(jit, 2, 0x80, 0xbb);             // cmp byte [rbx + x], imm8
+			jit_u32(jit, JIT_REGISTER(instruction->x));
+			jit_byte(jit, instruction->nn);
+		} else {
+			jit_load(jit, JIT_EAX, JIT_REGISTER(instruction->x));
+			jit_bytes(jit, 2, 0x3a, 0x83);             // cmp al, byte [rbx + y]
+			jit_u32(jit, JIT_REGISTER(instruction->y));
+		}
+		if (instruction->kind == INSTRUCTION_SKIP_EQUAL_IMMEDIATE || instruction->kind == INSTRUCTION_SKIP_EQUAL) {
+			jit_bytes(jit, 2, 0x0f, 0x84);             // je skip
+		} else {
+			jit_bytes(jit, 2, 0x0f, 0x85);             // jne skip
+		}
+		site = jit->code;
+		jit->code += 4;
+		jit_exit_to(jit, pc + 2);
+		jit_patch(site, jit->code);
+		jit_exit_to(jit, pc + 4);
+		return 1;
+	case INSTRUCTION_JUMP_OFFSET:
+		jit_load(jit, JIT_EAX, JIT_REGISTER(quirks & QUIRK_SUPER_CHIP_JUMP ? instruction->x : 0));
+		jit_byte(jit, 0x05);                           // add eax, nnn
+		jit_u32(jit, instruction->nnn);
+		jit_bytes(jit, 3, 0x66, 0x89, 0x83);           // mov word [rbx + pc], ax
+		jit_u32(jit, JIT_PC);
+		jit_exit(jit);
+		return 1;
+	}
+	return 0;
+}
+
+static void jit_compile(JitState * jit, Machine * machine, unsigned short int start) {
+	if (JIT_ARENA_SIZE - jit->used < JIT_MAX_BLOCK_BYTES) {
+		jit_flush(jit);
+	}
+
+	unsigned char * entry = jit->arena + jit->used;
+	jit->code = entry;
+
+	// budget check: cmp r12, length; jb epilogue; sub r12, length (length patched below)
+	jit_bytes(jit, 3, 0x49, 0x81, 0xfc);
+	unsigned char * lengthCheck = jit->code;
+	jit->code += 4;
+	jit_bytes(jit, 2, 0x0f, 0x82);
+	jit_patch(jit->code, jit->epilogue);
+	jit->code += 4;
+	jit_bytes(jit, 3, 0x49, 0x81, 0xec);
+	unsigned char * lengthCharge = jit->code;
+	jit->code += 4;
+
+	// blocks are registered before their body is emitted so a jump back to the start chains
+	jit->state[start] = JIT_COMPILED;
+	jit->entries[start] = entry;
+
+	unsigned short int pc = start;
+	unsigned int length = 0;
+	int terminated = 0;
+	while (length < JIT_MAX_BLOCK_INSTRUCTIONS && pc < MEMORY_LIMIT - 1) {
+		DecodedInstruction instruction;
+		decode_instruction(&instruction, machine->ram.mem[pc], machine->ram.mem[pc + 1]);
+		if (jit_emit_instruction(jit, &instruction, machine->quirks)) {
+			length++;
+			pc += 2;
+			continue;
+		}
+		if (jit_emit_terminator(jit, &instruction, pc, machine->quirks)) {
+			length++;
+			pc += 2;
+			terminated = 1;
+		}
+		break;
+	}
+
+	if (length == 0) {
+		jit->state[start] = JIT_INTERPRETED;
+		return;
+	}
+	if (!terminated) {
+		jit_exit_to(jit, pc);
+	}
+
+	memcpy(lengthCheck, &length, 4);
+	memcpy(lengthCharge, &length, 4);
+	jit->lengths[start] = length;
+	jit->used = jit->code - jit->arena;
+	for (unsigned int page = start >> JIT_PAGE_SHIFT; page <= (unsigned int)(pc - 1) >> JIT_PAGE_SHIFT; page++) {
+		jit->pages[page] = 1;
+	}
+
+	// earlier blocks waiting on this address now jump straight in
+	for (unsigned int i = 0; i < jit->linkCount; i++) {
+		if (jit->links[i].target != start) continue;
+		jit_patch(jit->links[i].site, entry);
+		jit->links[i] = jit->links[--jit->linkCount];
+		i--;
+	}
+}
+
+static unsigned int run_jit(Chip8 * chip8, unsigned int count) {
+	Machine * machine = &chip8->machine;
+	if (!chip8->jit) chip8->jit = jit_initialize();
+	if (!chip8->jit) {
+		chip8->engine = ENGINE_THREADED;
+		return run_decoded(chip8, count);
+	}
+	JitState * jit = chip8->jit;
+
+	// blocks have the quirks they were compiled under baked in
+	if (jit->quirks != machine->quirks) {
+		jit_flush(jit);
+		jit->quirks = machine->quirks;
+	}
+
+	unsigned long long int remaining = count;
+	while (remaining > 0 && !machine->halted) {
+		unsigned short int pc = machine->pc;
+		if (pc >= PROGRAM_MEMORY_SECTOR && pc < MEMORY_LIMIT - 1 && jit->state[pc] == JIT_UNCOMPILED) {
+			jit_compile(jit, machine, pc);
+		}
+		if (pc < PROGRAM_MEMORY_SECTOR || pc >= MEMORY_LIMIT - 1 || jit->state[pc] != JIT_COMPILED || jit->lengths[pc] > remaining) {
+			remaining -= run_decoded(chip8, 1);
+			continue;
+		}
+		unsigned long long int before = remaining;
+		remaining = jit->enter(machine, remaining, jit->entries[pc]);
+		machine->cycles += before - remaining;
+		// a block that refunds its first instruction hands it to the interpreter
+		if (remaining == before) {
+			remaining -= run_decoded(chip8, 1);
+		}
+	}
+	return count - remaining;
+}
+#else
+static void jit_flush(struct JitState * jit) {
+}
+
+static void jit_invalidate(struct JitState * jit, unsigned int address, unsigned int size) {
+}
+
+static void jit_destroy(struct JitState * jit) {
+}
+
+static unsigned int run_jit(Chip8 * chip8, unsigned int count) {
+	return run_decoded(chip8, count);
+}
+#endif
+
+// The profiler runs on the switch interpreter with a hook around every instruction, so an
+// instance that is not being profiled pays one pointer test per run_instructions. Call paths
+// are kept as a tree of CALL targets that follows the machine stack.
+#define PROFILE_NODE_LIMIT 4096
+#define PROFILE_UNKNOWN_TARGET 0xffff
+
+typedef struct {
+	unsigned int parent;
+	unsigned short int target;
+	unsigned char depth;
+	unsigned long long int instructions;
+} ProfileNode;
+
+struct Profile {
+	unsigned long long int instructions;
+	unsigned long long int families[OPCODE_FAMILY_COUNT];
+	unsigned long long int addresses[MEMORY_LIMIT];
+	unsigned long long int calls[MEMORY_LIMIT];
+	unsigned long long int draws;
+	unsigned long long int pixels;
+	unsigned long long int collisions;
+	ProfileNode nodes[PROFILE_NODE_LIMIT];
+	unsigned int nodeCount;
+	// node index + 1 by (parent, target), open addressing
+	unsigned int slots[PROFILE_NODE_LIMIT * 2];
+	unsigned int node;
+	int truncated;
+};
+
+static const char * const opcodeFamilyNames[OPCODE_FAMILY_COUNT] = {
+	"00E0", "00EE", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN", "8XYN", "9XY0", "ANNN", "BNNN",
+	"CXNN", "DXYN", "EXNN", "FX07", "FX0A", "FX15", "FX18", "FX1E", "FX29", "FX33", "FX55", "FX65", "other",
+};
+
+int chip8_opcode_family(unsigned short int opcode) {
+	static const unsigned char miscFamilies[] = {0x07, 0x0a, 0x15, 0x18, 0x1e, 0x29, 0x33, 0x55, 0x65};
+	int high = opcode >> 12;
+	if (opcode == 0x00e0) return 0;
+	if (opcode == 0x00ee) return 1;
+	if (high >= 1 && high <= 14) return high + 1;
+	if (high == 15) {
+		for (unsigned int i = 0; i < sizeof(miscFamilies); i++) {
+			if ((opcode & 0xff) == miscFamilies[i]) return 16 + i;
+		}
+	}
+	return OPCODE_FAMILY_COUNT - 1;
+}
+
+const char * chip8_opcode_family_name(int family) {
+	return family >= 0 && family < OPCODE_FAMILY_COUNT ? opcodeFamilyNames[family] : "other";
+}
+
+// Returns the node for a call to target from parent, or parent when the tree is full.
+static unsigned int profile_child(struct Profile * profile, unsigned int parent, unsigned short int target) {
+	unsigned int mask = PROFILE_NODE_LIMIT * 2 - 1;
+	unsigned int slot = (parent * 0x9e3779b1u ^ target) & mask;
+	while (profile->slots[slot]) {
+		const ProfileNode * node = &profile->nodes[profile->slots[slot] - 1];
+		if (node->parent == parent && node->target == target) return profile->slots[slot] - 1;
+		slot = (slot + 1) & mask;
+	}
+	if (profile->nodeCount == PROFILE_NODE_LIMIT) {
+		profile->truncated = 1;
+		return parent;
+	}
+	unsigned int index = profile->nodeCount++;
+	profile->nodes[index].parent = parent;
+	profile->nodes[index].target = target;
+	profile->nodes[index].depth = profile->nodes[parent].depth + 1;
+	profile->slots[slot] = index + 1;
+	return index;
+}
+
+// A call or return moves one level along the tree; anything else that changed the stack
+// depth, like loading a state, rebuilds the path from frames of unknown targets.
+static void profile_follow_stack(struct Profile * profile, const Machine * machine, unsigned short int opcode) {
+	const ProfileNode * node = &profile->nodes[profile->node];
+	if ((opcode & 0xf000) == 0x2000 && machine->stack.sp == node->depth + 1) {
+		profile->calls[opcode & 0x0fff]++;
+		profile->node = profile_child(profile, profile->node, opcode & 0x0fff);
+	} else if (opcode == 0x00ee && machine->stack.sp + 1 == node->depth) {
+		profile->node = node->parent;
+	} else {
+		profile->node = 0;
+		for (unsigned int i = 0; i < machine->stack.sp; i++) {
+			profile->node = profile_child(profile, profile->node, PROFILE_UNKNOWN_TARGET);
+		}
+	}
+}
+
+static unsigned int run_profiled(Chip8 * chip8, unsigned int count) {
+	Machine * machine = &chip8->machine;
+	struct Profile * profile = chip8->profile;
+	unsigned int executed = 0;
+	while (executed < count && !machine->halted) {
+		unsigned short int pc = machine->pc & (MEMORY_LIMIT - 1);
+		unsigned short int opcode = machine->ram.mem[pc] << 8 | machine->ram.mem[(pc + 1) & (MEMORY_LIMIT - 1)];
+		profile->instructions++;
+		profile->families[chip8_opcode_family(opcode)]++;
+		profile->addresses[pc]++;
+		profile->nodes[profile->node].instructions++;
+
+		ScreenMemory before;
+		int draw = (opcode & 0xf000) == 0xd000;
+		if (draw) before = machine->screen;
+
+		executed++;
+		machine->cycles++;
+		trace_instruction(chip8, machine->pc, machine->cycles);
+		execute_instruction(chip8);
+
+		if (draw) {
+			profile->draws++;
+			profile->collisions += machine->registers.reg[15] != 0;
+			for (int y = 0; y < SCREEN_HEIGHT; y++) {
+				profile->pixels += __builtin_popcountll(before.rows[y] ^ machine->screen.rows[y]);
+			}
+		}
+		if (machine->stack.sp != profile->nodes[profile->node].depth) {
+			profile_follow_stack(profile, machine, opcode);
+		}
+	}
+	return executed;
+}
+
+int chip8_profile_enable(Chip8 * chip8, int enable) {
+	if (!enable) {
+		free(chip8->profile);
+		chip8->profile = 0;
+		return 0;
+	}
+	if (chip8->profile) return 0;
+	chip8->profile = calloc(1, sizeof(*chip8->profile));
+	if (chip8->profile == 0) {
+		return 1;
+	}
+	chip8->profile->nodeCount = 1;
+	chip8->profile->nodes[0].target = PROFILE_UNKNOWN_TARGET;
+	for (unsigned int i = 0; i < chip8->machine.stack.sp; i++) {
+		chip8->profile->node = profile_child(chip8->profile, chip8->profile->node, PROFILE_UNKNOWN_TARGET);
+	}
+	return 0;
+}
+
+static void write_profile_frame(FILE * file, unsigned short int target) {
+	if (target == PROFILE_UNKNOWN_TARGET) fprintf(file, "?");
+	else fprintf(file, "sub_%.3x", target);
+}
+
+// Every address and call target that ran, in address order.
+int chip8_profile_write_json(const Chip8 * chip8, FILE * file) {
+	const struct Profile * profile = chip8->profile;
+	if (profile == 0) {
+		return 1;
+	}
+	fprintf(file, "{\"instructions\":%llu,\"families\":{", profile->instructions);
+	for (int i = 0, first = 1; i < OPCODE_FAMILY_COUNT; i++) {
+		if (profile->families[i] == 0) continue;
+		fprintf(file, "%s\"%s\":%llu", first ? "" : ",", opcodeFamilyNames[i], profile->families[i]);
+		first = 0;
+	}
+	fprintf(file, "},\"addresses\":[");
+	for (int i = 0, first = 1; i < MEMORY_LIMIT; i++) {
+		if (profile->addresses[i] == 0) continue;
+		unsigned short int opcode = chip8->machine.ram.mem[i] << 8 | chip8->machine.ram.mem[(i + 1) & (MEMORY_LIMIT - 1)];
+		fprintf(file, "%s{\"pc\":\"0x%.3x\",\"opcode\":\"%.4x\",\"count\":%llu}", first ? "" : ",", i, opcode, profile->addresses[i]);
+		first = 0;
+	}
+
+	// inclusive counts add up every path a target is on, once per path however deep it recurses
+	fprintf(file, "],\"calls\":[");
+	for (int target = 0, first = 1; target < MEMORY_LIMIT; target++) {
+		if (profile->calls[target] == 0) continue;
+		unsigned long long int inclusive = 0;
+		for (unsigned int n = 1; n < profile->nodeCount; n++) {
+			for (unsigned int a = n; a != 0; a = profile->nodes[a].parent) {
+				if (profile->nodes[a].target == target) {
+					inclusive += profile->nodes[n].instructions;
+					break;
+				}
+			}
+		}
+		fprintf(file, "%s{\"target\":\"0x%.3x\",\"calls\":%llu,\"instructions\":%llu}", first ? "" : ",", target, profile->calls[target], inclusive);
+		first = 0;
+	}
+	fprintf(file, "],\"dxyn\":{\"draws\":%llu,\"pixels\":%llu,\"collisions\":%llu,\"collision_rate\":%.6lf},\"truncated\":%s}\n", profile->draws,
+			profile->pixels, profile->collisions, profile->draws ? (double)profile->collisions / profile->draws : 0, profile->truncated ? "true" : "false");
+	return ferror(file) ? 2 : 0;
+}
+
+// One "main;sub_2a4;sub_300 <instructions>" line per call path, as flamegraph.pl reads them.
+int chip8_profile_write_folded(const Chip8 * chip8, FILE * file) {
+	const struct Profile * profile = chip8->profile;
+	if (profile == 0) {
+		return 1;
+	}
+	unsigned short int path[STACK_LIMIT];
+	for (unsigned int n = 0; n < profile->nodeCount; n++) {
+		if (profile->nodes[n].instructions == 0) continue;
+		unsigned int depth = 0;
+		for (unsigned int a = n; a != 0 && depth < sizeof(path) / sizeof(*path); a = profile->nodes[a].parent) {
+			path[depth++] = profile->nodes[a].target;
+		}
+		fprintf(file, "main");
+		while (depth) {
+			fputc(';', file);
+			write_profile_frame(file, path[--depth]);
+		}
+		fprintf(file, " %llu\n", profile->nodes[n].instructions);
+	}
+	return ferror(file) ? 2 : 0;
+}
+
+static unsigned int run_instructions(Chip8 * chip8, unsigned int count) {
+	Machine * machine = &chip8->machine;
+	unsigned int executed = 0;
+	if (chip8->profile) {
+		executed = run_profiled(chip8, count);
+	} else if (chip8->engine == ENGINE_JIT) {
+		executed = run_jit(chip8, count);
+	} else if (chip8->engine == ENGINE_THREADED) {
+		executed = run_decoded(chip8, count);
+	} else {
+		while (executed < count && !machine->halted) {
+			executed++;
+			machine->cycles++;
+			trace_instruction(chip8, machine->pc, machine->cycles);
+			execute_instruction(chip8);
+		}
+	}
+	return executed;
+}
+
+static unsigned short int fetch_opcode(const Machine * machine, unsigned int address) {
+	return machine->ram.mem[address] << 8 | machine->ram.mem[address + 1];
+}
+
+// Waits that nothing but a key press ends, a jump to itself or FX0A with no key pending,
+// change nothing but the cycle count and the timers, and keys only arrive between steps. The
+// whole step is skipped at once with the timers run down as many ticks as it spans.
+static unsigned int skip_idle_wait(Chip8 * chip8, unsigned int count) {
+	Machine * machine = &chip8->machine;
+	if (machine->pc > MEMORY_LIMIT - 2) return 0;
+	unsigned short int opcode = fetch_opcode(machine, machine->pc);
+	if (opcode != (0x1000 | machine->pc) && !((opcode & 0xf0ff) == 0xf00a && machine->keyBuffer == -1)) return 0;
+
+	unsigned long long int phase = machine->timerPhase + (unsigned long long int)count * TIMER_RATE;
+	unsigned long long int ticks = phase / machine->instructionRate;
+	machine->timerPhase = phase % machine->instructionRate;
+	machine->delayTimer = ticks < machine->delayTimer ? machine->delayTimer - ticks : 0;
+	machine->soundTimer = ticks < machine->soundTimer ? machine->soundTimer - ticks : 0;
+	machine->cycles += count;
+	return count;
+}
+
+// FX07, 3XNN, 1NNN back to the FX07: polling the delay timer, which cannot change before the
+// next tick. Whole turns of the loop left before the tick are skipped, with VX holding the
+// timer as the last FX07 would have left it. A pc inside the loop is first run to its start.
+static unsigned int skip_delay_loop(Chip8 * chip8, unsigned int batch) {
+	Machine * machine = &chip8->machine;
+	for (unsigned int offset = 0; offset <= 4 && offset <= machine->pc; offset += 2) {
+		unsigned int start = machine->pc - offset;
+		if (start > MEMORY_LIMIT - 6) continue;
+		unsigned short int read = fetch_opcode(machine, start);
+		unsigned short int test = fetch_opcode(machine, start + 2);
+		unsigned int x = (read >> 8) & 15;
+		if ((read & 0xf0ff) != 0xf007 || (test & 0xff00) != (0x3000 | x << 8) || fetch_opcode(machine, start + 4) != (0x1000 | start)) continue;
+
+		unsigned int ran = 0;
+		if (offset) {
+			unsigned int toStart = offset == 2 ? 2 : 1;
+			if (toStart > batch) return 0;
+			ran = run_instructions(chip8, toStart);
+			if (machine->pc != start || machine->halted) return ran;
+		}
+		if (machine->delayTimer == (test & 0xff)) return ran;
+		unsigned int turns = (batch - ran) / 3;
+		if (turns) {
+			machine->registers.reg[x] = machine->delayTimer;
+			machine->cycles += turns * 3;
+		}
+		return ran + turns * 3;
+	}
+	return 0;
+}
+
+// Timers are clocked off executed instructions, every instructionRate / TIMER_RATE of them,
+// so they tick at 60 Hz of machine time whatever the host loop is doing. Idle loops are fast
+// forwarded to the same state a plain run would reach, unless the instance is profiled.
+unsigned int chip8_step(Chip8 * chip8, unsigned int count) {
+	Machine * machine = &chip8->machine;
+	unsigned int executed = 0;
+	int fastForward = chip8->fastForward && !chip8->profile;
+	while (executed < count && !machine->halted) {
+		if (fastForward) {
+			unsigned int skipped = skip_idle_wait(chip8, count - executed);
+			if (skipped) {
+				executed += skipped;
+				break;
+			}
+		}
+		unsigned int untilTick = (machine->instructionRate - machine->timerPhase + TIMER_RATE - 1) / TIMER_RATE;
+		unsigned int batch = count - executed < untilTick ? count - executed : untilTick;
+
+		unsigned int ran = fastForward ? skip_delay_loop(chip8, batch) : 0;
+		ran += run_instructions(chip8, batch - ran);
+		executed += ran;
+		machine->timerPhase += ran * TIMER_RATE;
+		while (machine->timerPhase >= machine->instructionRate) {
+			machine->timerPhase -= machine->instructionRate;
+			update_machine_time(machine);
+		}
+	}
+	return executed;
+}
+
+// Lockstep: many instances of one program run side by side, LOCKSTEP_WIDTH lanes to a block,
+// with the pc, I, registers and timers of every lane stored as vectors. Each step splits the
+// live lanes into groups sharing a pc and runs the group's instruction once per block with
+// vector ops. Skips and key reads split groups up; lanes rejoin as soon as their pcs meet
+// again. Instructions without a vector form run lane by lane against each lane's Machine,
+// which holds everything but the vector state.
+#define LOCKSTEP_WIDTH 32
+#define LOCKSTEP_MAX_GROUPS 8
+
+typedef unsigned char LaneBytes __attribute__((vector_size(LOCKSTEP_WIDTH)));
+typedef signed char LaneMask __attribute__((vector_size(LOCKSTEP_WIDTH)));
+typedef unsigned short int LaneWords __attribute__((vector_size(LOCKSTEP_WIDTH * 2)));
+typedef short int LaneWordMask __attribute__((vector_size(LOCKSTEP_WIDTH * 2)));
+typedef uint32_t LaneDwords __attribute__((vector_size(LOCKSTEP_WIDTH * 4)));
+typedef int32_t LaneDwordMask __attribute__((vector_size(LOCKSTEP_WIDTH * 4)));
+
+typedef struct {
+	LaneWords pc;
+	LaneWords regI;
+	LaneBytes registers[REGISTER_COUNT];
+	LaneBytes delayTimer;
+	LaneBytes soundTimer;
+	// each lane's xoshiro128** state, word by word
+	LaneDwords randomState[4];
+	// 0xff while no key is latched
+	LaneBytes keyBuffer;
+	LaneBytes live;
+	LaneBytes pending;
+	LaneBytes group;
+} LaneBlock;
+
+struct Chip8Lockstep {
+	unsigned int count;
+	unsigned int blockCount;
+	Chip8 ** lanes;
+	LaneBlock * blocks;
+	unsigned int liveCount;
+	unsigned char quirks;
+	unsigned int instructionRate;
+	unsigned int timerPhase;
+	unsigned int executed;
+	unsigned int batchRan;
+	unsigned long long int groupedInstructions;
+	unsigned long long int scalarInstructions;
+	// the program as loaded, and every address any lane has written since
+	unsigned char code[MEMORY_LIMIT];
+	unsigned char written[MEMORY_LIMIT];
+};
+
+// The helpers are macros, or take their vectors by pointer: a vector wider than the target's
+// registers passed by value is an ABI change gcc warns about, even for static functions.
+// every lane set to value
+#define LANE_SPLAT(value) ((LaneBytes){0} + (unsigned char)(value))
+#define LANE_SPLAT_WORDS(value) ((LaneWords){0} + (unsigned short int)(value))
+#define LANE_WIDEN_MASK(mask) __builtin_convertvector((LaneMask)(mask), LaneWordMask)
+#define LANE_NARROW_MASK(mask) ((LaneBytes)__builtin_convertvector((mask), LaneMask))
+#define LANE_WIDEN(bytes) __builtin_convertvector((bytes), LaneWords)
+// a where mask is set, b elsewhere
+#define LANE_SELECT(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+#define LANE_SELECT_WORDS(mask, a, b) LANE_SELECT((LaneWords)LANE_WIDEN_MASK(mask), a, b)
+
+// next_random for the lanes in mask, the others keep their state
+static void lane_next_random(LaneBlock * block, const LaneBytes * mask, LaneBytes * random) {
+	LaneDwords * s = block->randomState;
+	LaneDwords s1 = s[1] * 5;
+	LaneDwords result = ((s1 << 7) | (s1 >> 25)) * 9;
+	LaneDwords t = s[1] << 9;
+	LaneDwords s2 = s[2] ^ s[0];
+	LaneDwords s3 = s[3] ^ s[1];
+	LaneDwords n1 = s[1] ^ s2;
+	LaneDwords n0 = s[0] ^ s3;
+	s2 ^= t;
+	s3 = (s3 << 11) | (s3 >> 21);
+	LaneDwords wide = (LaneDwords)__builtin_convertvector((LaneMask)*mask, LaneDwordMask);
+	s[0] = (n0 & wide) | (s[0] & ~wide);
+	s[1] = (n1 & wide) | (s[1] & ~wide);
+	s[2] = (s2 & wide) | (s[2] & ~wide);
+	s[3] = (s3 & wide) | (s[3] & ~wide);
+	*random = __builtin_convertvector(result >> 24, LaneBytes);
+}
+
+static int lane_any(const LaneBytes * mask) {
+	uint64_t parts[LOCKSTEP_WIDTH / 8];
+	memcpy(parts, mask, sizeof(parts));
+	uint64_t any = 0;
+	for (unsigned int i = 0; i < LOCKSTEP_WIDTH / 8; i++) any |= parts[i];
+	return any != 0;
+}
+
+static void lockstep_gather(Chip8Lockstep * lockstep, unsigned int lane) {
+	const Machine * machine = &lockstep->lanes[lane]->machine;
+	LaneBlock * block = &lockstep->blocks[lane / LOCKSTEP_WIDTH];
+	unsigned int i = lane % LOCKSTEP_WIDTH;
+	block->pc[i] = machine->pc;
+	block->regI[i] = machine->regI;
+	for (int r = 0; r < REGISTER_COUNT; r++) block->registers[r][i] = machine->registers.reg[r];
+	block->delayTimer[i] = machine->delayTimer;
+	block->soundTimer[i] = machine->soundTimer;
+	block->keyBuffer[i] = machine->keyBuffer;
+	for (int w = 0; w < 4; w++) block->randomState[w][i] = machine->randomState[w];
+}
+
+static void lockstep_scatter(Chip8Lockstep * lockstep, unsigned int lane) {
+	Machine * machine = &lockstep->lanes[lane]->machine;
+	const LaneBlock * block = &lockstep->blocks[lane / LOCKSTEP_WIDTH];
+	unsigned int i = lane % LOCKSTEP_WIDTH;
+	machine->pc = block->pc[i];
+	machine->regI = block->regI[i];
+	for (int r = 0; r < REGISTER_COUNT; r++) machine->registers.reg[r] = block->registers[r][i];
+	machine->delayTimer = block->delayTimer[i];
+	machine->soundTimer = block->soundTimer[i];
+	machine->keyBuffer = (signed char)block->keyBuffer[i];
+	for (int w = 0; w < 4; w++) machine->randomState[w] = block->randomState[w][i];
+}
+
+static void lockstep_mark_written(Chip8Lockstep * lockstep, unsigned int address, unsigned int size) {
+	for (unsigned int i = 0; i < size; i++) {
+		lockstep->written[MEMORY_ADDRESS(address + i)] = 1;
+	}
+}
+
+// A halted lane leaves the lockstep with the cycles and timers chip8_step would have left it.
+static void lockstep_retire(Chip8Lockstep * lockstep, unsigned int lane) {
+	Machine * machine = &lockstep->lanes[lane]->machine;
+	lockstep->blocks[lane / LOCKSTEP_WIDTH].live[lane % LOCKSTEP_WIDTH] = 0;
+	lockstep->liveCount--;
+
+	machine->cycles += lockstep->executed + lockstep->batchRan;
+	machine->timerPhase = lockstep->timerPhase + lockstep->batchRan * TIMER_RATE;
+	while (machine->timerPhase >= machine->instructionRate) {
+		machine->timerPhase -= machine->instructionRate;
+		update_machine_time(machine);
+	}
+}
+
+// runs one instruction of a lane on its own Machine, exactly as the switch engine would
+static void lockstep_execute_lane(Chip8Lockstep * lockstep, unsigned int lane) {
+	Chip8 * chip8 = lockstep->lanes[lane];
+	Machine * machine = &chip8->machine;
+	lockstep_scatter(lockstep, lane);
+
+	unsigned short int pc = machine->pc;
+	if (pc < MEMORY_LIMIT - 1 && (machine->ram.mem[pc] & 0xf0) == 0xf0) {
+		unsigned char p2 = machine->ram.mem[pc + 1];
+		if (p2 == 0x33) lockstep_mark_written(lockstep, machine->regI, 3);
+		if (p2 == 0x55) lockstep_mark_written(lockstep, machine->regI, (machine->ram.mem[pc] & 15) + 1);
+	}
+	execute_instruction(chip8);
+	lockstep->scalarInstructions++;
+
+	if (machine->halted) {
+		lockstep_retire(lockstep, lane);
+		return;
+	}
+	lockstep_gather(lockstep, lane);
+}
+
+static int lockstep_has_vector_form(unsigned char p1, unsigned char p2) {
+	switch (p1 >> 4) {
+	case 0:
+		return p1 == 0 && p2 == 0;
+	case 2:
+	case 13:
+		return 0;
+	case 8:
+		switch (p2 & 15) {
+		case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 14:
+			return 1;
+		}
+		return 0;
+	case 14:
+		return p2 == 0x9e || p2 == 0xa1;
+	case 15:
+		switch (p2) {
+		case 0x07: case 0x0a: case 0x15: case 0x18: case 0x1e: case 0x29:
+			return 1;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+// One instruction for the group lanes of a block, mirroring execute_instruction.
+static void lockstep_vector_block(LaneBlock * block, unsigned char p1, unsigned char p2, unsigned char quirks) {
+	LaneBytes group = block->group;
+	LaneBytes * reg = block->registers;
+	unsigned char x = p1 & 15;
+	unsigned char y = p2 >> 4;
+	unsigned short int nnn = ((p1 & 15) << 8) | p2;
+	LaneBytes vx = reg[x];
+	LaneBytes vy = reg[y];
+	LaneBytes skip = {0};
+	LaneWords pc = block->pc;
+
+	switch (p1 >> 4) {
+	case 0:
+		// stop executing empty space
+		return;
+	case 1:
+		block->pc = LANE_SELECT_WORDS(group, LANE_SPLAT_WORDS(nnn), pc);
+		return;
+	case 3:
+		skip = (LaneBytes)(vx == p2);
+		break;
+	case 4:
+		skip = (LaneBytes)(vx != p2);
+		break;
+	case 5:
+		skip = (LaneBytes)(vx == vy);
+		break;
+	case 6:
+		reg[x] = LANE_SELECT(group, LANE_SPLAT(p2), vx);
+		break;
+	case 7:
+		reg[x] = LANE_SELECT(group, vx + p2, vx);
+		break;
+	case 8: {
+		LaneBytes result, flag = {0};
+		int setsFlag = 1;
+		switch (p2 & 15) {
+		case 0:
+			result = vy;
+			setsFlag = 0;
+			break;
+		case 1:
+		case 2:
+		case 3:
+			if ((p2 & 15) == 1) result = vx | vy;
+			else if ((p2 & 15) == 2) result = vx & vy;
+			else result = vx ^ vy;
+			flag = LANE_SPLAT(0);
+			setsFlag = (quirks & QUIRK_COSMAC_VF_RESET) != 0;
+			break;
+		case 4:
+			result = vx + vy;
+			flag = (LaneBytes)(result < vx) & 1;
+			break;
+		case 5:
+			result = vx - vy;
+			flag = (LaneBytes)(vx >= vy) & 1;
+			break;
+		case 6:
+			if (!(quirks & QUIRK_SUPER_CHIP_SHIFT)) {
+				result = vy >> 1;
+				flag = vy & 1;
+			} else {
+				result = vx >> 1;
+				flag = vx & 1;
+			}
+			break;
+		case 7:
+			result = vy - vx;
+			flag = (LaneBytes)(vy >= vx) & 1;
+			break;
+		default:
+			if (!(quirks & QUIRK_SUPER_CHIP_SHIFT)) {
+				result = vy << 1;
+				flag = vy & 8;
+			} else {
+				result = vx << 1;
+				flag = (vx & 8) >> 3;
+			}
+			break;
+		}
+		// VF is written after VX, as the interpreters do
+		reg[x] = LANE_SELECT(group, result, vx);
+		if (setsFlag) reg[15] = LANE_SELECT(group, flag, reg[15]);
+		break;
+	}
+	case 9:
+		skip = (LaneBytes)(vx != vy);
+		break;
+	case 10:
+		block->regI = LANE_SELECT_WORDS(group, LANE_SPLAT_WORDS(nnn), block->regI);
+		break;
+	case 11: {
+		LaneWords offset = LANE_WIDEN(quirks & QUIRK_SUPER_CHIP_JUMP ? vx : reg[0]);
+		block->pc = LANE_SELECT_WORDS(group, offset + nnn, pc);
+		return;
+	}
+	case 12: {
+		LaneBytes random;
+		lane_next_random(block, &group, &random);
+		reg[x] = LANE_SELECT(group, random & p2, vx);
+		break;
+	}
+	case 14: {
+		LaneBytes key = block->keyBuffer;
+		if (p2 == 0x9e) {
+			skip = (LaneBytes)(key == (vx & 15));
+			block->keyBuffer = LANE_SELECT(group & skip, LANE_SPLAT(0xff), key);
+		} else {
+			skip = (LaneBytes)(key != (vx & 15));
+			block->keyBuffer = LANE_SELECT(group, LANE_SPLAT(0xff), key);
+		}
+		break;
+	}
+	case 15:
+		switch (p2) {
+		case 0x0a: {
+			// lanes without a key stay on the instruction
+			LaneBytes pressed = group & (LaneBytes)(block->keyBuffer != 0xff);
+			reg[x] = LANE_SELECT(pressed, block->keyBuffer, vx);
+			block->keyBuffer = LANE_SELECT(pressed, LANE_SPLAT(0xff), block->keyBuffer);
+			block->pc = LANE_SELECT_WORDS(pressed, pc + 2, pc);
+			return;
+		}
+		case 0x07:
+			reg[x] = LANE_SELECT(group, block->delayTimer, vx);
+			break;
+		case 0x15:
+			block->delayTimer = LANE_SELECT(group, vx, block->delayTimer);
+			break;
+		case 0x18:
+			block->soundTimer = LANE_SELECT(group, vx, block->soundTimer);
+			break;
+		case 0x1e: {
+			LaneWords regI = block->regI + LANE_WIDEN(vx);
+			block->regI = LANE_SELECT_WORDS(group, regI, block->regI);
+			if (quirks & QUIRK_AMIGA_INDEX_OVERFLOW) {
+				reg[15] = LANE_SELECT(group, LANE_NARROW_MASK(regI > 0x1000) & 1, reg[15]);
+			}
+			break;
+		}
+		case 0x29:
+			block->regI = LANE_SELECT_WORDS(group, LANE_WIDEN(vx) * 5 + FONT_MEMORY_SECTOR, block->regI);
+			break;
+		}
+		break;
+	}
+
+	block->pc = LANE_SELECT_WORDS(group, pc + 2 + (LANE_WIDEN(skip) & 2), pc);
+}
+
+// The group instructions that touch a lane's Machine. Returns 0 when the lane has to run
+// the instruction on its own, e.g. to raise an error.
+static int lockstep_lane_instruction(Chip8Lockstep * lockstep, unsigned int lane, unsigned char p1, unsigned char p2) {
+	Chip8 * chip8 = lockstep->lanes[lane];
+	Machine * machine = &chip8->machine;
+	LaneBlock * block = &lockstep->blocks[lane / LOCKSTEP_WIDTH];
+	unsigned int i = lane % LOCKSTEP_WIDTH;
+	unsigned char x = p1 & 15;
+	unsigned char vx = block->registers[x][i];
+	unsigned short int regI = block->regI[i];
+	unsigned short int pc = block->pc[i];
+
+	switch (p1 >> 4) {
+	case 0:
+		if (p2 == 0xe0) {
+			memset(machine->screen.rows, 0, sizeof(machine->screen.rows));
+			break;
+		}
+		if (p2 != 0xee || machine->stack.sp == 0) return 0;
+		machine->stack.sp--;
+		pc = machine->stack.mem[machine->stack.sp];
+		break;
+	case 2:
+		if (machine->stack.sp >= STACK_LIMIT) return 0;
+		machine->stack.mem[machine->stack.sp++] = pc;
+		block->pc[i] = ((p1 & 15) << 8) | p2;
+		return 1;
+	case 13:
+		draw_sprite(machine, p2 & 15, regI, vx, block->registers[p2 >> 4][i]);
+		block->registers[15][i] = machine->registers.reg[15];
+		break;
+	case 15:
+		switch (p2) {
+		case 0x33:
+			machine->ram.mem[MEMORY_ADDRESS(regI + 2)] = vx % 10;
+			machine->ram.mem[MEMORY_ADDRESS(regI + 1)] = (vx / 10) % 10;
+			machine->ram.mem[MEMORY_ADDRESS(regI)] = vx / 100;
+			invalidate_code(chip8, regI, 3);
+			lockstep_mark_written(lockstep, regI, 3);
+			break;
+		case 0x55:
+			for (int r = 0; r <= x; r++) {
+				machine->ram.mem[MEMORY_ADDRESS(regI + r)] = block->registers[r][i];
+			}
+			invalidate_code(chip8, regI, x + 1);
+			lockstep_mark_written(lockstep, regI, x + 1);
+			if (lockstep->quirks & QUIRK_COSMAC_INDEX_INCREMENT) block->regI[i] = regI + x + 1;
+			break;
+		case 0x65:
+			for (int r = 0; r <= x; r++) {
+				block->registers[r][i] = machine->ram.mem[MEMORY_ADDRESS(regI + r)];
+			}
+			if (lockstep->quirks & QUIRK_COSMAC_INDEX_INCREMENT) block->regI[i] = regI + x + 1;
+			break;
+		default:
+			return 0;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	block->pc[i] = pc + 2;
+	return 1;
+}
+
+static void lockstep_execute_group(Chip8Lockstep * lockstep, unsigned int firstBlock, unsigned short int pc) {
+	int shared = pc < MEMORY_LIMIT - 1 && !lockstep->written[pc] && !lockstep->written[pc + 1];
+	// a pc outside RAM is left to execute_instruction, which halts the lane
+	unsigned char p1 = shared ? lockstep->code[pc] : 0;
+	unsigned char p2 = shared ? lockstep->code[pc + 1] : 0;
+
+	if (shared && lockstep_has_vector_form(p1, p2)) {
+		for (unsigned int b = firstBlock; b < lockstep->blockCount; b++) {
+			lockstep_vector_block(&lockstep->blocks[b], p1, p2, lockstep->quirks);
+		}
+		return;
+	}
+
+	// memory written by any lane may differ between lanes, so those run the bytes they hold
+	for (unsigned int b = firstBlock; b < lockstep->blockCount; b++) {
+		LaneBlock * block = &lockstep->blocks[b];
+		if (!lane_any(&block->group)) continue;
+		for (unsigned int i = 0; i < LOCKSTEP_WIDTH; i++) {
+			if (!block->group[i]) continue;
+			unsigned int lane = b * LOCKSTEP_WIDTH + i;
+			if (!shared || !lockstep_lane_instruction(lockstep, lane, p1, p2)) {
+				lockstep->groupedInstructions--;
+				lockstep_execute_lane(lockstep, lane);
+			}
+		}
+	}
+}
+
+// every live lane runs exactly one instruction
+static void lockstep_run_step(Chip8Lockstep * lockstep) {
+	for (unsigned int b = 0; b < lockstep->blockCount; b++) {
+		lockstep->blocks[b].pending = lockstep->blocks[b].live;
+	}
+	lockstep->groupedInstructions += lockstep->liveCount;
+
+	unsigned int firstBlock = 0;
+	for (unsigned int groups = 0;; groups++) {
+		while (firstBlock < lockstep->blockCount && !lane_any(&lockstep->blocks[firstBlock].pending)) firstBlock++;
+		if (firstBlock == lockstep->blockCount) return;
+
+		LaneBlock * leader = &lockstep->blocks[firstBlock];
+		unsigned int i = 0;
+		while (!leader->pending[i]) i++;
+
+		// too many groups costs more than running the stragglers one by one
+		if (groups == LOCKSTEP_MAX_GROUPS) {
+			for (unsigned int b = firstBlock; b < lockstep->blockCount; b++) {
+				for (i = 0; i < LOCKSTEP_WIDTH; i++) {
+					if (!lockstep->blocks[b].pending[i]) continue;
+					lockstep->groupedInstructions--;
+					lockstep_execute_lane(lockstep, b * LOCKSTEP_WIDTH + i);
+				}
+			}
+			return;
+		}
+
+		unsigned short int pc = leader->pc[i];
+		for (unsigned int b = firstBlock; b < lockstep->blockCount; b++) {
+			LaneBlock * block = &lockstep->blocks[b];
+			block->group = block->pending & LANE_NARROW_MASK(block->pc == pc);
+			block->pending &= ~block->group;
+		}
+		lockstep_execute_group(lockstep, firstBlock, pc);
+	}
+}
+
+Chip8Lockstep * chip8_lockstep_create(unsigned int count) {
+	if (count == 0) {
+		return 0;
+	}
+	Chip8Lockstep * lockstep = calloc(1, sizeof(*lockstep));
+	if (lockstep == 0) {
+		return 0;
+	}
+	lockstep->count = count;
+	lockstep->blockCount = (count + LOCKSTEP_WIDTH - 1) / LOCKSTEP_WIDTH;
+	lockstep->lanes = calloc(count, sizeof(*lockstep->lanes));
+	lockstep->blocks = aligned_alloc(sizeof(LaneWords), lockstep->blockCount * sizeof(LaneBlock));
+	if (lockstep->lanes == 0 || lockstep->blocks == 0) {
+		chip8_lockstep_destroy(lockstep);
+		return 0;
+	}
+	memset(lockstep->blocks, 0, lockstep->blockCount * sizeof(LaneBlock));
+	for (unsigned int i = 0; i < count; i++) {
+		lockstep->lanes[i] = chip8_create();
+		if (lockstep->lanes[i] == 0) {
+			chip8_lockstep_destroy(lockstep);
+			return 0;
+		}
+	}
+	chip8_lockstep_memory_changed(lockstep);
+	return lockstep;
+}
+
+void chip8_lockstep_destroy(Chip8Lockstep * lockstep) {
+	if (!lockstep) return;
+	if (lockstep->lanes) {
+		for (unsigned int i = 0; i < lockstep->count; i++) {
+			chip8_destroy(lockstep->lanes[i]);
+		}
+	}
+	free(lockstep->lanes);
+	free(lockstep->blocks);
+	free(lockstep);
+}
+
+int chip8_lockstep_load(Chip8Lockstep * lockstep, const unsigned char * program, size_t size) {
+	for (unsigned int i = 0; i < lockstep->count; i++) {
+		if (chip8_load(lockstep->lanes[i], program, size)) {
+			return 1;
+		}
+	}
+	chip8_lockstep_memory_changed(lockstep);
+	return 0;
+}
+
+Chip8 * chip8_lockstep_lane(Chip8Lockstep * lockstep, unsigned int lane) {
+	return lockstep->lanes[lane];
+}
+
+void chip8_lockstep_memory_changed(Chip8Lockstep * lockstep) {
+	const unsigned char * first = lockstep->lanes[0]->machine.ram.mem;
+	memcpy(lockstep->code, first, MEMORY_LIMIT);
+	memset(lockstep->written, 0, MEMORY_LIMIT);
+	for (unsigned int i = 1; i < lockstep->count; i++) {
+		const unsigned char * mem = lockstep->lanes[i]->machine.ram.mem;
+		for (unsigned int a = 0; a < MEMORY_LIMIT; a++) {
+			if (mem[a] != first[a]) lockstep->written[a] = 1;
+		}
+	}
+}
+
+unsigned int chip8_lockstep_step(Chip8Lockstep * lockstep, unsigned int count) {
+	const Machine * leader = 0;
+	for (unsigned int i = 0; i < lockstep->count && !leader; i++) {
+		if (!lockstep->lanes[i]->machine.halted) leader = &lockstep->lanes[i]->machine;
+	}
+	if (!leader) {
+		return 0;
+	}
+	lockstep->quirks = leader->quirks;
+	lockstep->instructionRate = leader->instructionRate;
+	lockstep->timerPhase = leader->timerPhase;
+	lockstep->liveCount = 0;
+
+	unsigned int independentMost = 0;
+	for (unsigned int lane = 0; lane < lockstep->count; lane++) {
+		Machine * machine = &lockstep->lanes[lane]->machine;
+		LaneBlock * block = &lockstep->blocks[lane / LOCKSTEP_WIDTH];
+		unsigned int i = lane % LOCKSTEP_WIDTH;
+		block->live[i] = 0;
+		if (machine->halted) continue;
+
+		// lanes that cannot share the quirks and timer ticks of the leader run on their own
+		if (machine->quirks != lockstep->quirks || machine->instructionRate != lockstep->instructionRate || machine->timerPhase != lockstep->timerPhase) {
+			unsigned int ran = chip8_step(lockstep->lanes[lane], count);
+			if (ran > independentMost) independentMost = ran;
+			continue;
+		}
+		lockstep_gather(lockstep, lane);
+		block->live[i] = 0xff;
+		lockstep->liveCount++;
+	}
+
+	lockstep->executed = 0;
+	while (lockstep->executed < count && lockstep->liveCount) {
+		unsigned int untilTick = (lockstep->instructionRate - lockstep->timerPhase + TIMER_RATE - 1) / TIMER_RATE;
+		unsigned int batch = count - lockstep->executed < untilTick ? count - lockstep->executed : untilTick;
+
+		unsigned int ran = 0;
+		while (ran < batch && lockstep->liveCount) {
+			lockstep->batchRan = ++ran;
+			lockstep_run_step(lockstep);
+		}
+		lockstep->executed += ran;
+		lockstep->timerPhase += ran * TIMER_RATE;
+		while (lockstep->timerPhase >= lockstep->instructionRate) {
+			lockstep->timerPhase -= lockstep->instructionRate;
+			for (unsigned int b = 0; b < lockstep->blockCount; b++) {
+				LaneBlock * block = &lockstep->blocks[b];
+				block->delayTimer -= (LaneBytes)(block->delayTimer != 0) & 1;
+				block->soundTimer -= (LaneBytes)(block->soundTimer != 0) & 1;
+			}
+		}
+	}
+
+	for (unsigned int lane = 0; lane < lockstep->count; lane++) {
+		if (!lockstep->blocks[lane / LOCKSTEP_WIDTH].live[lane % LOCKSTEP_WIDTH]) continue;
+		Machine * machine = &lockstep->lanes[lane]->machine;
+		lockstep_scatter(lockstep, lane);
+		machine->cycles += lockstep->executed;
+		machine->timerPhase = lockstep->timerPhase;
+	}
+	return lockstep->executed > independentMost ? lockstep->executed : independentMost;
+}
+
+void chip8_lockstep_stats(const Chip8Lockstep * lockstep, unsigned long long int * grouped, unsigned long long int * scalar) {
+	*grouped = lockstep->groupedInstructions;
+	*scalar = lockstep->scalarInstructions;
+}
+
+// FNV-1a, good enough to tell two end states apart in CI logs
+unsigned long long int chip8_hash_bytes(unsigned long long int hash, const void * data, size_t size) {
+	const unsigned char * bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+typedef struct {
+	const char * name;
+	unsigned char quirks;
+} QuirkProfile;
+
+// Legacy and modern SUPER-CHIP only part ways on display wait and sprite clipping, which
+// are not emulated, so they share quirk bits for now.
+static const QuirkProfile quirkProfiles[] = {
+	{"cosmac", QUIRK_AMIGA_INDEX_OVERFLOW | QUIRK_COSMAC_INDEX_INCREMENT | QUIRK_COSMAC_VF_RESET},
+	{"schip-modern", QUIRK_SUPER_CHIP_SHIFT | QUIRK_SUPER_CHIP_JUMP | QUIRK_AMIGA_INDEX_OVERFLOW},
+	{"schip-legacy", QUIRK_SUPER_CHIP_SHIFT | QUIRK_SUPER_CHIP_JUMP | QUIRK_AMIGA_INDEX_OVERFLOW},
+};
+
+#define QUIRK_PROFILE_NAMES (sizeof(quirkProfiles) / sizeof(*quirkProfiles))
+
+typedef struct {
+	unsigned long long int hash;
+	unsigned char quirks;
+} RomProfile;
+
+// Profiles picked automatically when a ROM is loaded, keyed by chip8_hash_bytes of the whole
+// program file. Clients can still override them after loading.
+static const RomProfile romProfiles[] = {
+	// chip8/programs/4-flags.ch8 only reports all flags correct with the SUPER-CHIP shifts
+	{0x518c0287840c0507ULL, QUIRK_SUPER_CHIP_SHIFT | QUIRK_SUPER_CHIP_JUMP | QUIRK_AMIGA_INDEX_OVERFLOW},
+};
+
+#define ROM_PROFILE_COUNT (sizeof(romProfiles) / sizeof(*romProfiles))
+
+int chip8_parse_profile(const char * text) {
+	for (unsigned int i = 0; i < QUIRK_PROFILE_NAMES; i++) {
+		if (strcmp(text, quirkProfiles[i].name) == 0) return quirkProfiles[i].quirks;
+	}
+	char * end;
+	unsigned long int quirks = strtoul(text, &end, 0);
+	if (*text == 0 || *end != 0 || quirks >= QUIRK_PROFILE_COUNT) return -1;
+	return quirks;
+}
+
+const char * chip8_profile_name(unsigned char quirks) {
+	for (unsigned int i = 0; i < QUIRK_PROFILE_NAMES; i++) {
+		if (quirkProfiles[i].quirks == quirks) return quirkProfiles[i].name;
+	}
+	return "custom";
+}
+
+static int find_rom_profile(const unsigned char * program, size_t size) {
+	unsigned long long int hash = chip8_hash_bytes(HASH_SEED, program, size);
+	for (unsigned int i = 0; i < ROM_PROFILE_COUNT; i++) {
+		if (romProfiles[i].hash == hash) return romProfiles[i].quirks;
+	}
+	return -1;
+}
+
+Chip8 * chip8_create() {
+	size_t size = (sizeof(Chip8) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+	Chip8 * chip8 = aligned_alloc(CACHE_LINE_SIZE, size);
+	if (chip8 == 0) {
+		return 0;
+	}
+	memset(chip8, 0, size);
+	initialize_machine(&chip8->machine);
+	chip8->engine = ENGINE_THREADED;
+	chip8->fastForward = 1;
+	chip8->image = chip8->machine.ram;
+	chip8->imageHash = chip8_hash_bytes(HASH_SEED, &chip8->image, sizeof(chip8->image));
+	return chip8;
+}
+
+void chip8_destroy(Chip8 * chip8) {
+	if (!chip8) return;
+	jit_destroy(chip8->jit);
+	rewind_free(chip8->rewind);
+	free(chip8->profile);
+	free(chip8);
+}
+
+int chip8_load(Chip8 * chip8, const unsigned char * program, size_t size) {
+	if (size > MEMORY_LIMIT - PROGRAM_MEMORY_SECTOR) {
+		return 1;
+	}
+	memcpy(&chip8->machine.ram.mem[PROGRAM_MEMORY_SECTOR], program, size);
+	clear_code_caches(chip8);
+	chip8->image = chip8->machine.ram;
+	chip8->imageHash = chip8_hash_bytes(HASH_SEED, &chip8->image, sizeof(chip8->image));
+	// keyframes of the old program no longer load
+	rewind_clear(chip8->rewind);
+
+	int quirks = find_rom_profile(program, size);
+	if (quirks >= 0) chip8->machine.quirks = quirks;
+	return 0;
+}
+
+void chip8_set_keys(Chip8 * chip8, unsigned short int keys) {
+	if (chip8->machine.keyBuffer != -1 || keys == 0) return;
+	chip8->machine.keyBuffer = __builtin_ctz(keys);
+}
+
+const uint64_t * chip8_get_framebuffer(const Chip8 * chip8) {
+	return chip8->machine.screen.rows;
+}
+
+Machine * chip8_machine(Chip8 * chip8) {
+	return &chip8->machine;
+}
+
+void chip8_memory_changed(Chip8 * chip8) {
+	clear_code_caches(chip8);
+}
+
+void chip8_set_fast_forward(Chip8 * chip8, int enable) {
+	chip8->fastForward = enable;
+}
+
+void chip8_set_engine(Chip8 * chip8, int engine) {
+	chip8->engine = engine;
+}
+
+void chip8_seed(Chip8 * chip8, unsigned long long int seed) {
+	seed_random(&chip8->machine, seed);
+}
+
+// Save states are a header followed by tagged chunks with every integer little-endian, so a
+// state loads back on any build. Readers skip chunks they do not know. Only the live part of
+// the stack is kept, and RAM is stored as the runs that differ from the image the program
+// was loaded into.
+#define STATE_MAGIC "C8ST"
+#define STATE_VERSION 1
+#define STATE_RUN_GAP 4
+#define STATE_NO_KEY 0xff
+
+enum {
+	STATE_CHUNK_CPU = 1,
+	STATE_CHUNK_STACK = 2,
+	STATE_CHUNK_RAM = 4,
+	STATE_CHUNK_SCREEN = 8,
+	STATE_REQUIRED_CHUNKS = 15
+};
+
+typedef struct {
+	unsigned char * data;
+	size_t size;
+	size_t used;
+} StateWriter;
+
+typedef struct {
+	const unsigned char * data;
+	size_t size;
+	size_t used;
+	int failed;
+} StateReader;
+
+static void state_write_bytes(StateWriter * writer, const void * bytes, size_t size) {
+	// past the end of the buffer only the size is counted, like snprintf
+	if (writer->used + size <= writer->size) memcpy(writer->data + writer->used, bytes, size);
+	writer->used += size;
+}
+
+static void state_write_u8(StateWriter * writer, unsigned int value) {
+	unsigned char byte = value;
+	state_write_bytes(writer, &byte, 1);
+}
+
+static void state_write_u16(StateWriter * writer, unsigned int value) {
+	unsigned char bytes[2] = {value, value >> 8};
+	state_write_bytes(writer, bytes, 2);
+}
+
+static void state_write_u32(StateWriter * writer, unsigned int value) {
+	unsigned char bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+	state_write_bytes(writer, bytes, 4);
+}
+
+static void state_write_u64(StateWriter * writer, unsigned long long int value) {
+	state_write_u32(writer, value);
+	state_write_u32(writer, value >> 32);
+}
+
+static size_t state_begin_chunk(StateWriter * writer, const char * tag) {
+	state_write_bytes(writer, tag, 4);
+	state_write_u32(writer, 0);
+	return writer->used;
+}
+
+static void state_end_chunk(StateWriter * writer, size_t start) {
+	if (writer->used > writer->size) return;
+	unsigned int size = writer->used - start;
+	unsigned char * length = writer->data + start - 4;
+	length[0] = size;
+	length[1] = size >> 8;
+	length[2] = size >> 16;
+	length[3] = size >> 24;
+}
+
+static const unsigned char * state_read_bytes(StateReader * reader, size_t size) {
+	if (reader->failed || reader->size - reader->used < size) {
+		reader->failed = 1;
+		return 0;
+	}
+	const unsigned char * bytes = reader->data + reader->used;
+	reader->used += size;
+	return bytes;
+}
+
+static unsigned int state_read_u8(StateReader * reader) {
+	const unsigned char * bytes = state_read_bytes(reader, 1);
+	return bytes ? bytes[0] : 0;
+}
+
+static unsigned int state_read_u16(StateReader * reader) {
+	const unsigned char * bytes = state_read_bytes(reader, 2);
+	return bytes ? bytes[0] | (bytes[1] << 8) : 0;
+}
+
+static unsigned int state_read_u32(StateReader * reader) {
+	const unsigned char * bytes = state_read_bytes(reader, 4);
+	return bytes ? bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24) : 0;
+}
+
+static unsigned long long int state_read_u64(StateReader * reader) {
+	unsigned long long int low = state_read_u32(reader);
+	return low | (unsigned long long int)state_read_u32(reader) << 32;
+}
+
+static void state_write_ram(StateWriter * writer, const Chip8 * chip8) {
+	const unsigned char * mem = chip8->machine.ram.mem;
+	const unsigned char * image = chip8->image.mem;
+	state_write_u64(writer, chip8->imageHash);
+
+	unsigned int i = 0;
+	while (i < MEMORY_LIMIT) {
+		if (mem[i] == image[i]) {
+			i++;
+			continue;
+		}
+		// short stretches of equal bytes cost less inside a run than as a new run header
+		unsigned int end = i + 1;
+		unsigned int last = i;
+		while (end < MEMORY_LIMIT && end - last <= STATE_RUN_GAP) {
+			if (mem[end] != image[end]) last = end;
+			end++;
+		}
+		state_write_u16(writer, i);
+		state_write_u16(writer, last + 1 - i);
+		state_write_bytes(writer, mem + i, last + 1 - i);
+		i = last + 1;
+	}
+}
+
+static size_t save_state(const Chip8 * chip8, unsigned char * buffer, size_t size, int withError) {
+	const Machine * machine = &chip8->machine;
+	StateWriter writer = {buffer, size, 0};
+	size_t chunk;
+
+	state_write_bytes(&writer, STATE_MAGIC, 4);
+	state_write_u16(&writer, STATE_VERSION);
+	state_write_u16(&writer, 0);
+
+	chunk = state_begin_chunk(&writer, "CPU ");
+	state_write_u16(&writer, machine->pc);
+	state_write_u16(&writer, machine->regI);
+	state_write_bytes(&writer, machine->registers.reg, REGISTER_COUNT);
+	state_write_u8(&writer, machine->delayTimer);
+	state_write_u8(&writer, machine->soundTimer);
+	state_write_u8(&writer, machine->keyBuffer < 0 ? STATE_NO_KEY : machine->keyBuffer);
+	state_write_u8(&writer, machine->quirks);
+	state_write_u8(&writer, machine->halted);
+	state_write_u32(&writer, machine->instructionRate);
+	state_write_u32(&writer, machine->timerPhase);
+	state_write_u32(&writer, machine->cycles);
+	state_end_chunk(&writer, chunk);
+
+	chunk = state_begin_chunk(&writer, "RNG ");
+	for (int i = 0; i < 4; i++) {
+		state_write_u32(&writer, machine->randomState[i]);
+	}
+	state_end_chunk(&writer, chunk);
+
+	chunk = state_begin_chunk(&writer, "STCK");
+	unsigned int sp = machine->stack.sp < STACK_LIMIT ? machine->stack.sp : STACK_LIMIT;
+	state_write_u16(&writer, sp);
+	for (unsigned int i = 0; i < sp; i++) {
+		state_write_u16(&writer, machine->stack.mem[i]);
+	}
+	state_end_chunk(&writer, chunk);
+
+	chunk = state_begin_chunk(&writer, "RAM ");
+	state_write_ram(&writer, chip8);
+	state_end_chunk(&writer, chunk);
+
+	chunk = state_begin_chunk(&writer, "SCRN");
+	for (int i = 0; i < SCREEN_HEIGHT; i++) {
+		state_write_u64(&writer, machine->screen.rows[i]);
+	}
+	state_end_chunk(&writer, chunk);
+
+	if (*machine->error && withError) {
+		chunk = state_begin_chunk(&writer, "ERR ");
+		state_write_bytes(&writer, machine->error, strnlen(machine->error, MAX_STAT_WIDTH - 1));
+		state_end_chunk(&writer, chunk);
+	}
+	return writer.used;
+}
+
+size_t chip8_save_state(const Chip8 * chip8, unsigned char * buffer, size_t size) {
+	return save_state(chip8, buffer, size, 1);
+}
+
+// Fills machine from one chunk. Returns 0, 2 if the chunk is malformed or 3 if it belongs to
+// another program.
+static int state_read_chunk(const Chip8 * chip8, Machine * machine, const char * tag, StateReader * chunk, unsigned int * found) {
+	if (memcmp(tag, "CPU ", 4) == 0) {
+		machine->pc = state_read_u16(chunk);
+		machine->regI = state_read_u16(chunk);
+		const unsigned char * registers = state_read_bytes(chunk, REGISTER_COUNT);
+		if (registers) memcpy(machine->registers.reg, registers, REGISTER_COUNT);
+		machine->delayTimer = state_read_u8(chunk);
+		machine->soundTimer = state_read_u8(chunk);
+		unsigned int key = state_read_u8(chunk);
+		machine->keyBuffer = key == STATE_NO_KEY ? -1 : (int)key;
+		machine->quirks = state_read_u8(chunk);
+		machine->halted = state_read_u8(chunk);
+		machine->instructionRate = state_read_u32(chunk);
+		machine->timerPhase = state_read_u32(chunk);
+		machine->cycles = state_read_u32(chunk);
+		*found |= STATE_CHUNK_CPU;
+		if (key >= REGISTER_COUNT && key != STATE_NO_KEY) return 2;
+		// any I is valid, since what it addresses wraps, but an instruction at pc must fit in RAM
+		if (machine->pc >= MEMORY_LIMIT - 1) return 2;
+		if (machine->quirks >= QUIRK_PROFILE_COUNT || machine->instructionRate == 0) return 2;
+		return chunk->failed ? 2 : 0;
+	}
+	if (memcmp(tag, "STCK", 4) == 0) {
+		machine->stack.sp = state_read_u16(chunk);
+		if (machine->stack.sp > STACK_LIMIT) return 2;
+		for (unsigned int i = 0; i < machine->stack.sp; i++) {
+			machine->stack.mem[i] = state_read_u16(chunk);
+			if (machine->stack.mem[i] >= MEMORY_LIMIT - 1) return 2;
+		}
+		*found |= STATE_CHUNK_STACK;
+		return chunk->failed ? 2 : 0;
+	}
+	if (memcmp(tag, "RAM ", 4) == 0) {
+		// runs only make sense on top of the same image
+		unsigned long long int imageHash = state_read_u64(chunk);
+		if (chunk->failed) return 2;
+		if (imageHash != chip8->imageHash) return 3;
+		machine->ram = chip8->image;
+		while (chunk->used < chunk->size) {
+			unsigned int offset = state_read_u16(chunk);
+			unsigned int size = state_read_u16(chunk);
+			const unsigned char * bytes = state_read_bytes(chunk, size);
+			if (!bytes || offset + size > MEMORY_LIMIT) return 2;
+			memcpy(machine->ram.mem + offset, bytes, size);
+		}
+		*found |= STATE_CHUNK_RAM;
+		return 0;
+	}
+	if (memcmp(tag, "SCRN", 4) == 0) {
+		for (int i = 0; i < SCREEN_HEIGHT; i++) {
+			machine->screen.rows[i] = state_read_u64(chunk);
+		}
+		*found |= STATE_CHUNK_SCREEN;
+		return chunk->failed ? 2 : 0;
+	}
+	if (memcmp(tag, "RNG ", 4) == 0) {
+		// optional, states saved before it existed keep the instance's generator
+		for (int i = 0; i < 4; i++) {
+			machine->randomState[i] = state_read_u32(chunk);
+		}
+		return chunk->failed ? 2 : 0;
+	}
+	if (memcmp(tag, "ERR ", 4) == 0) {
+		size_t size = chunk->size < MAX_STAT_WIDTH - 1 ? chunk->size : MAX_STAT_WIDTH - 1;
+		memcpy(machine->error, chunk->data, size);
+		machine->error[size] = 0;
+	}
+	return 0;
+}
+
+int chip8_load_state(Chip8 * chip8, const unsigned char * data, size_t size) {
+	StateReader reader = {data, size, 0, 0};
+	const unsigned char * magic = state_read_bytes(&reader, 4);
+	unsigned int version = state_read_u16(&reader);
+	state_read_u16(&reader);
+	if (reader.failed || memcmp(magic, STATE_MAGIC, 4) != 0 || version > STATE_VERSION) {
+		return 2;
+	}
+
+	// nothing changes unless the whole state is good
+	Machine machine = chip8->machine;
+	*machine.error = 0;
+	unsigned int found = 0;
+	while (reader.used < reader.size) {
+		const unsigned char * tag = state_read_bytes(&reader, 4);
+		unsigned int chunkSize = state_read_u32(&reader);
+		const unsigned char * chunkData = state_read_bytes(&reader, chunkSize);
+		if (reader.failed) {
+			return 2;
+		}
+
+		StateReader chunk = {chunkData, chunkSize, 0, 0};
+		int result = state_read_chunk(chip8, &machine, (const char *)tag, &chunk, &found);
+		if (result) {
+			return result;
+		}
+	}
+	if (found != STATE_REQUIRED_CHUNKS) {
+		return 2;
+	}
+
+	chip8->machine = machine;
+	clear_code_caches(chip8);
+	return 0;
+}
+
+// Rewind history: every recorded frame stores the XOR of the machine against the frame
+// before it, run-length encoded over 8-byte words, so an unchanged RAM or screen costs next
+// to nothing. Every keyframeInterval frames also carry a keyframe, the same encoding taken
+// against a blank machine holding the load image, which bounds how many deltas a long jump
+// back has to apply. Save states cannot serve as keyframes: they leave out bytes such as the
+// dead part of the stack, and a delta is only exact on top of the very bytes it was taken
+// from. Entries live in one ring of budget bytes and the oldest are dropped to make room.
+typedef struct {
+	size_t offset;
+	unsigned int deltaSize;
+	unsigned int keyframeSize;
+} RewindEntry;
+
+typedef struct RewindBuffer {
+	unsigned char * data;
+	size_t capacity;
+	RewindEntry * entries;
+	unsigned int entryCapacity;
+	// how far the ring of entries may grow, one entry for every smallest one the budget holds
+	unsigned int entryLimit;
+	unsigned int first;
+	unsigned int count;
+	unsigned int keyframeInterval;
+	unsigned int sinceKeyframe;
+	// the machine as of the newest frame, what the next delta is taken against
+	Machine previous;
+	Machine blank;
+	unsigned char * scratch;
+	size_t scratchSize;
+	double recordSeconds;
+	unsigned long long int records;
+} RewindBuffer;
+
+#define REWIND_WORDS (sizeof(Machine) / sizeof(uint64_t))
+// a delta of a frame in which nothing changed is a single empty run
+#define REWIND_MIN_ENTRY_SIZE 4
+#define REWIND_INITIAL_ENTRIES 1024
+#define REWIND_MAX_ENTRIES (1U << 30)
+
+static double rewind_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static RewindEntry * rewind_entry(RewindBuffer * rewind, unsigned int index) {
+	return &rewind->entries[(rewind->first + index) % rewind->entryCapacity];
+}
+
+static void rewind_evict(RewindBuffer * rewind) {
+	rewind->first = (rewind->first + 1) % rewind->entryCapacity;
+	rewind->count--;
+}
+
+// Doubles the ring of entries up to entryLimit, unrolled so the oldest entry comes first.
+// Returns 1 when the ring cannot grow.
+static int rewind_grow(RewindBuffer * rewind) {
+	if (rewind->entryCapacity >= rewind->entryLimit) return 1;
+	unsigned int capacity = rewind->entryCapacity < rewind->entryLimit / 2 ? rewind->entryCapacity * 2 : rewind->entryLimit;
+	RewindEntry * entries = malloc(capacity * sizeof(*entries));
+	if (entries == 0) return 1;
+	for (unsigned int i = 0; i < rewind->count; i++) {
+		entries[i] = *rewind_entry(rewind, i);
+	}
+	free(rewind->entries);
+	rewind->entries = entries;
+	rewind->entryCapacity = capacity;
+	rewind->first = 0;
+	return 0;
+}
+
+// Finds size contiguous bytes after the newest entry, dropping the oldest entries until
+// they fit. Returns 0 if size can never fit.
+static unsigned char * rewind_reserve(RewindBuffer * rewind, size_t size) {
+	if (size > rewind->capacity) return 0;
+	while (1) {
+		if (rewind->count == rewind->entryCapacity && rewind_grow(rewind)) {
+			rewind_evict(rewind);
+			continue;
+		}
+		if (rewind->count == 0) return rewind->data;
+
+		RewindEntry * oldest = rewind_entry(rewind, 0);
+		RewindEntry * newest = rewind_entry(rewind, rewind->count - 1);
+		size_t head = newest->offset + newest->deltaSize + newest->keyframeSize;
+		if (newest->offset >= oldest->offset) {
+			if (rewind->capacity - head >= size) return rewind->data + head;
+			if (oldest->offset >= size) return rewind->data;
+		} else if (oldest->offset - head >= size) {
+			return rewind->data + head;
+		}
+		rewind_evict(rewind);
+	}
+}
+
+static void rewind_put_u16(unsigned char * out, unsigned int value) {
+	out[0] = value;
+	out[1] = value >> 8;
+}
+
+static unsigned int rewind_get_u16(const unsigned char * in) {
+	return in[0] | (in[1] << 8);
+}
+
+// Writes (skipped words, changed words, changed words XORed) runs and brings previous up
+// to date in the same pass. Every delta holds at least one run, so no entry is empty.
+static size_t rewind_encode(unsigned char * out, Machine * previous, const Machine * machine) {
+	unsigned char * start = out;
+	unsigned char * before = (unsigned char *)previous;
+	const unsigned char * after = (const unsigned char *)machine;
+	unsigned int i = 0;
+	while (i < REWIND_WORDS) {
+		unsigned int skip = i;
+		uint64_t a, b;
+		for (; i < REWIND_WORDS; i++) {
+			memcpy(&a, before + i * 8, 8);
+			memcpy(&b, after + i * 8, 8);
+			if (a != b) break;
+		}
+		if (i == REWIND_WORDS) break;
+		unsigned int literal = i;
+		for (; i < REWIND_WORDS; i++) {
+			memcpy(&a, before + i * 8, 8);
+			memcpy(&b, after + i * 8, 8);
+			if (a == b) break;
+			a ^= b;
+			memcpy(out + 4 + (i - literal) * 8, &a, 8);
+			memcpy(before + i * 8, &b, 8);
+		}
+		rewind_put_u16(out, literal - skip);
+		rewind_put_u16(out + 2, i - literal);
+		out += 4 + (i - literal) * 8;
+	}
+	if (out == start) {
+		rewind_put_u16(out, 0);
+		rewind_put_u16(out + 2, 0);
+		out += 4;
+	}
+	return out - start;
+}
+
+static void rewind_blank(RewindBuffer * rewind, const Chip8 * chip8) {
+	memset(&rewind->blank, 0, sizeof(rewind->blank));
+	rewind->blank.ram = chip8->image;
+}
+
+static void rewind_apply(Machine * machine, const unsigned char * delta, size_t size) {
+	unsigned char * bytes = (unsigned char *)machine;
+	const unsigned char * end = delta + size;
+	unsigned int i = 0;
+	while (delta < end) {
+		i += rewind_get_u16(delta);
+		unsigned int literal = rewind_get_u16(delta + 2);
+		delta += 4;
+		for (unsigned int j = 0; j < literal; j++, i++) {
+			uint64_t a, b;
+			memcpy(&a, bytes + i * 8, 8);
+			memcpy(&b, delta + j * 8, 8);
+			a ^= b;
+			memcpy(bytes + i * 8, &a, 8);
+		}
+		delta += literal * 8;
+	}
+}
+
+static void rewind_free(RewindBuffer * rewind) {
+	if (!rewind) return;
+	free(rewind->data);
+	free(rewind->entries);
+	free(rewind->scratch);
+	free(rewind);
+}
+
+static void rewind_clear(RewindBuffer * rewind) {
+	if (!rewind) return;
+	rewind->first = 0;
+	rewind->count = 0;
+	rewind->sinceKeyframe = 0;
+}
+
+int chip8_rewind_enable(Chip8 * chip8, size_t budget, unsigned int keyframeInterval) {
+	rewind_free(chip8->rewind);
+	chip8->rewind = 0;
+	if (budget == 0) {
+		return 0;
+	}
+
+	RewindBuffer * rewind = calloc(1, sizeof(*rewind));
+	if (rewind == 0) {
+		return 1;
+	}
+	rewind->capacity = budget;
+	rewind->keyframeInterval = keyframeInterval ? keyframeInterval : 1;
+	// entries start few and grow with the history, since idle frames take only a few bytes
+	size_t entryLimit = budget / REWIND_MIN_ENTRY_SIZE + 1;
+	rewind->entryLimit = entryLimit < REWIND_MAX_ENTRIES ? entryLimit : REWIND_MAX_ENTRIES;
+	rewind->entryCapacity = rewind->entryLimit < REWIND_INITIAL_ENTRIES ? rewind->entryLimit : REWIND_INITIAL_ENTRIES;
+	// worst case for a delta and a keyframe is every word changing, one run of them all
+	rewind->scratchSize = 2 * (4 + 8 * REWIND_WORDS);
+	rewind->data = malloc(budget);
+	rewind->entries = malloc(rewind->entryCapacity * sizeof(*rewind->entries));
+	rewind->scratch = malloc(rewind->scratchSize);
+	if (!rewind->data || !rewind->entries || !rewind->scratch) {
+		rewind_free(rewind);
+		return 1;
+	}
+	chip8->rewind = rewind;
+	return 0;
+}
+
+void chip8_rewind_record(Chip8 * chip8) {
+	RewindBuffer * rewind = chip8->rewind;
+	if (!rewind) return;
+	double start = rewind_seconds();
+
+	Machine * machine = &chip8->machine;
+	size_t deltaSize = 0;
+	size_t keyframeSize = 0;
+	if (rewind->count == 0) {
+		memcpy(&rewind->previous, machine, sizeof(Machine));
+	} else {
+		deltaSize = rewind_encode(rewind->scratch, &rewind->previous, machine);
+	}
+
+	if (rewind->count == 0 || rewind->sinceKeyframe + 1 >= rewind->keyframeInterval) {
+		rewind_blank(rewind, chip8);
+		keyframeSize = rewind_encode(rewind->scratch + deltaSize, &rewind->blank, &rewind->previous);
+	}
+
+	unsigned char * destination = rewind_reserve(rewind, deltaSize + keyframeSize);
+	if (destination) {
+		memcpy(destination, rewind->scratch, deltaSize + keyframeSize);
+		RewindEntry * entry = &rewind->entries[(rewind->first + rewind->count) % rewind->entryCapacity];
+		entry->offset = destination - rewind->data;
+		entry->deltaSize = deltaSize;
+		entry->keyframeSize = keyframeSize;
+		rewind->count++;
+		rewind->sinceKeyframe = keyframeSize ? 0 : rewind->sinceKeyframe + 1;
+	} else {
+		// too large to keep at all, history cannot bridge this frame
+		rewind_clear(rewind);
+	}
+
+	rewind->recordSeconds += rewind_seconds() - start;
+	rewind->records++;
+}
+
+unsigned int chip8_rewind(Chip8 * chip8, unsigned int frames) {
+	RewindBuffer * rewind = chip8->rewind;
+	if (!rewind || rewind->count == 0) return 0;
+	if (frames > rewind->count - 1) frames = rewind->count - 1;
+	unsigned int target = rewind->count - 1 - frames;
+
+	// walk forward from the nearest keyframe when that is shorter than walking back
+	unsigned int keyframe = target + 1;
+	for (unsigned int i = target + 1; i-- > 0 && target - i < frames;) {
+		if (rewind_entry(rewind, i)->keyframeSize) {
+			keyframe = i;
+			break;
+		}
+	}
+
+	Machine * state = &rewind->previous;
+	if (keyframe <= target) {
+		RewindEntry * entry = rewind_entry(rewind, keyframe);
+		rewind_blank(rewind, chip8);
+		memcpy(state, &rewind->blank, sizeof(Machine));
+		rewind_apply(state, rewind->data + entry->offset + entry->deltaSize, entry->keyframeSize);
+		for (unsigned int i = keyframe + 1; i <= target; i++) {
+			entry = rewind_entry(rewind, i);
+			rewind_apply(state, rewind->data + entry->offset, entry->deltaSize);
+		}
+	} else {
+		for (unsigned int i = rewind->count - 1; i > target; i--) {
+			RewindEntry * entry = rewind_entry(rewind, i);
+			rewind_apply(state, rewind->data + entry->offset, entry->deltaSize);
+		}
+	}
+
+	// whole-struct copies so the bytes the deltas were taken over stay exact
+	memcpy(&chip8->machine, state, sizeof(Machine));
+	clear_code_caches(chip8);
+
+	rewind->count = target + 1;
+	rewind->sinceKeyframe = 0;
+	for (unsigned int i = target; i > 0 && !rewind_entry(rewind, i)->keyframeSize; i--) {
+		rewind->sinceKeyframe++;
+	}
+	return frames;
+}
+
+void chip8_rewind_stats(const Chip8 * chip8, RewindStats * stats) {
+	memset(stats, 0, sizeof(*stats));
+	const RewindBuffer * rewind = chip8->rewind;
+	if (!rewind) return;
+	stats->frames = rewind->count;
+	stats->budget = rewind->capacity;
+	if (rewind->count) {
+		const RewindEntry * oldest = &rewind->entries[rewind->first];
+		const RewindEntry * newest = &rewind->entries[(rewind->first + rewind->count - 1) % rewind->entryCapacity];
+		size_t end = newest->offset + newest->deltaSize + newest->keyframeSize;
+		stats->bytesUsed = end > oldest->offset ? end - oldest->offset : rewind->capacity - oldest->offset + end;
+	}
+	stats->recordSeconds = rewind->records ? rewind->recordSeconds / rewind->records : 0;
+}
+
+int chip8_save(const Chip8 * chip8, const char * path) {
+	size_t size = chip8_save_state(chip8, 0, 0);
+	unsigned char * state = malloc(size);
+	if (state == 0) {
+		return 3;
+	}
+	chip8_save_state(chip8, state, size);
+
+	FILE * machineFile = fopen(path, "wb");
+	if (machineFile == 0) {
+		free(state);
+		return 2;
+	}
+	unsigned long int amount = fwrite(state, 1, size, machineFile);
+	int closed = fclose(machineFile);
+	free(state);
+	if (amount != size || closed != 0) {
+		return 3;
+	}
+	return 0;
+}
+
+int chip8_restore(Chip8 * chip8, const char * path) {
+	int machineFile = open(path, O_RDONLY);
+	if (machineFile < 0) {
+		return 1;
+	}
+	struct stat info;
+	if (fstat(machineFile, &info) || info.st_size == 0) {
+		close(machineFile);
+		return 2;
+	}
+	void * state = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, machineFile, 0);
+	close(machineFile);
+	if (state == MAP_FAILED) {
+		return 1;
+	}
+
+	int result = chip8_load_state(chip8, state, info.st_size);
+	munmap(state, info.st_size);
+	return result;
+}
+
+// The error text is left out, clients also use it to show their own messages.
+unsigned long long int chip8_state_hash(const Chip8 * chip8) {
+	size_t size = save_state(chip8, 0, 0, 0);
+	unsigned char * state = malloc(size);
+	if (state == 0) {
+		return 0;
+	}
+	save_state(chip8, state, size, 0);
+	unsigned long long int hash = chip8_hash_bytes(HASH_SEED, state, size);
+	free(state);
+	return hash;
+}
@@ -0,0 +1,226 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// libchip8: the emulator core. Every bit of state lives in a Chip8 instance, so any number
+// of machines can run side by side; the core does no terminal I/O of its own.
+
+// Machine Macros
+#define MAX_STAT_WIDTH 100
+#define SCREEN_WIDTH 64
+#define SCREEN_HEIGHT 32
+#define SCREEN_COUNT (SCREEN_WIDTH * SCREEN_HEIGHT)
+#define DEFAULT_INSTRUCTION_RATE 700
+#define TIMER_RATE 60
+// the 16 levels of later interpreters, enough for any program written for real hardware
+#define STACK_LIMIT 16
+#define CACHE_LINE_SIZE 64
+#define REGISTER_COUNT 16
+#define MEMORY_LIMIT 4096
+
+// Memory Macros
+#define NAME_MEMORY_SECTOR 0
+#define FONT_MEMORY_SECTOR 80
+#define PROGRAM_MEMORY_SECTOR 512
+// I holds 16 bits, but the memory it addresses wraps at the end of RAM
+#define MEMORY_ADDRESS(address) ((address) & (MEMORY_LIMIT - 1))
+
+// Quirk bits, a profile is any combination of them
+#define QUIRK_SUPER_CHIP_SHIFT 1
+#define QUIRK_SUPER_CHIP_JUMP 2
+#define QUIRK_AMIGA_INDEX_OVERFLOW 4
+#define QUIRK_COSMAC_INDEX_INCREMENT 8
+#define QUIRK_COSMAC_VF_RESET 16
+#define QUIRK_PROFILE_COUNT 32
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+#define DEFAULT_RANDOM_SEED 0x43484950ULL
+
+enum {
+	ENGINE_SWITCH,
+	ENGINE_THREADED,
+	ENGINE_JIT
+};
+
+typedef struct {
+	unsigned short int sp;
+	unsigned short int mem[STACK_LIMIT];
+} StackMemory;
+
+typedef struct {
+	unsigned char reg[REGISTER_COUNT];
+} RegisterMemory;
+
+typedef struct {
+	unsigned char mem[MEMORY_LIMIT];
+} RandomAccessMemory;
+
+// one bit per pixel, the most significant bit of each row is x = 0
+typedef struct {
+	uint64_t rows[SCREEN_HEIGHT];
+} ScreenMemory;
+
+#define SCREEN_BIT(x) (0x8000000000000000ULL >> (x))
+
+// Fields are ordered by how often they are touched. The first cache line holds everything an
+// ordinary instruction reads or writes, so a machine in the middle of a batch of thousands
+// costs one line plus the RAM and screen its program uses; the error text, written only on
+// a fault and read by front ends, comes last.
+typedef struct {
+	unsigned int cycles;
+	unsigned short int pc;
+	unsigned short int regI;
+	RegisterMemory registers;
+	StackMemory stack;
+	unsigned char delayTimer;
+	unsigned char soundTimer;
+	unsigned char quirks;
+	unsigned char halted;
+
+	// timer ticks, key instructions and CXNN
+	unsigned int instructionRate;
+	unsigned int timerPhase;
+	int keyBuffer;
+	// xoshiro128** state behind CXNN, part of the machine so runs replay exactly
+	uint32_t randomState[4];
+
+	RandomAccessMemory ram;
+	ScreenMemory screen;
+	char error[MAX_STAT_WIDTH];
+} Machine;
+
+typedef struct {
+	unsigned int cycle;
+	unsigned short int pc;
+	unsigned short int opcode;
+	unsigned short int regI;
+	unsigned char registers[REGISTER_COUNT];
+} TraceRecord;
+
+typedef struct Chip8 Chip8;
+
+// Returns 0 when out of memory.
+Chip8 * chip8_create();
+void chip8_destroy(Chip8 * chip8);
+
+// Copies a program to PROGRAM_MEMORY_SECTOR and picks its quirk profile from the ROM table.
+// Returns 1 if the program does not fit.
+int chip8_load(Chip8 * chip8, const unsigned char * program, size_t size);
+
+// Runs up to count instructions, ticking the timers as it goes. Stops early once the
+// machine halts on a fatal error. Returns how many instructions ran.
+unsigned int chip8_step(Chip8 * chip8, unsigned int count);
+
+// keys is a bitmask of the 16 keypad keys. The machine latches one key at a time until an
+// instruction consumes it; while nothing is latched the lowest pressed key is.
+void chip8_set_keys(Chip8 * chip8, unsigned short int keys);
+
+// SCREEN_HEIGHT rows laid out like ScreenMemory. A set bit is a dark pixel.
+const uint64_t * chip8_get_framebuffer(const Chip8 * chip8);
+
+// Direct access to the machine state. Quirks and rates may be changed between steps; call
+// chip8_memory_changed after writing program memory.
+Machine * chip8_machine(Chip8 * chip8);
+void chip8_memory_changed(Chip8 * chip8);
+void chip8_set_engine(Chip8 * chip8, int engine);
+// On by default: jumps to self, FX0A waiting for a key and FX07/3XNN/1NNN delay timer polls
+// are skipped ahead to the next tick or the end of the step instead of run instruction by
+// instruction. The machine ends in the same state either way; only the trace misses them.
+void chip8_set_fast_forward(Chip8 * chip8, int enable);
+// Every instance starts seeded with DEFAULT_RANDOM_SEED, so CXNN is reproducible unless the
+// client seeds it otherwise.
+void chip8_seed(Chip8 * chip8, unsigned long long int seed);
+
+// Save states are small, versioned and the same on every build. RAM is stored against the
+// memory the program was loaded into, so a state only restores into an instance that loaded
+// the same program the same way.
+// chip8_save_state writes at most size bytes and returns the size of the whole state; pass a
+// size of 0 to measure it.
+size_t chip8_save_state(const Chip8 * chip8, unsigned char * buffer, size_t size);
+// Returns 0 on success, 2 for a malformed or newer state and 3 for a state of another
+// program. The instance is left untouched on failure.
+int chip8_load_state(Chip8 * chip8, const unsigned char * data, size_t size);
+// Files holding one state each. chip8_save returns 2 if the file cannot be opened and 3 if it
+// cannot be written; chip8_restore returns 1 if the file cannot be opened, then as above.
+int chip8_save(const Chip8 * chip8, const char * path);
+int chip8_restore(Chip8 * chip8, const char * path);
+// A hash of the save state without the error text, equal for two machines that would save
+// the same state.
+unsigned long long int chip8_state_hash(const Chip8 * chip8);
+
+// Accepts a profile name or a raw quirk bitmask. Returns -1 for anything else.
+int chip8_parse_profile(const char * text);
+const char * chip8_profile_name(unsigned char quirks);
+
+// Opcode families as the profiler counts them: the fixed opcodes, one family per leading nibble
+// and one per FX function, and "other" for anything the machine does not run.
+#define OPCODE_FAMILY_COUNT 26
+
+int chip8_opcode_family(unsigned short int opcode);
+const char * chip8_opcode_family_name(int family);
+
+// The profiler counts instructions per opcode family, per address and per call path, and the
+// pixels DXYN flips and how often it collides. A profiled instance runs on the switch
+// interpreter whatever its engine; an instance without a profile pays nothing for it. Enabling
+// returns 1 when out of memory; disabling drops the counts.
+int chip8_profile_enable(Chip8 * chip8, int enable);
+// Both return 1 when profiling is off and 2 if the file could not be written.
+int chip8_profile_write_json(const Chip8 * chip8, FILE * file);
+// Folded stacks for flamegraph.pl, one line per call path with the instructions run on it.
+int chip8_profile_write_folded(const Chip8 * chip8, FILE * file);
+
+const TraceRecord * chip8_latest_trace_record(const Chip8 * chip8);
+void chip8_describe_trace_record(const TraceRecord * record, char * text);
+void chip8_dump_trace(const Chip8 * chip8, FILE * file, unsigned int limit);
+int chip8_dump_trace_file(const Chip8 * chip8, const char * path);
+
+// Rewind keeps a bounded history of frames. The client records one frame whenever it likes,
+// typically once per displayed frame, and can later step back to any recorded frame.
+typedef struct {
+	unsigned int frames;
+	size_t bytesUsed;
+	size_t budget;
+	// average time chip8_rewind_record takes
+	double recordSeconds;
+} RewindStats;
+
+// Keeps as many frames as fit in budget bytes, with a full save state every
+// keyframeInterval frames. A budget of 0 turns rewinding off. Returns 1 when out of memory.
+int chip8_rewind_enable(Chip8 * chip8, size_t budget, unsigned int keyframeInterval);
+void chip8_rewind_record(Chip8 * chip8);
+// Returns to the frame recorded frames frames before the newest one, or to the oldest frame
+// still held, and forgets the frames after it. Returns how many frames it went back.
+unsigned int chip8_rewind(Chip8 * chip8, unsigned int frames);
+void chip8_rewind_stats(const Chip8 * chip8, RewindStats * stats);
+
+// Lockstep runs many instances of one program together, executing the instructions their
+// lanes share as vector ops. Every lane is an ordinary instance, so keys, random seeds and
+// the rest can be set per lane between steps; call
+// chip8_lockstep_memory_changed after writing the memory of any lane.
+typedef struct Chip8Lockstep Chip8Lockstep;
+
+// Returns 0 when out of memory.
+Chip8Lockstep * chip8_lockstep_create(unsigned int count);
+void chip8_lockstep_destroy(Chip8Lockstep * lockstep);
+
+// Loads the program into every lane like chip8_load.
+int chip8_lockstep_load(Chip8Lockstep * lockstep, const unsigned char * program, size_t size);
+Chip8 * chip8_lockstep_lane(Chip8Lockstep * lockstep, unsigned int lane);
+void chip8_lockstep_memory_changed(Chip8Lockstep * lockstep);
+
+// Runs up to count instructions on every lane, leaving each lane as chip8_step would have.
+// Lanes whose quirks, instruction rate or timer phase differ from the first running lane are
+// stepped on their own. Instructions run in lockstep are not traced. Returns how many
+// instructions the longest running lane ran.
+unsigned int chip8_lockstep_step(Chip8Lockstep * lockstep, unsigned int count);
+
+// Lane instructions run as part of a group and lane by lane since the lockstep was created.
+void chip8_lockstep_stats(const Chip8Lockstep * lockstep, unsigned long long int * grouped, unsigned long long int * scalar);
+
+unsigned long long int chip8_hash_bytes(unsigned long long int hash, const void * data, size_t size);
+
+#endif
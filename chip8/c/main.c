@@ -1,88 +1,70 @@
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <stdarg.h>
 #include <string.h>
-#include <sys/_types/_timeval.h>
+#include <time.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <termios.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/select.h>
-
-// Terminal Macros
-#define INVISIBLE_CURSOR_SEQUENCE "\033[?25l"
-#define SIZE_INVISIBLE_CURSOR_SEQUENCE sizeof(INVISIBLE_CURSOR_SEQUENCE)
-#define VISIBLE_CURSOR_SEQUENCE "\033[?25h"
-#define SIZE_VISIBLE_CURSOR_SEQUENCE sizeof(VISIBLE_CURSOR_SEQUENCE)
-#define RESET_CURSOR_SEQUENCE "\033[H"
-#define SIZE_RESET_CURSOR_SEQUENCE sizeof(RESET_CURSOR_SEQUENCE)
-#define UP_CURSOR_SEQUENCE "\033[1A"
-#define SIZE_UP_CURSOR_SEQUENCE sizeof(UP_CURSOR_SEQUENCE)
-#define DOWN_CURSOR_SEQUENCE "\033[1B"
-#define SIZE_DOWN_CURSOR_SEQUENCE sizeof(DOWN_CURSOR_SEQUENCE)
-#define LEFT_CURSOR_SEQUENCE "\033[1D"
-#define SIZE_LEFT_CURSOR_SEQUENCE sizeof(LEFT_CURSOR_SEQUENCE)
-#define RIGHT_CURSOR_SEQUENCE "\033[1C"
-#define SIZE_RIGHT_CURSOR_SEQUENCE sizeof(RIGHT_CURSOR_SEQUENCE)
-#define NEXT_LINE_CURSOR_SEQUENCE "\033[1E"
-#define SIZE_NEXT_LINE_CURSOR_SEQUENCE sizeof(NEXT_LINE_CURSOR_SEQUENCE)
-#define PREV_LINE_CURSOR_SEQUENCE "\033[1F"
-#define SIZE_PREV_LINE_CURSOR_SEQUENCE sizeof(PREV_LINE_CURSOR_SEQUENCE)
-#define CLEAR_SEQUENCE "\033[2J\033[H\033[2J"
-#define SIZE_CLEAR_SEQUENCE sizeof(CLEAR_SEQUENCE)
-
-// Device Macros
-#define FILL_CHARACTER " "
-#define SIZE_FILL_CHARACTER sizeof(FILL_CHARACTER)
-#define CLEAR_CHARACTER "\u2588"
-#define SIZE_CLEAR_CHARACTER sizeof(CLEAR_CHARACTER)
-#define SOUND_VOLUME_SEQUENCE "\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588"
-#define DEFAULT_X_OFFSET 7
-#define DEFAULT_Y_OFFSET 3
-#define MAX_STAT_WIDTH 100
-#define SCREEN_WIDTH 64
-#define SCREEN_HEIGHT 32
-#define SCREEN_COUNT (SCREEN_WIDTH * SCREEN_HEIGHT)
-#define SCREEN_BUFFER_SIZE ((SCREEN_WIDTH + MAX_STAT_WIDTH + 1) * (SCREEN_HEIGHT + 1))
-
-// Machine Macros
-#define SET_FRAMERATE 480.0
-#define FRAME_TIME CLOCKS_PER_SEC / SET_FRAMERATE
-#define STACK_LIMIT 512
-#define REGISTER_COUNT 16
-#define MEMORY_LIMIT 4096
-
-// Memory Macros
-#define NAME_MEMORY_SECTOR 0
-#define FONT_MEMORY_SECTOR 80
-#define PROGRAM_MEMORY_SECTOR 512
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "chip8.h"
+#include "batch.h"
+#include "bench.h"
+#include "check.h"
+#include "video.h"
+#include "metrics.h"
+#include "movie.h"
+#include "render.h"
+
+// Host Macros
+#define DEFAULT_REFRESH_RATE 60.0
+#define MAX_CATCH_UP_SECONDS 0.25
+#define INPUT_READ_SIZE 64
+#define INPUT_QUEUE_SIZE 256
+#define JITTER_SMOOTHING 0.05
+#define SPEED_SMOOTHING 0.1
+// turbo multiplier when --turbo is not given, 0 runs uncapped
+#define DEFAULT_TURBO_MULTIPLIER 0
+#define TURBO_KEY 't'
+// an uncapped frame runs the core for this share of the frame period, a slice at a time
+#define TURBO_FRAME_SHARE 0.75
+#define TURBO_SLICE 4096
+// the share of its time the render thread may spend blocked writing to the terminal
+#define RENDER_WRITE_SHARE 0.5
+#define HEADLESS_BATCH 4096
+#define DEFAULT_HEADLESS_CYCLES 1000000
+#define DEFAULT_BENCH_CYCLES 2000000
+#define DEFAULT_BENCH_REPEAT 3
+#define DEFAULT_BENCH_TOLERANCE 10.0
+#define DEFAULT_CHECK_CYCLES 200000
+#define DEFAULT_CHECK_INTERVAL 1000
+#define DEFAULT_CHECK_WINDOW 32
+#define DEFAULT_VIDEO_RATE 60
+#define DEFAULT_VIDEO_SCALE 4
+#define DEFAULT_VIDEO_SECONDS 60
+#define TRACE_DUMP_ON_ERROR 16
+#define DEFAULT_TRACE_FILE "spn/trace.txt"
+#define DEFAULT_REWIND_MEGABYTES 8
+#define REWIND_KEYFRAME_INTERVAL 60
+#define REWIND_FRAMES_PER_KEY 4
+#define REWIND_KEY 'r'
+#define SAVE_STATE_FILE "spn/m.ch8.%d.state"
+#define SAVE_STATE_SLOTS 10
+#define SAVE_STATE_PATH_SIZE 64
 
 // Configuration Settings
 #define PAUSE_ON_SAVE_MACHINE 1
 #define UNPAUSE_ON_LOAD_MACHINE 1
 
-#define SUPER_CHIP_SHIFT_CONFIGURATION 1
-#define SUPER_CHIP_JUMP_CONFIGURATION 1
-#define AMIGA_INDEX_OVERFLOW_CONFIGURATION 1
-#define COSMAC_INDEX_INCREMENT_CONFIGURATION 0
-#define COSMAC_VF_RESET_CONFIGURATION 0
-
-/*
-  SUPER-CHIP (MODERN / LEGACY)
-#define SUPER_CHIP_SHIFT_CONFIGURATION 1
-#define SUPER_CHIP_JUMP_CONFIGURATION 1
-#define AMIGA_INDEX_OVERFLOW_CONFIGURATION 1
-#define COSMAC_INDEX_INCREMENT_CONFIGURATION 0
-#define COSMAC_VF_RESET_CONFIGURATION 0
-*/
-/*
-  COSMAC CHIP-8
-#define SUPER_CHIP_SHIFT_CONFIGURATION 0
-#define SUPER_CHIP_JUMP_CONFIGURATION 0
-#define AMIGA_INDEX_OVERFLOW_CONFIGURATION 1
-#define COSMAC_INDEX_INCREMENT_CONFIGURATION 1
-#define COSMAC_VF_RESET_CONFIGURATION 1
-*/
 struct termios term;
 
 void disable_raw_mode() {
@@ -121,104 +103,81 @@ void reveal_cursor() {
 	return;
 }
 
-void set_cursor_up() {
-	write(1, UP_CURSOR_SEQUENCE, SIZE_UP_CURSOR_SEQUENCE);
-	return;
-}
-
-void set_cursor_down() {
-	write(1, DOWN_CURSOR_SEQUENCE, SIZE_DOWN_CURSOR_SEQUENCE);
-	return;
-}
-
-void set_cursor_left() {
-	write(1, LEFT_CURSOR_SEQUENCE, SIZE_LEFT_CURSOR_SEQUENCE);
-	return;
-}
-
-void set_cursor_right() {
-	write(1, RIGHT_CURSOR_SEQUENCE, SIZE_RIGHT_CURSOR_SEQUENCE);
-	return;
-}
-
-void default_x_offset() {
-	for (int i = 0; i < DEFAULT_X_OFFSET; i++) {
-		set_cursor_right();
-	}
-}
-
-void default_y_offset() {
-	for (int i = 0; i < DEFAULT_Y_OFFSET; i++) {
-		set_cursor_down();
-	}
+double monotonic_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-void set_cursor_next_line() {
-	write(1, NEXT_LINE_CURSOR_SEQUENCE, SIZE_NEXT_LINE_CURSOR_SEQUENCE);
-	default_x_offset();
-	return;
-}
-
-void set_cursor_prev_line() {
-	write(1, PREV_LINE_CURSOR_SEQUENCE, SIZE_PREV_LINE_CURSOR_SEQUENCE);
-	default_x_offset();
-	return;
-}
-
-void reset_cursor() {
-	write(1, RESET_CURSOR_SEQUENCE, SIZE_RESET_CURSOR_SEQUENCE);
-	default_x_offset();
-	default_y_offset();
-	return;
+// The emulation thread sleeps until the next frame deadline. Deadlines are absolute, period
+// apart, so a late wake-up does not push back the frames after it. Linux counts them off a
+// timerfd; elsewhere nanosleep waits out whatever is left of the period.
+typedef struct {
+	double period;
+	double next;
+	// frames whose deadline had already passed by more than a period when they ran
+	unsigned int lateFrames;
+	int timer;
+} FrameClock;
+
+void free_frame_clock(FrameClock * clock) {
+	if (clock->timer >= 0) close(clock->timer);
+	clock->timer = -1;
 }
 
-void write_blank_screen() {
-	reset_cursor();
-	char * clear_char = CLEAR_CHARACTER;
-	for (int i = 0; i < SCREEN_HEIGHT; i++) {
-		for (int j = 0; j < SCREEN_WIDTH; j++) {
-			write(1, clear_char, SIZE_CLEAR_CHARACTER);
-		}
-	    set_cursor_next_line();
+void initialize_frame_clock(FrameClock * clock, double period) {
+	clock->period = period;
+	clock->next = monotonic_seconds() + period;
+	clock->lateFrames = 0;
+	clock->timer = -1;
+#ifdef __linux__
+	clock->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	struct itimerspec deadline;
+	deadline.it_value.tv_sec = (time_t)clock->next;
+	deadline.it_value.tv_nsec = (long)((clock->next - deadline.it_value.tv_sec) * 1e9);
+	deadline.it_interval.tv_sec = (time_t)period;
+	deadline.it_interval.tv_nsec = (long)((period - deadline.it_interval.tv_sec) * 1e9);
+	if (clock->timer >= 0 && timerfd_settime(clock->timer, TFD_TIMER_ABSTIME, &deadline, 0)) {
+		free_frame_clock(clock);
 	}
-	reset_cursor();
+#endif
 }
 
-void write_to_stat_pane(const char * text, unsigned short int row) {
-	reset_cursor();
-	for (int i = 0; i < SCREEN_WIDTH + 1; i++) {
-		set_cursor_right();
+void frame_clock_wait(FrameClock * clock) {
+	uint64_t expirations;
+	if (clock->timer >= 0 && read(clock->timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+		if (expirations > 1) clock->lateFrames++;
+		return;
 	}
-	for (int i = 0; i < row; i++) {
-		set_cursor_down();
+	double wait = clock->next - monotonic_seconds();
+	if (wait > 0) {
+		struct timespec remaining = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+		while (nanosleep(&remaining, &remaining)) {}
 	}
-
-	for (int i = 0; i < MAX_STAT_WIDTH; i++) {
-		if (text[i] == 0) {
-			write(1, text, i);
-			return;
-		}
+	double now = monotonic_seconds();
+	clock->next += clock->period;
+	if (clock->next < now) {
+		clock->next = now + clock->period;
+		clock->lateFrames++;
 	}
-
 }
 
-void wait_for_input(int * c) {
+// Render thread wake-ups: stdin has input, or the emulation thread published a frame and
+// wrote a byte to the wake pipe, or the timeout ran out. A negative timeout never runs out.
+void wait_for_render_work(int inputOpen, int wake, double timeout, int * inputReady, int * wakeReady) {
 	fd_set fds;
 	FD_ZERO(&fds);
-	FD_SET(0, &fds);
-	struct timeval timeout = {0, 500};
-	int ready = select(1, &fds, NULL, NULL, &timeout);
-	if (ready) {
-		ssize_t read_amount = read(0, c, 1);
-		if (!read_amount) {
-			*c = 0;
-		}
-	} else {
-		*c = 0;
+	if (inputOpen) FD_SET(STDIN_FILENO, &fds);
+	FD_SET(wake, &fds);
+	*inputReady = 0;
+	*wakeReady = 0;
+	struct timeval limit = {(time_t)timeout, (suseconds_t)((timeout - (time_t)timeout) * 1e6)};
+	if (select((wake > STDIN_FILENO ? wake : STDIN_FILENO) + 1, &fds, 0, 0, timeout < 0 ? 0 : &limit) > 0) {
+		*inputReady = FD_ISSET(STDIN_FILENO, &fds) != 0;
+		*wakeReady = FD_ISSET(wake, &fds) != 0;
 	}
 }
 
-
 const unsigned char inputMap[] = {'0', '1', '2', '3', '4', '5', '6', '7',
                          '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
 
@@ -234,570 +193,1106 @@ void fill_keymap_from_input_map() {
 
 char program_name[] = "Press Ctrl+m to exit";
 
-const unsigned char font[] = {
-    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-    0x20, 0x60, 0x20, 0x20, 0x70, // 1
-    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-};
+int initialize_program_name(Machine * machine, const char * name, ssize_t size) {
+	if (size > MAX_STAT_WIDTH) {
+		perror("Size for program name cannot be larger than the maximum stat width.");
+		return 1;
+	}
+	void * dest = &machine->ram.mem + NAME_MEMORY_SECTOR;
+	memcpy(dest, name, size);
+	return 0;
+}
+
+// Frames travel through a lock-free triple buffer. The emulation thread fills the back slot
+// and swaps it into the middle; the render thread swaps a fresh middle slot for its front one.
+// Neither side ever waits for the other, and a frame the renderer was too slow to pick up is
+// overwritten and counted as dropped.
+#define FRAME_FRESH 4
 
 typedef struct {
-	unsigned short int sp;
-	unsigned short int mem[STACK_LIMIT];
-} StackMemory;
+	Frame slots[3];
+	atomic_uint middle;
+	atomic_uint dropped;
+	unsigned int back;
+	unsigned int front;
+} TripleBuffer;
+
+void initialize_triple_buffer(TripleBuffer * frames) {
+	frames->back = 0;
+	atomic_init(&frames->middle, 1);
+	frames->front = 2;
+	atomic_init(&frames->dropped, 0);
+}
 
-typedef struct {
-	unsigned char reg[REGISTER_COUNT];
-} RegisterMemory;
+Frame * triple_buffer_back(TripleBuffer * frames) {
+	return &frames->slots[frames->back];
+}
 
-typedef struct {
-	unsigned char mem[MEMORY_LIMIT];
-} RandomAccessMemory;
+void triple_buffer_publish(TripleBuffer * frames) {
+	unsigned int previous = atomic_exchange_explicit(&frames->middle, frames->back | FRAME_FRESH, memory_order_acq_rel);
+	if (previous & FRAME_FRESH) {
+		atomic_fetch_add_explicit(&frames->dropped, 1, memory_order_relaxed);
+	}
+	frames->back = previous & ~FRAME_FRESH;
+}
 
+// Returns the newest frame, or 0 if none was published since the last call.
+const Frame * triple_buffer_acquire(TripleBuffer * frames) {
+	if (!(atomic_load_explicit(&frames->middle, memory_order_relaxed) & FRAME_FRESH)) {
+		return 0;
+	}
+	unsigned int middle = atomic_exchange_explicit(&frames->middle, frames->front, memory_order_acq_rel);
+	frames->front = middle & ~FRAME_FRESH;
+	return &frames->slots[frames->front];
+}
+
+// Raw input bytes from the render thread to the emulation thread, one producer and one
+// consumer. Input that arrives while the queue is full is dropped rather than waited on.
 typedef struct {
-	unsigned char mem[SCREEN_COUNT];
-} ScreenMemory;
+	unsigned char data[INPUT_QUEUE_SIZE];
+	atomic_uint head;
+	atomic_uint tail;
+} InputQueue;
+
+void initialize_input_queue(InputQueue * queue) {
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+}
+
+int input_queue_push(InputQueue * queue, unsigned char input) {
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) == INPUT_QUEUE_SIZE) {
+		return 1;
+	}
+	queue->data[head % INPUT_QUEUE_SIZE] = input;
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return 0;
+}
+
+int input_queue_pop(InputQueue * queue, unsigned char * input) {
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&queue->head, memory_order_acquire)) {
+		return 0;
+	}
+	*input = queue->data[tail % INPUT_QUEUE_SIZE];
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return 1;
+}
 
 typedef struct {
-	char error[MAX_STAT_WIDTH];
+	const char * programFile;
+	int headless;
 	unsigned int cycles;
-	clock_t cycleTime;
-	double cycleTimeDelta;
-	unsigned short int pc;
-	unsigned short int regI;
-	StackMemory stack;
-	RegisterMemory registers;
-	RandomAccessMemory ram;
-	ScreenMemory screen;
-	unsigned char delayTimer;
-	unsigned char soundTimer;
-	int keyBuffer;
-} Machine;
-
-int serialize_machine(Machine * machine) {
-	int result = mkdir("spn", 0777);
-
-	FILE * machineFile = fopen("spn/m.ch8.bin", "w");
-	if (machineFile == 0) {
-		return 2;
+	int untilPc;
+	unsigned int instructionRate;
+	double refreshRate;
+	double rewindMegabytes;
+	int engine;
+	int profile;
+	const char * traceFile;
+	const char * batchSource;
+	const char * batchOutput;
+	int batchFormat;
+	unsigned int batchThreads;
+	const char * benchSource;
+	const char * benchBaseline;
+	double benchTolerance;
+	unsigned int benchRepeat;
+	const char * checkSource;
+	unsigned int checkRandom;
+	unsigned int checkInterval;
+	int checkCandidate;
+	unsigned int lanes;
+	unsigned long long int seed;
+	int seeded;
+	const char * recordFile;
+	const char * replayFile;
+	const char * hotspotsFile;
+	const char * flamegraphFile;
+	int fastForward;
+	int halfBlocks;
+	int turbo;
+	double turboMultiplier;
+	const char * metricsFile;
+	const char * videoFile;
+	int videoFormat;
+	unsigned int videoRate;
+	unsigned int videoScale;
+	double videoSeconds;
+	int videoDedup;
+	const char * timecodesFile;
+} Options;
+
+int parse_options(Options * options, int argc, char * argv[]) {
+	options->programFile = 0;
+	options->headless = 0;
+	options->cycles = 0;
+	options->untilPc = -1;
+	options->instructionRate = DEFAULT_INSTRUCTION_RATE;
+	options->refreshRate = DEFAULT_REFRESH_RATE;
+	options->rewindMegabytes = DEFAULT_REWIND_MEGABYTES;
+	options->engine = ENGINE_THREADED;
+	options->profile = -1;
+	options->traceFile = 0;
+	options->batchSource = 0;
+	options->batchOutput = 0;
+	options->batchFormat = BATCH_FORMAT_JSONL;
+	options->batchThreads = 0;
+	options->benchSource = 0;
+	options->benchBaseline = 0;
+	options->benchTolerance = DEFAULT_BENCH_TOLERANCE;
+	options->benchRepeat = DEFAULT_BENCH_REPEAT;
+	options->checkSource = 0;
+	options->checkRandom = 0;
+	options->checkInterval = DEFAULT_CHECK_INTERVAL;
+	options->checkCandidate = CHECK_ALL;
+	options->lanes = 0;
+	options->seed = DEFAULT_RANDOM_SEED;
+	options->seeded = 0;
+	options->recordFile = 0;
+	options->replayFile = 0;
+	options->hotspotsFile = 0;
+	options->flamegraphFile = 0;
+	options->fastForward = 1;
+	options->halfBlocks = 0;
+	options->turbo = 0;
+	options->turboMultiplier = DEFAULT_TURBO_MULTIPLIER;
+	options->metricsFile = 0;
+	options->videoFile = 0;
+	options->videoFormat = -1;
+	options->videoRate = DEFAULT_VIDEO_RATE;
+	options->videoScale = DEFAULT_VIDEO_SCALE;
+	options->videoSeconds = 0;
+	options->videoDedup = 0;
+	options->timecodesFile = 0;
+
+	for (int i = 1; i < argc; i++) {
+		const char * arg = argv[i];
+		if (strcmp(arg, "--headless") == 0) {
+			options->headless = 1;
+		} else if (strcmp(arg, "--cycles") == 0 && i + 1 < argc) {
+			options->cycles = strtoul(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--until-pc") == 0 && i + 1 < argc) {
+			options->untilPc = strtol(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--ips") == 0 && i + 1 < argc) {
+			options->instructionRate = strtoul(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--refresh") == 0 && i + 1 < argc) {
+			options->refreshRate = strtod(argv[++i], 0);
+		} else if (strcmp(arg, "--rewind") == 0 && i + 1 < argc) {
+			options->rewindMegabytes = strtod(argv[++i], 0);
+		} else if (strcmp(arg, "--trace-file") == 0 && i + 1 < argc) {
+			options->traceFile = argv[++i];
+		} else if (strcmp(arg, "--batch") == 0 && i + 1 < argc) {
+			options->batchSource = argv[++i];
+		} else if (strcmp(arg, "--output") == 0 && i + 1 < argc) {
+			options->batchOutput = argv[++i];
+		} else if (strcmp(arg, "--jobs") == 0 && i + 1 < argc) {
+			options->batchThreads = strtoul(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--format") == 0 && i + 1 < argc) {
+			const char * name = argv[++i];
+			if (strcmp(name, "jsonl") == 0) options->batchFormat = BATCH_FORMAT_JSONL;
+			else if (strcmp(name, "csv") == 0) options->batchFormat = BATCH_FORMAT_CSV;
+			else {
+				fprintf(stderr, "Unknown batch format %s\n", name);
+				return 1;
+			}
+		} else if (strcmp(arg, "--bench") == 0 && i + 1 < argc) {
+			options->benchSource = argv[++i];
+		} else if (strcmp(arg, "--baseline") == 0 && i + 1 < argc) {
+			options->benchBaseline = argv[++i];
+		} else if (strcmp(arg, "--tolerance") == 0 && i + 1 < argc) {
+			options->benchTolerance = strtod(argv[++i], 0);
+		} else if (strcmp(arg, "--repeat") == 0 && i + 1 < argc) {
+			options->benchRepeat = strtoul(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--check") == 0 && i + 1 < argc) {
+			options->checkSource = argv[++i];
+		} else if (strcmp(arg, "--random") == 0 && i + 1 < argc) {
+			options->checkRandom = strtoul(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--interval") == 0 && i + 1 < argc) {
+			options->checkInterval = strtoul(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--candidate") == 0 && i + 1 < argc) {
+			const char * name = argv[++i];
+			if (strcmp(name, "threaded") == 0) options->checkCandidate = CHECK_THREADED;
+			else if (strcmp(name, "jit") == 0) options->checkCandidate = CHECK_JIT;
+			else if (strcmp(name, "lockstep") == 0) options->checkCandidate = CHECK_LOCKSTEP;
+			else if (strcmp(name, "all") == 0) options->checkCandidate = CHECK_ALL;
+			else {
+				fprintf(stderr, "Unknown candidate engine %s\n", name);
+				return 1;
+			}
+		} else if (strcmp(arg, "--seed") == 0 && i + 1 < argc) {
+			options->seed = strtoull(argv[++i], 0, 0);
+			options->seeded = 1;
+		} else if (strcmp(arg, "--record") == 0 && i + 1 < argc) {
+			options->recordFile = argv[++i];
+		} else if (strcmp(arg, "--replay") == 0 && i + 1 < argc) {
+			options->replayFile = argv[++i];
+		} else if (strcmp(arg, "--video") == 0 && i + 1 < argc) {
+			options->videoFile = argv[++i];
+		} else if (strcmp(arg, "--video-format") == 0 && i + 1 < argc) {
+			const char * name = argv[++i];
+			options->videoFormat = video_parse_format(name);
+			if (options->videoFormat < 0) {
+				fprintf(stderr, "Unknown video format %s\n", name);
+				return 1;
+			}
+		} else if (strcmp(arg, "--fps") == 0 && i + 1 < argc) {
+			options->videoRate = strtoul(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--scale") == 0 && i + 1 < argc) {
+			options->videoScale = strtoul(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--seconds") == 0 && i + 1 < argc) {
+			options->videoSeconds = strtod(argv[++i], 0);
+		} else if (strcmp(arg, "--dedup") == 0) {
+			options->videoDedup = 1;
+		} else if (strcmp(arg, "--timecodes") == 0 && i + 1 < argc) {
+			options->timecodesFile = argv[++i];
+		} else if (strcmp(arg, "--turbo") == 0 && i + 1 < argc) {
+			options->turbo = 1;
+			options->turboMultiplier = strtod(argv[++i], 0);
+			if (options->turboMultiplier < 0) {
+				fprintf(stderr, "--turbo must not be negative\n");
+				return 1;
+			}
+		} else if (strcmp(arg, "--metrics") == 0 && i + 1 < argc) {
+			options->metricsFile = argv[++i];
+		} else if (strcmp(arg, "--half-blocks") == 0) {
+			options->halfBlocks = 1;
+		} else if (strcmp(arg, "--no-fast-forward") == 0) {
+			options->fastForward = 0;
+		} else if (strcmp(arg, "--hotspots") == 0 && i + 1 < argc) {
+			options->hotspotsFile = argv[++i];
+		} else if (strcmp(arg, "--flamegraph") == 0 && i + 1 < argc) {
+			options->flamegraphFile = argv[++i];
+		} else if (strcmp(arg, "--lanes") == 0 && i + 1 < argc) {
+			options->lanes = strtoul(argv[++i], 0, 0);
+		} else if (strcmp(arg, "--profile") == 0 && i + 1 < argc) {
+			const char * name = argv[++i];
+			options->profile = chip8_parse_profile(name);
+			if (options->profile < 0) {
+				fprintf(stderr, "Unknown quirk profile %s\n", name);
+				return 1;
+			}
+		} else if (strcmp(arg, "--engine") == 0 && i + 1 < argc) {
+			const char * name = argv[++i];
+			if (strcmp(name, "switch") == 0) options->engine = ENGINE_SWITCH;
+			else if (strcmp(name, "threaded") == 0) options->engine = ENGINE_THREADED;
+			else if (strcmp(name, "jit") == 0) options->engine = ENGINE_JIT;
+			else {
+				fprintf(stderr, "Unknown engine %s\n", name);
+				return 1;
+			}
+		} else if (strncmp(arg, "--", 2) == 0) {
+			fprintf(stderr, "Unknown option %s\n", arg);
+			return 1;
+		} else {
+			options->programFile = arg;
+		}
 	}
-	
-	unsigned long int amount = fwrite(machine, 1, sizeof(*machine), machineFile);
-	if (amount != sizeof(*machine)) {
-		return 3;
+
+	if (options->instructionRate == 0 || options->refreshRate <= 0) {
+		fprintf(stderr, "Instruction and refresh rates must be positive\n");
+		return 1;
 	}
 
-	fclose(machineFile);
+	if (options->headless && options->cycles == 0 && options->untilPc < 0) {
+		options->cycles = DEFAULT_HEADLESS_CYCLES;
+	}
+	if (options->lanes && !options->headless) {
+		fprintf(stderr, "--lanes needs --headless\n");
+		return 1;
+	}
+	if (options->recordFile && (options->headless || options->batchSource || options->benchSource || options->checkSource || options->checkRandom)) {
+		fprintf(stderr, "--record needs the interactive client\n");
+		return 1;
+	}
+	if (options->metricsFile && (options->headless || options->batchSource || options->benchSource || options->checkSource || options->checkRandom
+			|| options->replayFile || options->videoFile || options->lanes)) {
+		fprintf(stderr, "--metrics needs the interactive client\n");
+		return 1;
+	}
+	if (options->lanes && options->cycles == 0) {
+		options->cycles = DEFAULT_HEADLESS_CYCLES;
+	}
+	if (options->batchSource && options->cycles == 0) {
+		options->cycles = DEFAULT_HEADLESS_CYCLES;
+	}
+	if (options->benchSource && options->cycles == 0) {
+		options->cycles = DEFAULT_BENCH_CYCLES;
+	}
+	if ((options->checkSource || options->checkRandom) && options->cycles == 0) {
+		options->cycles = DEFAULT_CHECK_CYCLES;
+	}
+	if (options->videoFile) {
+		if (options->videoRate == 0 || options->videoScale == 0 || options->videoSeconds < 0) {
+			fprintf(stderr, "--fps and --scale must be positive\n");
+			return 1;
+		}
+		if (options->videoFormat < 0) {
+			size_t length = strlen(options->videoFile);
+			int pbm = length > 4 && strcmp(options->videoFile + length - 4, ".pbm") == 0;
+			options->videoFormat = pbm ? VIDEO_FORMAT_PBM : VIDEO_FORMAT_Y4M;
+		}
+		if (options->recordFile) {
+			fprintf(stderr, "--record needs the interactive client\n");
+			return 1;
+		}
+	}
+	if (options->checkInterval == 0) {
+		fprintf(stderr, "--interval must be positive\n");
+		return 1;
+	}
+	if (options->benchRepeat == 0 || options->benchTolerance < 0) {
+		fprintf(stderr, "--repeat must be positive and --tolerance not negative\n");
+		return 1;
+	}
 	return 0;
 }
 
-int deserialize_machine(Machine * machine) {
-	FILE * machineFile = fopen("spn/m.ch8.bin", "r");
-	if (machineFile == 0) {
-		return 1;
+int load_program_file(Chip8 * chip8, const char * filename) {
+	FILE * programFile = fopen(filename, "rb");
+	if (!programFile) {
+		perror("Could not read program file");
+		return 4;
 	}
 
-	unsigned long int amount = fread(machine, 1, sizeof(*machine), machineFile);
-	if (amount != sizeof(*machine)) {
-		return 2;
-	}
+	unsigned char program[MEMORY_LIMIT - PROGRAM_MEMORY_SECTOR + 1];
+	size_t programSize = fread(program, 1, sizeof(program), programFile);
+	fclose(programFile);
 
-	fclose(machineFile);
+	if (chip8_load(chip8, program, programSize)) {
+		fprintf(stderr, "Program too large\n");
+		return 5;
+	}
 	return 0;
 }
 
-int initialize_program_name(Machine * machine, const char * name, ssize_t size) {
-	if (size > MAX_STAT_WIDTH) {
-		perror("Size for program name cannot be larger than the maximum stat width.");
+static int write_profile_file(Chip8 * chip8, const char * path, int (* write)(const Chip8 *, FILE *)) {
+	FILE * file = fopen(path, "w");
+	if (file == 0 || write(chip8, file)) {
+		perror("Could not write the profile");
+		if (file) fclose(file);
 		return 1;
 	}
-	void * dest = &machine->ram.mem + NAME_MEMORY_SECTOR;
-	memcpy(dest, name, size);
+	fclose(file);
 	return 0;
 }
 
-void initialize_font_memory(Machine * machine, const unsigned char * font_start, ssize_t size) {
-	void * dest = machine->ram.mem + FONT_MEMORY_SECTOR;
-	memcpy(dest, font_start, size);
+// Writes whichever of --hotspots and --flamegraph were asked for.
+int write_profile(Chip8 * chip8, const Options * options) {
+	int failed = 0;
+	if (options->hotspotsFile) failed |= write_profile_file(chip8, options->hotspotsFile, chip8_profile_write_json);
+	if (options->flamegraphFile) failed |= write_profile_file(chip8, options->flamegraphFile, chip8_profile_write_folded);
+	return failed;
 }
 
-void initialize_machine(Machine * machine) {
-	*machine->error = 0;
-	machine->cycles = 0;
-	machine->cycleTime = clock();
-	machine->pc = PROGRAM_MEMORY_SECTOR;
-	machine->stack.sp = 0;
-	machine->delayTimer = 0;
-	machine->soundTimer = 0;
-	machine->keyBuffer = -1;
+int run_headless(Chip8 * chip8, Options * options) {
+	Machine * machine = chip8_machine(chip8);
+	double start = monotonic_seconds();
 
-	memset(machine->ram.mem, 0, MEMORY_LIMIT);
-	memset(machine->screen.mem, 1, SCREEN_COUNT);
+	while (!machine->halted) {
+		if (options->cycles && machine->cycles >= options->cycles) break;
+		if (machine->pc == options->untilPc) break;
 
-	initialize_program_name(machine, program_name, sizeof(program_name));
-	initialize_font_memory(machine, font, sizeof(font) / sizeof(*font));
-	fill_keymap_from_input_map();
+		unsigned int count = HEADLESS_BATCH;
+		if (options->untilPc >= 0) count = 1;
+		if (options->cycles && options->cycles - machine->cycles < count) {
+			count = options->cycles - machine->cycles;
+		}
+
+		chip8_step(chip8, count);
+	}
+
+	double wallTime = monotonic_seconds() - start;
+
+	printf("cycles: %u\n", machine->cycles);
+	printf("pc: 0x%.4x\n", machine->pc);
+	printf("profile: %s (0x%.2x)\n", chip8_profile_name(machine->quirks), machine->quirks);
+	printf("wall time: %.6lf s\n", wallTime);
+	printf("instructions per second: %.0lf\n", wallTime > 0 ? machine->cycles / wallTime : 0);
+	printf("screen hash: 0x%.16llx\n", chip8_hash_bytes(HASH_SEED, &machine->screen, sizeof(machine->screen)));
+	printf("ram hash: 0x%.16llx\n", chip8_hash_bytes(HASH_SEED, &machine->ram, sizeof(machine->ram)));
+	if (*machine->error) {
+		printf("error: %s\n", machine->error);
+	}
+	if (machine->halted) {
+		chip8_dump_trace(chip8, stderr, TRACE_DUMP_ON_ERROR);
+	}
+	if (options->traceFile && chip8_dump_trace_file(chip8, options->traceFile)) {
+		perror("Could not write trace file");
+	}
+	write_profile(chip8, options);
+	return machine->halted ? 6 : 0;
 }
 
-void unsafe_write_machine_error(Machine * machine, const char * restrict format, ...) {
-	clear_terminal();
-	va_list args;
-	va_start(args, format);
-	vsprintf(machine->error, format, args);
+static int compare_hashes(const void * a, const void * b) {
+	unsigned long long int x = *(const unsigned long long int *)a;
+	unsigned long long int y = *(const unsigned long long int *)b;
+	return x < y ? -1 : x > y;
 }
 
-void vunsafe_write_machine_error(Machine * machine, const char * restrict format, va_list args) {
-	clear_terminal();
-	vsprintf(machine->error, format, args);
-}
-
-int p = 0;
-int b = 0;
-void fatal_unsafe_write_machine_error(Machine * machine, const char * restrict format, ...) {
-	if (b) return;
-	va_list args;
-	va_start(args, format);
-	vunsafe_write_machine_error(machine, format, args);
-	b = 1;
-}
-
-void update_machine_time(Machine * machine) {
-	machine->cycleTimeDelta = 0;
-    if (machine->delayTimer > 0) machine->delayTimer--;
-    if (machine->soundTimer > 0) machine->soundTimer--;
-}
-
-void draw_screen(Machine * machine) {
-	reset_cursor();
-	char * fill_char = FILL_CHARACTER;
-	char * clear_char = CLEAR_CHARACTER;
-	for (int i = 0; i < SCREEN_HEIGHT; i++) {
-		for (int j = 0; j < SCREEN_WIDTH; j++) {
-			char val = machine->screen.mem[j + (i * SCREEN_WIDTH)];
-			if (val) {
-				write(1, fill_char, SIZE_FILL_CHARACTER);
-			} else {
-				write(1, clear_char, SIZE_CLEAR_CHARACTER);
+// Reads a movie and sets the machine up the way the recording started.
+int start_movie(Chip8 * chip8, const char * path, Movie * movie) {
+	int result = movie_read(movie, path);
+	if (result) {
+		fprintf(stderr, result == 1 ? "Could not read movie %s\n" : "%s is not a finished movie\n", path);
+		return result == 3 ? 3 : 1;
+	}
+
+	Machine * machine = chip8_machine(chip8);
+	machine->quirks = movie->quirks;
+	machine->instructionRate = movie->instructionRate;
+	chip8_seed(chip8, movie->seed);
+	if (chip8_state_hash(chip8) != movie->startHash) {
+		fprintf(stderr, "The movie starts from another program or setup\n");
+		movie_free(movie);
+		return 7;
+	}
+	return 0;
+}
+
+// Feeds a movie back to the machine as fast as it runs and checks it ends where the
+// recording did.
+int run_replay(Chip8 * chip8, Options * options) {
+	Movie movie;
+	int result = start_movie(chip8, options->replayFile, &movie);
+	if (result) {
+		return result;
+	}
+
+	Machine * machine = chip8_machine(chip8);
+	double start = monotonic_seconds();
+	unsigned int next = 0;
+	while (!machine->halted && machine->cycles < movie.endCycles) {
+		while (next < movie.count && movie.events[next].cycle <= machine->cycles) {
+			chip8_set_keys(chip8, movie.events[next++].keys);
+		}
+		unsigned int until = next < movie.count ? movie.events[next].cycle : movie.endCycles;
+		unsigned int count = until - machine->cycles < HEADLESS_BATCH ? until - machine->cycles : HEADLESS_BATCH;
+		chip8_step(chip8, count);
+	}
+	// keys pressed on the last recorded cycle
+	while (next < movie.count && movie.events[next].cycle <= machine->cycles) {
+		chip8_set_keys(chip8, movie.events[next++].keys);
+	}
+	double wallTime = monotonic_seconds() - start;
+
+	unsigned long long int endHash = chip8_state_hash(chip8);
+	int matched = machine->cycles == movie.endCycles && endHash == movie.endHash;
+	printf("events: %u\n", movie.count);
+	printf("cycles: %u of %u\n", machine->cycles, movie.endCycles);
+	printf("profile: %s (0x%.2x)\n", chip8_profile_name(machine->quirks), machine->quirks);
+	printf("wall time: %.6lf s\n", wallTime);
+	printf("instructions per second: %.0lf\n", wallTime > 0 ? machine->cycles / wallTime : 0);
+	printf("state hash: 0x%.16llx, recorded 0x%.16llx\n", endHash, movie.endHash);
+	printf("replay: %s\n", matched ? "match" : "MISMATCH");
+	if (*machine->error) {
+		printf("error: %s\n", machine->error);
+	}
+	write_profile(chip8, options);
+	movie_free(&movie);
+	return matched ? 0 : 7;
+}
+
+// Runs headlessly and writes the screen every 1 / --fps of machine time, for --seconds, for
+// --cycles or to the end of a --replay movie, whose key presses it plays back.
+int run_video(Chip8 * chip8, Options * options) {
+	Machine * machine = chip8_machine(chip8);
+	Movie movie = {0};
+	if (options->replayFile) {
+		int result = start_movie(chip8, options->replayFile, &movie);
+		if (result) {
+			return result;
+		}
+	}
+
+	unsigned long long int limit = options->cycles;
+	if (options->videoSeconds > 0) limit = options->videoSeconds * machine->instructionRate;
+	if (limit == 0) limit = options->replayFile ? movie.endCycles : (unsigned long long int)DEFAULT_VIDEO_SECONDS * machine->instructionRate;
+
+	VideoWriter video;
+	int result = video_open(&video, options->videoFile, options->videoFormat, options->videoRate, options->videoScale, options->videoDedup, options->timecodesFile);
+	if (result) {
+		perror(result == 3 ? "Cannot allocate the video buffer" : "Could not open the video");
+		movie_free(&movie);
+		return result;
+	}
+
+	double start = monotonic_seconds();
+	unsigned int next = 0;
+	for (unsigned long long int frame = 1; !machine->halted; frame++) {
+		unsigned long long int frameEnd = frame * machine->instructionRate / options->videoRate;
+		if (frameEnd > limit) break;
+		while (machine->cycles < frameEnd && !machine->halted) {
+			while (next < movie.count && movie.events[next].cycle <= machine->cycles) {
+				chip8_set_keys(chip8, movie.events[next++].keys);
 			}
-			
+			unsigned long long int until = next < movie.count && movie.events[next].cycle < frameEnd ? movie.events[next].cycle : frameEnd;
+			chip8_step(chip8, until - machine->cycles);
 		}
-	    set_cursor_next_line();
-	}
-	reset_cursor();
-}
-
-void draw_sprite(Machine * machine, unsigned short int size, unsigned short int sprite, unsigned char x, unsigned char y) {
-	unsigned char px = x % SCREEN_WIDTH;
-	unsigned char py = y % SCREEN_HEIGHT;
-
-	machine->registers.reg[15] = 0;
-	for (int i = 0; i < size; i++) {
-		if (py + i > SCREEN_HEIGHT - 1) break;
-		unsigned char spriteData = machine->ram.mem[sprite + i];
-		for (int j = 0; j < 8; j++) {
-			unsigned char draw = (spriteData << j) & 0x80;
-			if (px + j > SCREEN_WIDTH - 1) goto outer;
-			unsigned char current = machine->screen.mem[px + j + ((py + i) * SCREEN_WIDTH)];
-			
-			if (draw) {
-				if (current) {
-					machine->screen.mem[px + j + ((py + i) * SCREEN_WIDTH)] = 0;
-					machine->registers.reg[15] = 1;
-				} else {
-					machine->screen.mem[px + j + ((py + i) * SCREEN_WIDTH)] = 1;
-				}
+		result = video_write_frame(&video, machine->screen.rows);
+		if (result) break;
+	}
+	if (video_close(&video)) result = 2;
+	if (result) perror("Could not write the video");
+	double wallTime = monotonic_seconds() - start;
+
+	double seconds = (double)video.frames / options->videoRate;
+	fprintf(stderr, "frames: %u (%u written)\n", video.frames, video.written);
+	fprintf(stderr, "bytes: %llu\n", video.bytes);
+	fprintf(stderr, "video time: %.3lf s\n", seconds);
+	fprintf(stderr, "wall time: %.6lf s\n", wallTime);
+	fprintf(stderr, "speed: %.1lfx realtime\n", wallTime > 0 ? seconds / wallTime : 0);
+	if (*machine->error) {
+		fprintf(stderr, "error: %s\n", machine->error);
+	}
+	write_profile(chip8, options);
+	movie_free(&movie);
+	return result;
+}
+
+// Runs one program in options->lanes machines at once, lane i seeded with seed + i so each
+// sees different random bytes. Lane 0 matches a plain headless run.
+int run_lanes(Options * options) {
+	Chip8Lockstep * lockstep = chip8_lockstep_create(options->lanes);
+	unsigned long long int * hashes = malloc(options->lanes * sizeof(*hashes));
+	if (lockstep == 0 || hashes == 0) {
+		perror("Cannot allocate the lanes");
+		chip8_lockstep_destroy(lockstep);
+		free(hashes);
+		return 3;
+	}
+
+	for (unsigned int i = 0; i < options->lanes; i++) {
+		Chip8 * lane = chip8_lockstep_lane(lockstep, i);
+		initialize_program_name(chip8_machine(lane), program_name, sizeof(program_name));
+		chip8_machine(lane)->instructionRate = options->instructionRate;
+		chip8_set_engine(lane, options->engine);
+		chip8_set_fast_forward(lane, options->fastForward);
+		if (options->programFile) {
+			int result = load_program_file(lane, options->programFile);
+			if (result) {
+				chip8_lockstep_destroy(lockstep);
+				free(hashes);
+				return result;
 			}
-		inner: {};
 		}
-	outer: {};
+		if (options->profile >= 0) {
+			chip8_machine(lane)->quirks = options->profile;
+		}
+		chip8_seed(lane, options->seed + i);
 	}
-	
-	machine->screen.mem[px + (py * SCREEN_WIDTH)] = 1;
+	chip8_lockstep_memory_changed(lockstep);
+
+	double start = monotonic_seconds();
+	unsigned int cycles = 0;
+	while (cycles < options->cycles) {
+		unsigned int count = HEADLESS_BATCH;
+		if (options->cycles - cycles < count) count = options->cycles - cycles;
+		unsigned int ran = chip8_lockstep_step(lockstep, count);
+		if (ran == 0) break;
+		cycles += ran;
+	}
+	double wallTime = monotonic_seconds() - start;
+
+	unsigned long long int instructions = 0;
+	unsigned int halted = 0;
+	for (unsigned int i = 0; i < options->lanes; i++) {
+		Machine * machine = chip8_machine(chip8_lockstep_lane(lockstep, i));
+		instructions += machine->cycles;
+		halted += machine->halted;
+		hashes[i] = chip8_hash_bytes(HASH_SEED, &machine->screen, sizeof(machine->screen));
+	}
+	qsort(hashes, options->lanes, sizeof(*hashes), compare_hashes);
+	unsigned int distinct = 0;
+	for (unsigned int i = 0; i < options->lanes; i++) {
+		if (i == 0 || hashes[i] != hashes[i - 1]) distinct++;
+	}
+	unsigned long long int grouped, scalar;
+	chip8_lockstep_stats(lockstep, &grouped, &scalar);
+
+	Machine * first = chip8_machine(chip8_lockstep_lane(lockstep, 0));
+	printf("lanes: %u (%u halted)\n", options->lanes, halted);
+	printf("cycles: %u\n", cycles);
+	printf("profile: %s (0x%.2x)\n", chip8_profile_name(first->quirks), first->quirks);
+	printf("wall time: %.6lf s\n", wallTime);
+	printf("machine instructions per second: %.0lf\n", wallTime > 0 ? instructions / wallTime : 0);
+	printf("run in lockstep: %.2lf%%\n", grouped + scalar ? 100.0 * grouped / (grouped + scalar) : 0);
+	printf("distinct screens: %u\n", distinct);
+	printf("screen hash: 0x%.16llx\n", chip8_hash_bytes(HASH_SEED, &first->screen, sizeof(first->screen)));
+	printf("ram hash: 0x%.16llx\n", chip8_hash_bytes(HASH_SEED, &first->ram, sizeof(first->ram)));
+
+	chip8_lockstep_destroy(lockstep);
+	free(hashes);
+	return 0;
 }
 
-char currentInstructionStat[MAX_STAT_WIDTH] = {0};
-void execute_instruction(Machine * machine) {
-	unsigned char p1 = machine->ram.mem[machine->pc];
-	unsigned char p2 = machine->ram.mem[machine->pc + 1];
+// The terminal session runs on two threads. The emulation thread owns the machine and keeps
+// to the frame deadlines; the render thread owns the terminal, formats and writes whatever
+// frame is newest and forwards input. A terminal that blocks on write only holds up the
+// render thread.
+typedef struct {
+	Chip8 * chip8;
+	const Options * options;
+	Movie movie;
+	int recording;
+	TripleBuffer frames;
+	InputQueue inputs;
+	// the emulation thread writes a byte after every frame it publishes
+	int wake[2];
+	MetricsPage * metrics;
+	atomic_int running;
+	int result;
+} Session;
+
+void capture_frame(Frame * frame, Chip8 * chip8) {
+	Machine * machine = chip8_machine(chip8);
+	memcpy(frame->screen, chip8_get_framebuffer(chip8), sizeof(frame->screen));
+	memcpy(frame->error, machine->error, MAX_STAT_WIDTH);
+	const char * name = (char *)machine->ram.mem + NAME_MEMORY_SECTOR;
+	size_t nameSize = strnlen(name, MAX_STAT_WIDTH - 1);
+	memcpy(frame->programName, name, nameSize);
+	frame->programName[nameSize] = 0;
+	const TraceRecord * instruction = chip8_latest_trace_record(chip8);
+	frame->traced = instruction != 0;
+	if (instruction) frame->instruction = *instruction;
+	frame->cycles = machine->cycles;
+	frame->pc = machine->pc;
+	frame->keyBuffer = machine->keyBuffer;
+	frame->quirks = machine->quirks;
+	frame->soundTimer = machine->soundTimer;
+	frame->halted = machine->halted;
+	chip8_rewind_stats(chip8, &frame->rewind);
+}
 
-	unsigned char op   = (p1 & 240) >> 4;
-	unsigned char x = p1 & 15;
-	unsigned char y = (p2 & 240) >> 4;
-	unsigned char reg1 = machine->registers.reg[x];
-	unsigned char reg2 = machine->registers.reg[y];
+// Copies the figures of a frame into the metrics page, a handful of stores between the two
+// sequence bumps.
+void publish_metrics(MetricsPage * page, Chip8 * chip8, const Frame * frame, unsigned long long int droppedFrames) {
+	Machine * machine = chip8_machine(chip8);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	unsigned int bucket = frame->frameTime * 1000;
+
+	metrics_begin_update(page);
+	page->updated = now.tv_sec + now.tv_nsec / 1e9;
+	page->cycles = machine->cycles;
+	page->speed = frame->speed;
+	page->instructionRate = machine->instructionRate;
+	page->instructionsPerSecond = frame->speed * machine->instructionRate;
+	page->pc = machine->pc;
+	page->opcode = machine->pc < MEMORY_LIMIT - 1 ? machine->ram.mem[machine->pc] << 8 | machine->ram.mem[machine->pc + 1] : 0;
+	page->index = machine->regI;
+	page->delayTimer = machine->delayTimer;
+	page->soundTimer = machine->soundTimer;
+	page->quirks = machine->quirks;
+	page->paused = frame->paused;
+	page->halted = machine->halted;
+	page->turbo = frame->turbo;
+	page->frames++;
+	page->droppedFrames = droppedFrames;
+	page->lateFrames = frame->lateFrames;
+	page->frameTime = frame->frameTime;
+	page->jitter = frame->jitter;
+	page->frameTimes[bucket < METRICS_FRAME_BUCKETS ? bucket : METRICS_FRAME_BUCKETS - 1]++;
+	memcpy(page->error, machine->error, MAX_STAT_WIDTH);
+	metrics_end_update(page);
+}
 
-	unsigned short int num  = p2 & 15;
-	unsigned short int nnum  = p2;
-	
-	unsigned short int nnnum  = ((unsigned short int)(p1 & 15)  << 8) + p2;
+// Handles one byte of input on the emulation thread. Returns 0 to keep running.
+int handle_input(Session * session, int input, int * paused, int * turbo, int * saveSlot, unsigned int * recordedCycles, double * instructionBudget) {
+	Chip8 * chip8 = session->chip8;
+	Machine * machine = chip8_machine(chip8);
+	char saveStatePath[SAVE_STATE_PATH_SIZE];
+	int key = keymap[input];
+
+	if (key >= 0) {
+		chip8_set_keys(chip8, 1 << key);
+		if (session->recording && movie_add_event(&session->movie, machine->cycles, 1 << key)) {
+			perror("Cannot allocate the movie");
+			return 3;
+		}
+	}
 
-	sprintf(currentInstructionStat, "(%.2x%.2x @ %.4x)  %.1x(%.1x,%.1x) 0=%.2x 1=%.2x | 0x%.4x 0x%.4x 0x%.4x", p1, p2, machine->pc, op, x, y, reg1, reg2, num, nnum, nnnum);
-	
-	switch(op) {
-	case 0:
-		if (p2 == 0xe0) {
-			memset(machine->screen.mem, 0, SCREEN_COUNT);
-			break;
-		} else if (p2 == 0xee) {
-			if (machine->stack.sp == 0) {
-				fatal_unsafe_write_machine_error(machine, "Error: cannot return out of an empty stack");
-				return;
-			}
-			machine->stack.sp--;
-			machine->pc = machine->stack.mem[machine->stack.sp];
-			break;
-		} else if (p1 + p2 == 0) return; // stop executing empty space
-		
-		
-		unsafe_write_machine_error(machine, "Warning: ignored instruction 0x%.2x%2.2x", p1, p2);
-		break;
-	case 1:
-		machine->pc = nnnum;
-		return;
-	case 2:
-		machine->stack.mem[machine->stack.sp] = machine->pc;
-		machine->stack.sp++;
-		machine->pc = nnnum;
-		return;
-	case 3:
-		if (reg1 == nnum) machine->pc += 2;
-		break;
-	case 4:
-		if (reg1 != nnum) machine->pc += 2;
-		break;
-	case 5:
-		if (reg1 == reg2) machine->pc += 2;
-		break;
-	case 6:
-			machine->registers.reg[x] = nnum;
-			break;
-	case 7:
-		machine->registers.reg[x] += nnum;
-		break;
-	case 8:
-		switch(num) {
-		case 0:
-			machine->registers.reg[x] = reg2;
-			break;
-		case 1:
-			machine->registers.reg[x] |= reg2;
-			if (COSMAC_VF_RESET_CONFIGURATION) machine->registers.reg[15] = 0;
-			break;
-		case 2:
-			machine->registers.reg[x] &= reg2;
-			if (COSMAC_VF_RESET_CONFIGURATION) machine->registers.reg[15] = 0;
-			break;
-		case 3:
-			machine->registers.reg[x] ^= reg2;
-			if (COSMAC_VF_RESET_CONFIGURATION) machine->registers.reg[15] = 0;
-			break;
-		case 4:
-			machine->registers.reg[x] = reg1 + reg2;
-			if (reg1 + reg2 > 255) machine->registers.reg[15] = 1;
-			else machine->registers.reg[15] = 0;
-			break;
-		case 5:
-			machine->registers.reg[x] = reg1 - reg2;
-			if (reg1 >= reg2) machine->registers.reg[15] = 1;
-			else machine->registers.reg[15] = 0;
-			break;
-		case 6:
-			if (!SUPER_CHIP_SHIFT_CONFIGURATION) {
-				machine->registers.reg[x] = reg2;
-				machine->registers.reg[x] >>= 1;
-				machine->registers.reg[15] = reg2 & 1;
-			} else {
-				machine->registers.reg[x] >>= 1;
-				machine->registers.reg[15] = reg1 & 1;
-			}
-			break;
-		case 7:
-			machine->registers.reg[x] = reg2 - reg1;
-			if (reg2 >= reg1) machine->registers.reg[15] = 1;
-			else machine->registers.reg[15] = 0;
-			break;
-		case 14:
-			if (!SUPER_CHIP_SHIFT_CONFIGURATION) {
-				machine->registers.reg[x] = reg2;
-				machine->registers.reg[x] <<= 1;
-				machine->registers.reg[15] = reg2 & 8;
-			} else {
-				machine->registers.reg[x] <<= 1;
-				machine->registers.reg[15] = (reg1 & 8) >> 3;
+	if (input == REWIND_KEY) {
+		// holding the key repeats it, so the machine keeps winding back
+		chip8_rewind(chip8, REWIND_FRAMES_PER_KEY);
+		*recordedCycles = machine->cycles;
+		// the recorded frame predates any keys pressed on its cycle
+		if (session->recording) movie_truncate(&session->movie, machine->cycles);
+		*instructionBudget = 0;
+	}
+
+	if (input == 13) return -1;
+	if (input == 8) *paused = !*paused;
+	if (input == TURBO_KEY) {
+		*turbo = !*turbo;
+		*instructionBudget = 0;
+	}
+	if (input == '[') *saveSlot = (*saveSlot + SAVE_STATE_SLOTS - 1) % SAVE_STATE_SLOTS;
+	if (input == ']') *saveSlot = (*saveSlot + 1) % SAVE_STATE_SLOTS;
+	sprintf(saveStatePath, SAVE_STATE_FILE, *saveSlot);
+	if (input == 9) {
+		mkdir("spn", 0777);
+		int result = chip8_save(chip8, saveStatePath);
+		if (result > 0) {
+			perror("Serialization error");
+			return result;
+		}
+		sprintf(machine->error, "Warning: wrote machine state to slot %d", *saveSlot);
+		*paused = PAUSE_ON_SAVE_MACHINE | *paused;
+	}
+	if (input == 67) {
+		// a movie cannot jump to another state, so it ends where the load happens
+		if (session->recording) movie_end(&session->movie, chip8);
+		int result = chip8_restore(chip8, saveStatePath);
+		if (result == 0 && session->recording) {
+			session->recording = 0;
+			if (movie_write(&session->movie, session->options->recordFile)) {
+				perror("Could not write the movie");
 			}
-			
-			break;
-		default:
-			fatal_unsafe_write_machine_error(machine, "Error: unknown instruction 0x%.2x%2.2x at address 0x%.4x", p1, p2, machine->pc);
-			return;
 		}
-		break;
-	case 9:
-		if (reg1 != reg2) machine->pc += 2;
-		break;
-	case 10:
-		machine->regI = nnnum;
-		break;
-	case 11:
-		if (SUPER_CHIP_JUMP_CONFIGURATION) {
-			machine->pc = nnnum + reg1;
+		if (result == 0) {
+			sprintf(machine->error, "Warning: loaded machine from slot %d!", *saveSlot);
+			*paused = !UNPAUSE_ON_LOAD_MACHINE & *paused;
+		} else if (result == 1) {
+			sprintf(machine->error, "Warning: slot %d is empty", *saveSlot);
+		} else if (result == 3) {
+			sprintf(machine->error, "Warning: slot %d holds another program", *saveSlot);
 		} else {
-			machine->pc = nnnum + machine->registers.reg[0];
+			sprintf(machine->error, "Warning: slot %d is not a valid save state", *saveSlot);
 		}
-		return;
-	case 12:
-		machine->registers.reg[x] = (unsigned char)machine->cycleTime & nnum;
-		break;
-	case 13:
-		draw_sprite(machine, num, machine->regI, reg1, reg2);
-		break;
-	case 14:
-		switch (nnum) {
-		case 0x9e:
-			if (machine->keyBuffer == (reg1 & 15)) {
-					machine->pc += 2;
-					machine->keyBuffer = -1;
-				}
-			break;
-		case 0xa1:
-			if (machine->keyBuffer != (reg1 & 15)) {
-				machine->pc += 2;
-				machine->keyBuffer = -1;
+	}
+	return 0;
+}
+
+void * run_emulation(void * argument) {
+	Session * session = argument;
+	Chip8 * chip8 = session->chip8;
+	Machine * machine = chip8_machine(chip8);
+	const Options * options = session->options;
+
+	FrameClock frameClock;
+	initialize_frame_clock(&frameClock, 1 / options->refreshRate);
+	double lastTime = monotonic_seconds();
+	double lastRefresh = lastTime;
+	double instructionBudget = 0;
+	double frameJitter = 0;
+	double speed = 1;
+	int p = 0;
+	int turbo = options->turbo;
+	int saveSlot = 0;
+	int lastInput = 0;
+	int traceDumped = 0;
+	unsigned int recordedCycles = 0;
+	int recorded = 0;
+
+	while (atomic_load(&session->running)) {
+		frame_clock_wait(&frameClock);
+
+		unsigned char input;
+		while (input_queue_pop(&session->inputs, &input)) {
+			lastInput = input;
+			int result = handle_input(session, input, &p, &turbo, &saveSlot, &recordedCycles, &instructionBudget);
+			if (result) {
+				session->result = result > 0 ? result : 0;
+				atomic_store(&session->running, 0);
+				break;
 			}
-			machine->keyBuffer = -1;
-			break;
-		default:
-			fatal_unsafe_write_machine_error(machine, "Error: unknown instruction 0x%.2x%2.2x at address 0x%.4x", p1, p2, machine->pc);
-			return;
 		}
-		break;
-	case 15:
-		switch (nnum) {
-		case 0x07:
-			machine->registers.reg[x] = machine->delayTimer;
-			break;
-		case 0x15:
-			machine->delayTimer = machine->registers.reg[x];
-			break;
-		case 0x18:
-			machine->soundTimer = machine->registers.reg[x];
+		if (!atomic_load(&session->running)) {
 			break;
-		case 0x1e:
-			machine->regI += reg1;
-			if (AMIGA_INDEX_OVERFLOW_CONFIGURATION) {
-				if (machine->regI > 0x1000) {
-					machine->registers.reg[15] = 1;
-				} else machine->registers.reg[15] = 0;
-			}
-			break;
-		case 0x0a:
-			if (machine->keyBuffer > -1) {
-				machine->registers.reg[x] = machine->keyBuffer;
-				machine->keyBuffer = -1;
-			} else machine->pc -= 2;
-			break;
-		case 0x29:
-			machine->regI = FONT_MEMORY_SECTOR + (reg1 * 5);
-			break;
-		case 0x33:
-			machine->ram.mem[machine->regI + 2] = reg1 % 10;
-			machine->ram.mem[machine->regI + 1] = (reg1 / 10) % 10;
-			machine->ram.mem[machine->regI] = (reg1 / 100);
-			break;
-		case 0x55:
-			for (int i = 0; i < x + 1; i++) {
-				machine->ram.mem[machine->regI + i] = machine->registers.reg[i];
-			}
-			if (COSMAC_INDEX_INCREMENT_CONFIGURATION) {
-				machine->regI += x + 1;
-			}
-			break;
-		case 0x65:
-			for (int i = 0; i < x + 1; i++) {
-				machine->registers.reg[i] = machine->ram.mem[machine->regI + i];	
+		}
+
+		double now = monotonic_seconds();
+		unsigned int startCycles = machine->cycles;
+		// timers follow machine cycles, so turbo speeds them up along with everything else
+		double rate = machine->instructionRate * (turbo ? options->turboMultiplier : 1);
+		if (!p && !machine->halted && turbo && rate == 0) {
+			// uncapped: run slices until most of the frame is used, leaving time to hand it over
+			double end = now + frameClock.period * TURBO_FRAME_SHARE;
+			do {
+				chip8_step(chip8, TURBO_SLICE);
+			} while (!machine->halted && monotonic_seconds() < end);
+			now = monotonic_seconds();
+		} else if (!p && !machine->halted) {
+			// a late frame runs everything it owes, up to MAX_CATCH_UP_SECONDS worth
+			instructionBudget += (now - lastTime) * rate;
+			if (instructionBudget > rate * MAX_CATCH_UP_SECONDS) {
+				instructionBudget = rate * MAX_CATCH_UP_SECONDS;
 			}
-			if (COSMAC_INDEX_INCREMENT_CONFIGURATION) {
-				machine->regI += x + 1;
+			if (instructionBudget >= 1) {
+				instructionBudget -= chip8_step(chip8, (unsigned int)instructionBudget);
 			}
-			break;
-		default:
-			fatal_unsafe_write_machine_error(machine, "Error: unknown instruction 0x%.2x%2.2x at address 0x%.4x", p1, p2, machine->pc);
-			return;
 		}
-		break;
-	default:
-		fatal_unsafe_write_machine_error(machine, "Error: unknown instruction 0x%.2x%2.2x at address 0x%.4x", p1, p2, machine->pc);
-		return;
-	}
-
-	machine->pc += 2;
-}
+		if (now > lastTime && !p) {
+			// the difference stays right when an uncapped run wraps the cycle counter
+			unsigned int ran = machine->cycles - startCycles;
+			double frameSpeed = ran / ((now - lastTime) * machine->instructionRate);
+			speed += (frameSpeed - speed) * SPEED_SMOOTHING;
+		}
+		lastTime = now;
+
+		double secSinceLastRefresh = now - lastRefresh;
+		lastRefresh = now;
+		double deviation = secSinceLastRefresh - frameClock.period;
+		frameJitter += ((deviation < 0 ? -deviation : deviation) - frameJitter) * JITTER_SMOOTHING;
+
+		// only frames where the machine moved go into the rewind history
+		if (!recorded || machine->cycles != recordedCycles) {
+			chip8_rewind_record(chip8);
+			recordedCycles = machine->cycles;
+			recorded = 1;
+		}
 
+		Frame * frame = triple_buffer_back(&session->frames);
+		capture_frame(frame, chip8);
+		frame->paused = p;
+		frame->turbo = turbo;
+		frame->speed = speed;
+		frame->saveSlot = saveSlot;
+		frame->lastInput = lastInput;
+		frame->rewindEnabled = options->rewindMegabytes > 0;
+		frame->frameTime = secSinceLastRefresh;
+		frame->jitter = frameJitter;
+		frame->lateFrames = frameClock.lateFrames;
+		if (session->metrics) {
+			publish_metrics(session->metrics, chip8, frame, atomic_load_explicit(&session->frames.dropped, memory_order_relaxed));
+		}
+		triple_buffer_publish(&session->frames);
+		// a full pipe already holds a wake-up, so the byte can be lost
+		write(session->wake[1], "", 1);
+
+		if (machine->halted && !traceDumped) {
+			mkdir("spn", 0777);
+			chip8_dump_trace_file(chip8, options->traceFile ? options->traceFile : DEFAULT_TRACE_FILE);
+			traceDumped = 1;
+		}
+	}
 
-void debug_first_4_program_instruction(Machine * machine) {
-	unsafe_write_machine_error(machine, "%d %d %d %d %d %d %d %d",
-							   machine->ram.mem[PROGRAM_MEMORY_SECTOR],
-							   machine->ram.mem[PROGRAM_MEMORY_SECTOR + 1],
-							   machine->ram.mem[PROGRAM_MEMORY_SECTOR + 2],
-							   machine->ram.mem[PROGRAM_MEMORY_SECTOR + 3],
-							   machine->ram.mem[PROGRAM_MEMORY_SECTOR + 4],
-							   machine->ram.mem[PROGRAM_MEMORY_SECTOR + 5],
-							   machine->ram.mem[PROGRAM_MEMORY_SECTOR + 6],
-							   machine->ram.mem[PROGRAM_MEMORY_SECTOR + 7]);
+	if (options->traceFile && !traceDumped) {
+		chip8_dump_trace_file(chip8, options->traceFile);
+	}
+	write_profile(chip8, options);
+	if (session->recording) {
+		movie_end(&session->movie, chip8);
+		int result = movie_write(&session->movie, options->recordFile);
+		if (result) {
+			perror("Could not write the movie");
+			if (!session->result) session->result = result;
+		}
+	}
+	free_frame_clock(&frameClock);
+	write(session->wake[1], "", 1);
+	return 0;
 }
 
 int main(int argc, char * argv[]) {
-	FILE * stdout = fdopen(1, "w");
-	char * screenBuffer = malloc(SCREEN_BUFFER_SIZE);
-	if (setvbuf(stdout, screenBuffer, _IOFBF, SCREEN_BUFFER_SIZE)) {
-		perror("Cannot honor our buffering scheme");
-		return 3;
+	Options options;
+	if (parse_options(&options, argc, argv)) {
+		return 1;
 	}
-	
-	Machine machine;
-	
-
-	// debug buffers
-	char frameTimeStat[MAX_STAT_WIDTH];
-	char framesPerSecondStat[MAX_STAT_WIDTH];
-	char lastInputStat[MAX_STAT_WIDTH];
-	char keyBufferStat[MAX_STAT_WIDTH];
-	char programCounterStat[MAX_STAT_WIDTH];
-	char soundTimerStat[MAX_STAT_WIDTH];
-	char currentCycleStat[MAX_STAT_WIDTH];
-
-	sprintf(lastInputStat, "Code of Last Input: %03d", 0);
-	sprintf(keyBufferStat, "Key Buffer: %02d", -1);
-
-	initialize_machine(&machine);
-
-	if (argc > 1) {
-		const char * filename = argv[1];
-		FILE * programFile = fopen(filename, "rb");
-		if (!programFile) {
-			perror("Could not read program file");
-			return 4;
-		}
 
-		fseek(programFile, 0, SEEK_END);
-		long int programSize = ftell(programFile);
-		rewind(programFile);
+	if (options.batchSource) {
+		BatchOptions batch = {
+			.source = options.batchSource,
+			.outputFile = options.batchOutput,
+			.format = options.batchFormat,
+			.threads = options.batchThreads,
+			.cycles = options.cycles,
+			.instructionRate = options.instructionRate,
+			.engine = options.engine,
+			.profile = options.profile,
+			.seed = options.seed,
+			.fastForward = options.fastForward,
+			.programName = program_name,
+			.programNameSize = sizeof(program_name),
+		};
+		return run_batch(&batch);
+	}
 
-		if (programSize > MEMORY_LIMIT - PROGRAM_MEMORY_SECTOR) {
-			perror("Program too large");
-			return 5;
-		}
+	if (options.benchSource) {
+		BenchOptions bench = {
+			.source = options.benchSource,
+			.outputFile = options.batchOutput,
+			.baselineFile = options.benchBaseline,
+			.tolerance = options.benchTolerance / 100,
+			.repeat = options.benchRepeat,
+			.cycles = options.cycles,
+			.instructionRate = options.instructionRate,
+			.programName = program_name,
+			.programNameSize = sizeof(program_name),
+		};
+		return run_bench(&bench);
+	}
 
-		long amount = fread(&machine.ram.mem[PROGRAM_MEMORY_SECTOR], 1, programSize, programFile);
-		fclose(programFile);
+	if (options.checkSource || options.checkRandom) {
+		CheckOptions check = {
+			.source = options.checkSource,
+			.randomCount = options.checkRandom,
+			.candidate = options.checkCandidate,
+			.profile = options.profile,
+			.interval = options.checkInterval,
+			.cycles = options.cycles,
+			.instructionRate = options.instructionRate,
+			.threads = options.batchThreads,
+			.window = DEFAULT_CHECK_WINDOW,
+			.seed = options.seed,
+			.programName = program_name,
+			.programNameSize = sizeof(program_name),
+		};
+		return run_check(&check);
 	}
 
-	enable_raw_mode();
+	if (options.lanes) {
+		return run_lanes(&options);
+	}
 
-	
-	hide_cursor();
-	clear_terminal();
-	write_blank_screen();
+	Chip8 * chip8 = chip8_create();
+	if (chip8 == 0) {
+		perror("Cannot allocate the machine");
+		return 3;
+	}
+	Machine * machine = chip8_machine(chip8);
 
-	while (1) {
-		machine.cycleTimeDelta += clock() - machine.cycleTime;
-		machine.cycleTime = clock();
+	initialize_program_name(machine, program_name, sizeof(program_name));
+	fill_keymap_from_input_map();
+	machine->instructionRate = options.instructionRate;
+	chip8_set_engine(chip8, options.engine);
+	chip8_set_fast_forward(chip8, options.fastForward);
+
+	if (options.programFile) {
+		int result = load_program_file(chip8, options.programFile);
+		if (result) {
+			return result;
+		}
+	}
+	if (options.profile >= 0) {
+		machine->quirks = options.profile;
+	}
+	if ((options.hotspotsFile || options.flamegraphFile) && chip8_profile_enable(chip8, 1)) {
+		perror("Cannot allocate the profiler");
+		return 3;
+	}
 
-		double secSinceLastEcycle = machine.cycleTimeDelta / CLOCKS_PER_SEC;
-		double framesPerSecond = 1 / secSinceLastEcycle;
-		sprintf(frameTimeStat, "Frame Time:  %10.6lf", secSinceLastEcycle);
-		sprintf(framesPerSecondStat, "Frames per Second: %4.0lf", framesPerSecond);
+	if (options.replayFile && !options.videoFile) {
+		return run_replay(chip8, &options);
+	}
 
-		if (machine.cycleTimeDelta < FRAME_TIME) {
-			continue;
-		}
+	// a fresh game every session unless asked for a particular one
+	if (!options.seeded && !options.headless && !options.videoFile) {
+		options.seed = (unsigned long long int)(monotonic_seconds() * 1e9) ^ getpid();
+	}
+	chip8_seed(chip8, options.seed);
 
-		draw_screen(&machine);
+	if (options.videoFile) {
+		return run_video(chip8, &options);
+	}
 
+	if (options.headless) {
+		return run_headless(chip8, &options);
+	}
 
-		int input = 0;
-		int key = -1;
-		wait_for_input(&input);
-		key = keymap[input];
-		if (input) {
-			sprintf(lastInputStat, "Code of Last Input: %03d", input);
+	Session * session = malloc(sizeof(Session));
+	if (session == 0) {
+		perror("Cannot allocate the session");
+		return 3;
+	}
+	session->chip8 = chip8;
+	session->options = &options;
+	session->recording = options.recordFile != 0;
+	session->result = 0;
+	session->metrics = 0;
+	atomic_init(&session->running, 1);
+	initialize_triple_buffer(&session->frames);
+	initialize_input_queue(&session->inputs);
+	if (session->recording) {
+		movie_begin(&session->movie, chip8, options.seed);
+	}
+	if (options.metricsFile) {
+		session->metrics = metrics_create(options.metricsFile);
+		if (session->metrics == 0) {
+			perror("Could not create the metrics page");
+			return 1;
 		}
+		// the program file tells instances apart better than the name shown in the pane
+		const char * name = options.programFile ? options.programFile : program_name;
+		const char * slash = strrchr(name, '/');
+		metrics_begin_update(session->metrics);
+		snprintf(session->metrics->programName, METRICS_NAME_SIZE, "%s", slash ? slash + 1 : name);
+		metrics_end_update(session->metrics);
+	}
 
-		if (machine.keyBuffer == -1) {
-			machine.keyBuffer = key;
-		}
+	Renderer renderer;
+	if (initialize_renderer(&renderer, options.halfBlocks)) {
+		perror("Cannot allocate the render buffer");
+		return 3;
+	}
+	if (options.rewindMegabytes > 0 && chip8_rewind_enable(chip8, options.rewindMegabytes * 1024 * 1024, REWIND_KEYFRAME_INTERVAL)) {
+		perror("Cannot allocate the rewind buffer");
+		return 3;
+	}
+	if (pipe(session->wake) || fcntl(session->wake[0], F_SETFL, O_NONBLOCK) || fcntl(session->wake[1], F_SETFL, O_NONBLOCK)) {
+		perror("Cannot create the wake pipe");
+		return 3;
+	}
+	
+	enable_raw_mode();
 
-		sprintf(keyBufferStat, "Key Buffer: %02d", machine.keyBuffer);
+	
+	hide_cursor();
+	clear_terminal();
 
-		if (input == 13) break;
-		if (input == 8) p = !p;
-		if (input == 9) {
-			int result = serialize_machine(&machine);
-			if (result > 0) {
-				perror("Serialization error");
-				return result;
+	pthread_t emulation;
+	if (pthread_create(&emulation, 0, run_emulation, session)) {
+		perror("Cannot start the emulation thread");
+		return 3;
+	}
+
+	int inputOpen = 1;
+	double nextPresent = 0;
+	while (atomic_load(&session->running)) {
+		int inputReady, wakeReady;
+		double now = monotonic_seconds();
+		wait_for_render_work(inputOpen, session->wake[0], nextPresent > now ? nextPresent - now : -1, &inputReady, &wakeReady);
+
+		if (inputReady) {
+			unsigned char inputs[INPUT_READ_SIZE];
+			ssize_t count = read(STDIN_FILENO, inputs, sizeof(inputs));
+			if (count <= 0) inputOpen = 0;
+			for (ssize_t i = 0; i < count; i++) {
+				input_queue_push(&session->inputs, inputs[i]);
 			}
-			unsafe_write_machine_error(&machine, "Warning: wrote machine state to file");
-			p = PAUSE_ON_SAVE_MACHINE | p;
 		}
-		if (input == 67) {
-			int result = deserialize_machine(&machine);
-			if (result > 0) {
-				perror("Deserialization error");
-				return result;
-			}
-			unsafe_write_machine_error(&machine, "Warning: loaded machine from file!");
-			p = !UNPAUSE_ON_LOAD_MACHINE & p;
+		if (wakeReady) {
+			char drain[64];
+			while (read(session->wake[0], drain, sizeof(drain)) > 0) {}
 		}
 
-		if (p) {
-			write_to_stat_pane("PAUSED", 1);
-		} else {
-			if (b) continue;
-			
-			write_to_stat_pane("      ", 1);
-			
-			machine.cycles += 1;
-			sprintf(currentCycleStat, "Current Cycle: %d", machine.cycles);
-			update_machine_time(&machine);
-
-			sprintf(programCounterStat, "Program Counter: %d 0x%.4x", machine.pc, machine.pc);
-			sprintf(soundTimerStat, "%-*.*s", MAX_STAT_WIDTH - 1, machine.soundTimer, SOUND_VOLUME_SEQUENCE);
-			execute_instruction(&machine);
-
-			write_to_stat_pane(frameTimeStat, 3);
-			write_to_stat_pane(framesPerSecondStat, 4);
+		// a terminal that is slow to take frames gets fewer of them: frames published until
+		// the next present are dropped, and only the newest frame is drawn
+		if (monotonic_seconds() < nextPresent) continue;
+		const Frame * frame = triple_buffer_acquire(&session->frames);
+		if (frame) {
+			draw_frame(&renderer, frame, atomic_load_explicit(&session->frames.dropped, memory_order_relaxed), options.refreshRate);
+			present_frame(&renderer);
+			nextPresent = monotonic_seconds() + renderer.writeTime * (1 / RENDER_WRITE_SHARE - 1);
 		}
-
-		write_to_stat_pane(machine.error, 0);
-		write_to_stat_pane((char *)machine.ram.mem + NAME_MEMORY_SECTOR, 2);
-
-		write_to_stat_pane(lastInputStat, 5);
-		write_to_stat_pane(keyBufferStat, 6);
-		write_to_stat_pane(programCounterStat, 7);
-		write_to_stat_pane(currentInstructionStat, 8);
-		write_to_stat_pane(currentCycleStat, 9);
-
-		write_to_stat_pane(soundTimerStat, 12);
-		
-		fflush(0);
 	}
+	pthread_join(emulation, 0);
+	int result = session->result;
 
-	free(screenBuffer);
+	if (options.recordFile) {
+		movie_free(&session->movie);
+	}
+	if (session->metrics) {
+		metrics_close(session->metrics);
+	}
+	close(session->wake[0]);
+	close(session->wake[1]);
+	free(session);
+	free_renderer(&renderer);
+	chip8_destroy(chip8);
 	reveal_cursor();
 	disable_raw_mode();
 	clear_terminal();
-	return 0;
+	return result;
 }
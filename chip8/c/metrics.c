@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+
+#include "metrics.h"
+
+// Metrics Macros
+#define METRICS_READ_ATTEMPTS 1000
+
+MetricsPage * metrics_create(const char * path) {
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return 0;
+	}
+	if (ftruncate(fd, sizeof(MetricsPage))) {
+		close(fd);
+		return 0;
+	}
+	MetricsPage * page = mmap(0, sizeof(MetricsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		return 0;
+	}
+
+	// the file is all zeros until here, which no reader takes for a page
+	page->version = METRICS_VERSION;
+	page->size = sizeof(MetricsPage);
+	page->pid = getpid();
+	atomic_init(&page->sequence, 0);
+	atomic_thread_fence(memory_order_release);
+	page->magic = METRICS_MAGIC;
+	return page;
+}
+
+void metrics_close(MetricsPage * page) {
+	metrics_begin_update(page);
+	page->exited = 1;
+	metrics_end_update(page);
+	munmap(page, sizeof(MetricsPage));
+}
+
+void metrics_begin_update(MetricsPage * page) {
+	unsigned int sequence = atomic_load_explicit(&page->sequence, memory_order_relaxed);
+	atomic_store_explicit(&page->sequence, sequence + 1, memory_order_relaxed);
+	// the odd sequence is visible before any of the fields change
+	atomic_thread_fence(memory_order_release);
+}
+
+void metrics_end_update(MetricsPage * page) {
+	unsigned int sequence = atomic_load_explicit(&page->sequence, memory_order_relaxed);
+	atomic_store_explicit(&page->sequence, sequence + 1, memory_order_release);
+}
+
+const MetricsPage * metrics_open(const char * path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	struct stat status;
+	if (fstat(fd, &status) || status.st_size < (off_t)sizeof(MetricsPage)) {
+		close(fd);
+		return 0;
+	}
+	const MetricsPage * page = mmap(0, sizeof(MetricsPage), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		return 0;
+	}
+	if (page->magic != METRICS_MAGIC || page->version != METRICS_VERSION || page->size != sizeof(MetricsPage)) {
+		munmap((void *)page, sizeof(MetricsPage));
+		return 0;
+	}
+	return page;
+}
+
+void metrics_unmap(const MetricsPage * page) {
+	munmap((void *)page, sizeof(MetricsPage));
+}
+
+int metrics_read(const MetricsPage * page, MetricsPage * snapshot) {
+	for (int attempt = 0; attempt < METRICS_READ_ATTEMPTS; attempt++) {
+		unsigned int before = atomic_load_explicit(&page->sequence, memory_order_acquire);
+		if (before & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(snapshot, (const void *)page, sizeof(MetricsPage));
+		// the copy is complete before the sequence is checked again
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&page->sequence, memory_order_relaxed) == before) {
+			return 0;
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,73 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "chip8.h"
+
+// Live metrics: the terminal client publishes a page of counters once a frame into a file it
+// maps shared, for chip8-top or anything else to read without touching the emulation thread.
+// The page is guarded by a sequence lock: the sequence is odd while the page is written, so
+// a reader copies the page and keeps the copy only when the sequence was the same even
+// number before and after. A path under /dev/shm keeps the page out of the disk.
+
+#define METRICS_MAGIC 0x544d3843
+#define METRICS_VERSION 1
+// frame times by whole milliseconds, the last bucket holds everything slower
+#define METRICS_FRAME_BUCKETS 64
+#define METRICS_NAME_SIZE 64
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	int32_t pid;
+	atomic_uint sequence;
+	// set once the client has exited, the page keeps its last figures
+	uint32_t exited;
+	// wall clock seconds of the last update
+	double updated;
+	char programName[METRICS_NAME_SIZE];
+
+	uint64_t cycles;
+	double instructionsPerSecond;
+	double speed;
+	uint32_t instructionRate;
+	uint16_t pc;
+	uint16_t opcode;
+	uint16_t index;
+	uint8_t delayTimer;
+	uint8_t soundTimer;
+	uint8_t quirks;
+	uint8_t paused;
+	uint8_t halted;
+	uint8_t turbo;
+
+	uint64_t frames;
+	uint64_t droppedFrames;
+	uint64_t lateFrames;
+	double frameTime;
+	double jitter;
+	uint64_t frameTimes[METRICS_FRAME_BUCKETS];
+	char error[MAX_STAT_WIDTH];
+} MetricsPage;
+
+// Creates or truncates the file at path and maps a fresh page from it. Returns 0 when the
+// file cannot be created or mapped.
+MetricsPage * metrics_create(const char * path);
+// Marks the page exited and unmaps it; the file stays for readers to see the last figures.
+void metrics_close(MetricsPage * page);
+
+// The writer's side: every change to the page goes between these two.
+void metrics_begin_update(MetricsPage * page);
+void metrics_end_update(MetricsPage * page);
+
+// Maps an existing page read only. Returns 0 when the file cannot be mapped or holds no
+// page of this version.
+const MetricsPage * metrics_open(const char * path);
+void metrics_unmap(const MetricsPage * page);
+// Copies a consistent snapshot of the page. Returns 1 if the writer kept it busy for too long.
+int metrics_read(const MetricsPage * page, MetricsPage * snapshot);
+
+#endif
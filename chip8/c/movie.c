@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "movie.h"
+
+// A movie is a text file: a header naming how the machine was started, one "key" line per
+// event and an "end" line with where the recording stopped.
+#define MOVIE_MAGIC "chip8-movie 1"
+#define MOVIE_LINE_SIZE 128
+
+void movie_begin(Movie * movie, Chip8 * chip8, unsigned long long int seed) {
+	const Machine * machine = chip8_machine(chip8);
+	memset(movie, 0, sizeof(*movie));
+	movie->seed = seed;
+	movie->quirks = machine->quirks;
+	movie->instructionRate = machine->instructionRate;
+	movie->startHash = chip8_state_hash(chip8);
+}
+
+int movie_add_event(Movie * movie, unsigned int cycle, unsigned short int keys) {
+	if (movie->count == movie->capacity) {
+		unsigned int capacity = movie->capacity ? movie->capacity * 2 : 256;
+		MovieEvent * events = realloc(movie->events, capacity * sizeof(*events));
+		if (events == 0) {
+			return 1;
+		}
+		movie->events = events;
+		movie->capacity = capacity;
+	}
+	movie->events[movie->count].cycle = cycle;
+	movie->events[movie->count].keys = keys;
+	movie->count++;
+	return 0;
+}
+
+void movie_truncate(Movie * movie, unsigned int cycle) {
+	while (movie->count && movie->events[movie->count - 1].cycle >= cycle) {
+		movie->count--;
+	}
+}
+
+void movie_end(Movie * movie, Chip8 * chip8) {
+	movie->endCycles = chip8_machine(chip8)->cycles;
+	movie->endHash = chip8_state_hash(chip8);
+}
+
+void movie_free(Movie * movie) {
+	free(movie->events);
+	movie->events = 0;
+	movie->count = 0;
+	movie->capacity = 0;
+}
+
+int movie_write(const Movie * movie, const char * path) {
+	FILE * file = fopen(path, "w");
+	if (file == 0) {
+		return 2;
+	}
+	fprintf(file, "%s\n", MOVIE_MAGIC);
+	fprintf(file, "seed 0x%.16llx\n", movie->seed);
+	fprintf(file, "quirks 0x%.2x\n", movie->quirks);
+	fprintf(file, "ips %u\n", movie->instructionRate);
+	fprintf(file, "start 0x%.16llx\n", movie->startHash);
+	for (unsigned int i = 0; i < movie->count; i++) {
+		fprintf(file, "key %u 0x%.4x\n", movie->events[i].cycle, movie->events[i].keys);
+	}
+	fprintf(file, "end %u 0x%.16llx\n", movie->endCycles, movie->endHash);
+	int failed = ferror(file);
+	if (fclose(file) != 0 || failed) {
+		return 3;
+	}
+	return 0;
+}
+
+int movie_read(Movie * movie, const char * path) {
+	FILE * file = fopen(path, "r");
+	if (file == 0) {
+		return 1;
+	}
+	memset(movie, 0, sizeof(*movie));
+
+	char line[MOVIE_LINE_SIZE];
+	int result = 2;
+	unsigned int header = 0;
+	unsigned int lastCycle = 0;
+	if (fgets(line, sizeof(line), file) && strncmp(line, MOVIE_MAGIC, sizeof(MOVIE_MAGIC) - 1) == 0) {
+		while (fgets(line, sizeof(line), file)) {
+			unsigned int cycle, value;
+			if (sscanf(line, "seed %llx", &movie->seed) == 1) {
+				header |= 1;
+			} else if (sscanf(line, "quirks %x", &value) == 1 && value < QUIRK_PROFILE_COUNT) {
+				movie->quirks = value;
+				header |= 2;
+			} else if (sscanf(line, "ips %u", &value) == 1 && value > 0) {
+				movie->instructionRate = value;
+				header |= 4;
+			} else if (sscanf(line, "start %llx", &movie->startHash) == 1) {
+				header |= 8;
+			} else if (sscanf(line, "key %u %x", &cycle, &value) == 2 && cycle >= lastCycle) {
+				if (movie_add_event(movie, cycle, value)) {
+					result = 3;
+					break;
+				}
+				lastCycle = cycle;
+			} else if (sscanf(line, "end %u %llx", &movie->endCycles, &movie->endHash) == 2 && movie->endCycles >= lastCycle) {
+				result = header == 15 ? 0 : 2;
+				break;
+			} else {
+				break;
+			}
+		}
+	}
+	fclose(file);
+
+	if (result) {
+		movie_free(movie);
+	}
+	return result;
+}
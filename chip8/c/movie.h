@@ -0,0 +1,43 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include "chip8.h"
+
+// Movies: the key events of a session stamped with the cycle they arrived on. A machine
+// started the same way and fed the same keys at the same cycles ends in the same state, so
+// a movie replays headlessly at full speed and checks itself against the recorded end.
+
+typedef struct {
+	unsigned int cycle;
+	unsigned short int keys;
+} MovieEvent;
+
+typedef struct {
+	unsigned long long int seed;
+	unsigned char quirks;
+	unsigned int instructionRate;
+	// chip8_state_hash when recording started and stopped
+	unsigned long long int startHash;
+	unsigned long long int endHash;
+	unsigned int endCycles;
+	MovieEvent * events;
+	unsigned int count;
+	unsigned int capacity;
+} Movie;
+
+// Starts a movie of a machine that was just loaded and seeded with seed.
+void movie_begin(Movie * movie, Chip8 * chip8, unsigned long long int seed);
+// Returns 1 when out of memory.
+int movie_add_event(Movie * movie, unsigned int cycle, unsigned short int keys);
+// Forgets every event from cycle on, for when the machine went back in time.
+void movie_truncate(Movie * movie, unsigned int cycle);
+void movie_end(Movie * movie, Chip8 * chip8);
+void movie_free(Movie * movie);
+
+// Returns 2 if the file cannot be opened and 3 if it cannot be written.
+int movie_write(const Movie * movie, const char * path);
+// Returns 1 if the file cannot be opened, 2 if it is not a finished movie and 3 when out
+// of memory.
+int movie_read(Movie * movie, const char * path);
+
+#endif
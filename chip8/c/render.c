@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "render.h"
+
+int initialize_renderer(Renderer * renderer, int halfBlocks) {
+	renderer->halfBlocks = halfBlocks;
+	renderer->buffer = malloc(RENDER_BUFFER_SIZE);
+	if (renderer->buffer == 0) {
+		return 1;
+	}
+	renderer->length = 0;
+	renderer->writeTime = 0;
+	renderer->cursorRow = -1;
+	renderer->cursorColumn = -1;
+	renderer->presentedValid = 0;
+	memset(renderer->presentedStats, 0, sizeof(renderer->presentedStats));
+	return 0;
+}
+
+void free_renderer(Renderer * renderer) {
+	free(renderer->buffer);
+	renderer->buffer = 0;
+}
+
+static void renderer_append(Renderer * renderer, const char * text, size_t size) {
+	memcpy(renderer->buffer + renderer->length, text, size);
+	renderer->length += size;
+}
+
+// rows and columns are 1-based terminal coordinates
+static void renderer_move(Renderer * renderer, int row, int column) {
+	if (renderer->cursorRow == row && renderer->cursorColumn == column) return;
+	renderer->length += sprintf(renderer->buffer + renderer->length, MOVE_CURSOR_SEQUENCE, row, column);
+	renderer->cursorRow = row;
+	renderer->cursorColumn = column;
+}
+
+static void renderer_append_pixel(Renderer * renderer, unsigned char val) {
+	if (val) {
+		renderer_append(renderer, FILL_CHARACTER, SIZE_FILL_CHARACTER - 1);
+	} else {
+		renderer_append(renderer, CLEAR_CHARACTER, SIZE_CLEAR_CHARACTER - 1);
+	}
+	renderer->cursorColumn++;
+}
+
+void draw_screen(Renderer * renderer, const uint64_t * rows) {
+	for (int i = 0; i < SCREEN_HEIGHT; i++) {
+		uint64_t row = rows[i];
+		uint64_t changed = renderer->presentedValid ? row ^ renderer->presented[i] : ~0ULL;
+		int lastChanged = -1;
+		while (changed) {
+			int j = __builtin_clzll(changed);
+			changed &= ~SCREEN_BIT(j);
+
+			// a short gap is cheaper to repaint than to jump over
+			if (lastChanged >= 0 && j - lastChanged <= 3) {
+				for (int k = lastChanged + 1; k < j; k++) {
+					renderer_append_pixel(renderer, (row & SCREEN_BIT(k)) != 0);
+				}
+			}
+			renderer_move(renderer, DEFAULT_Y_OFFSET + 1 + i, DEFAULT_X_OFFSET + 1 + j);
+			renderer_append_pixel(renderer, (row & SCREEN_BIT(j)) != 0);
+			lastChanged = j;
+		}
+		renderer->presented[i] = row;
+	}
+	renderer->presentedValid = 1;
+}
+
+static const char * const halfBlockCells[4] = {
+	FILL_CHARACTER, LOWER_HALF_CHARACTER, UPPER_HALF_CHARACTER, CLEAR_CHARACTER
+};
+static const unsigned char halfBlockSizes[4] = {
+	SIZE_FILL_CHARACTER - 1, sizeof(LOWER_HALF_CHARACTER) - 1, sizeof(UPPER_HALF_CHARACTER) - 1, SIZE_CLEAR_CHARACTER - 1
+};
+
+// The cell of column x: bit 1 is the upper pixel lit, bit 0 the lower one.
+static inline unsigned int half_block_cell(uint64_t upper, uint64_t lower, int x) {
+	return ((upper & SCREEN_BIT(x)) == 0) << 1 | ((lower & SCREEN_BIT(x)) == 0);
+}
+
+// Writes the cell once and has the terminal repeat it when that is shorter than writing it
+// count times.
+static void renderer_append_run(Renderer * renderer, unsigned int cell, unsigned int count) {
+	const char * text = halfBlockCells[cell];
+	size_t size = halfBlockSizes[cell];
+	renderer_append(renderer, text, size);
+	unsigned int repeat = count - 1;
+	if (repeat) {
+		char sequence[SIZE_REPEAT_SEQUENCE];
+		size_t sequenceSize = sprintf(sequence, REPEAT_SEQUENCE, repeat);
+		if (sequenceSize < repeat * size) {
+			renderer_append(renderer, sequence, sequenceSize);
+		} else {
+			for (unsigned int i = 0; i < repeat; i++) renderer_append(renderer, text, size);
+		}
+	}
+	renderer->cursorColumn += count;
+}
+
+// Appends the cells from column first to column last of one line, run by run.
+static void renderer_append_cells(Renderer * renderer, uint64_t upper, uint64_t lower, int first, int last) {
+	unsigned int cell = half_block_cell(upper, lower, first);
+	unsigned int count = 1;
+	for (int x = first + 1; x <= last; x++) {
+		unsigned int next = half_block_cell(upper, lower, x);
+		if (next == cell) {
+			count++;
+			continue;
+		}
+		renderer_append_run(renderer, cell, count);
+		cell = next;
+		count = 1;
+	}
+	renderer_append_run(renderer, cell, count);
+}
+
+void draw_half_blocks(Renderer * renderer, const uint64_t * rows, const char stats[STAT_ROW_COUNT][MAX_STAT_WIDTH]) {
+	for (int line = 0; line < SCREEN_HEIGHT / 2; line++) {
+		int row = DEFAULT_Y_OFFSET + 1 + line;
+		uint64_t upper = rows[2 * line];
+		uint64_t lower = rows[2 * line + 1];
+		uint64_t changed = renderer->presentedValid ? (upper ^ renderer->presented[2 * line]) | (lower ^ renderer->presented[2 * line + 1]) : ~0ULL;
+
+		// changes closer than HALF_BLOCK_GAP cells are drawn as one stretch
+		while (changed) {
+			int first = __builtin_clzll(changed);
+			int last = first;
+			changed &= ~SCREEN_BIT(first);
+			while (changed && __builtin_clzll(changed) - last - 1 <= HALF_BLOCK_GAP) {
+				last = __builtin_clzll(changed);
+				changed &= ~SCREEN_BIT(last);
+			}
+			renderer_move(renderer, row, DEFAULT_X_OFFSET + 1 + first);
+			renderer_append_cells(renderer, upper, lower, first, last);
+		}
+		renderer->presented[2 * line] = upper;
+		renderer->presented[2 * line + 1] = lower;
+
+		if (stats == 0) continue;
+		const char * text = stats[line];
+		size_t size = strnlen(text, MAX_STAT_WIDTH - 1);
+		char * presented = renderer->presentedStats[line];
+		if (strncmp(presented, text, size) == 0 && presented[size] == 0) continue;
+
+		// the pane starts one column after the screen, a space is shorter than a move there
+		int column = DEFAULT_X_OFFSET + SCREEN_WIDTH + 2;
+		if (renderer->cursorRow == row && renderer->cursorColumn == column - 1) {
+			renderer_append(renderer, FILL_CHARACTER, SIZE_FILL_CHARACTER - 1);
+			renderer->cursorColumn++;
+		}
+		renderer_move(renderer, row, column);
+		renderer_append(renderer, text, size);
+		renderer_append(renderer, CLEAR_LINE_RIGHT_SEQUENCE, SIZE_CLEAR_LINE_RIGHT_SEQUENCE - 1);
+		renderer->cursorRow = -1;
+
+		memcpy(presented, text, size);
+		presented[size] = 0;
+	}
+	renderer->presentedValid = 1;
+}
+
+void write_to_stat_pane(Renderer * renderer, const char * text, unsigned short int row) {
+	size_t size = strnlen(text, MAX_STAT_WIDTH - 1);
+	char * presented = renderer->presentedStats[row];
+	if (strncmp(presented, text, size) == 0 && presented[size] == 0) return;
+
+	renderer_move(renderer, DEFAULT_Y_OFFSET + 1 + row, DEFAULT_X_OFFSET + SCREEN_WIDTH + 2);
+	renderer_append(renderer, text, size);
+	renderer_append(renderer, CLEAR_LINE_RIGHT_SEQUENCE, SIZE_CLEAR_LINE_RIGHT_SEQUENCE - 1);
+	// stat text may hold multi-byte glyphs, so the cursor column is no longer known
+	renderer->cursorRow = -1;
+
+	memcpy(presented, text, size);
+	presented[size] = 0;
+}
+
+static double render_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void present_frame(Renderer * renderer) {
+	double start = render_seconds();
+	size_t written = 0;
+	while (written < renderer->length) {
+		ssize_t amount = write(1, renderer->buffer + written, renderer->length - written);
+		if (amount <= 0) break;
+		written += amount;
+	}
+	renderer->length = 0;
+	renderer->writeTime += (render_seconds() - start - renderer->writeTime) * WRITE_TIME_SMOOTHING;
+}
+
+// Formats the stat rows of a frame; rows the frame has nothing for keep what they showed.
+static void format_stats(const Renderer * renderer, const Frame * frame, unsigned int dropped, double refreshRate, char stats[STAT_ROW_COUNT][MAX_STAT_WIDTH]) {
+	memcpy(stats, renderer->presentedStats, sizeof(renderer->presentedStats));
+
+	if (frame->paused) {
+		sprintf(stats[1], "PAUSED");
+	} else {
+		sprintf(stats[1], "Speed: %7.2lfx%s", frame->speed, frame->turbo ? " TURBO" : "");
+		sprintf(stats[3], "Frame Time:  %10.6lf", frame->frameTime);
+		sprintf(stats[4], "Frames per Second: %4.0lf", 1 / frame->frameTime);
+		sprintf(stats[14], "Frame Jitter: %8.1lf us, %u late frames", frame->jitter * 1e6, frame->lateFrames);
+		sprintf(stats[15], "Dropped Frames: %u, %.2lf ms per write", dropped, renderer->writeTime * 1e3);
+	}
+
+	snprintf(stats[0], MAX_STAT_WIDTH, "%s", frame->error);
+	snprintf(stats[2], MAX_STAT_WIDTH, "%s", frame->programName);
+	sprintf(stats[5], "Code of Last Input: %03d", frame->lastInput);
+	sprintf(stats[6], "Key Buffer: %02d", frame->keyBuffer);
+	sprintf(stats[7], "Program Counter: %d 0x%.4x", frame->pc, frame->pc);
+	if (frame->traced) {
+		chip8_describe_trace_record(&frame->instruction, stats[8]);
+	}
+	sprintf(stats[9], "Current Cycle: %d", frame->cycles);
+	sprintf(stats[10], "Quirk Profile: %s (0x%.2x)", chip8_profile_name(frame->quirks), frame->quirks);
+	sprintf(stats[11], "Save Slot: %d", frame->saveSlot);
+	sprintf(stats[12], "%-*.*s", MAX_STAT_WIDTH - 1, frame->soundTimer, SOUND_VOLUME_SEQUENCE);
+	if (frame->rewindEnabled) {
+		sprintf(stats[13], "Rewind: %6.1lf s in %8.1lf KB of %.0lf MB, %5.2lf us/frame", frame->rewind.frames / refreshRate,
+				frame->rewind.bytesUsed / 1024.0, frame->rewind.budget / 1048576.0, frame->rewind.recordSeconds * 1e6);
+	}
+}
+
+void draw_frame(Renderer * renderer, const Frame * frame, unsigned int dropped, double refreshRate) {
+	char stats[STAT_ROW_COUNT][MAX_STAT_WIDTH];
+	format_stats(renderer, frame, dropped, refreshRate, stats);
+
+	if (renderer->halfBlocks) {
+		draw_half_blocks(renderer, frame->screen, stats);
+		return;
+	}
+	draw_screen(renderer, frame->screen);
+	for (unsigned short int row = 0; row < STAT_ROW_COUNT; row++) {
+		write_to_stat_pane(renderer, stats[row], row);
+	}
+}
@@ -0,0 +1,99 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "chip8.h"
+
+// The terminal renderer: draws the screen and the stat pane as escape sequences into one
+// buffer, then writes it out.
+
+// Terminal Macros
+#define INVISIBLE_CURSOR_SEQUENCE "\033[?25l"
+#define SIZE_INVISIBLE_CURSOR_SEQUENCE sizeof(INVISIBLE_CURSOR_SEQUENCE)
+#define VISIBLE_CURSOR_SEQUENCE "\033[?25h"
+#define SIZE_VISIBLE_CURSOR_SEQUENCE sizeof(VISIBLE_CURSOR_SEQUENCE)
+#define MOVE_CURSOR_SEQUENCE "\033[%d;%dH"
+#define SIZE_MOVE_CURSOR_SEQUENCE sizeof("\033[000;000H")
+#define CLEAR_LINE_RIGHT_SEQUENCE "\033[K"
+#define SIZE_CLEAR_LINE_RIGHT_SEQUENCE sizeof(CLEAR_LINE_RIGHT_SEQUENCE)
+#define CLEAR_SEQUENCE "\033[2J\033[H\033[2J"
+#define SIZE_CLEAR_SEQUENCE sizeof(CLEAR_SEQUENCE)
+
+// Device Macros
+#define FILL_CHARACTER " "
+#define SIZE_FILL_CHARACTER sizeof(FILL_CHARACTER)
+#define CLEAR_CHARACTER "\u2588"
+#define SIZE_CLEAR_CHARACTER sizeof(CLEAR_CHARACTER)
+#define UPPER_HALF_CHARACTER "\u2580"
+#define LOWER_HALF_CHARACTER "\u2584"
+// repeats the character just written n more times (REP)
+#define REPEAT_SEQUENCE "\033[%ub"
+#define SIZE_REPEAT_SEQUENCE sizeof("\033[4294967295b")
+// unchanged cells between two changes that are cheaper to repaint than to jump over
+#define HALF_BLOCK_GAP 8
+#define SOUND_VOLUME_SEQUENCE "\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588\u2588"
+#define DEFAULT_X_OFFSET 7
+#define DEFAULT_Y_OFFSET 3
+#define STAT_ROW_COUNT 16
+#define WRITE_TIME_SMOOTHING 0.2
+#define RENDER_BUFFER_SIZE (SCREEN_COUNT * (SIZE_MOVE_CURSOR_SEQUENCE + SIZE_CLEAR_CHARACTER) + STAT_ROW_COUNT * (SIZE_MOVE_CURSOR_SEQUENCE + MAX_STAT_WIDTH + SIZE_CLEAR_LINE_RIGHT_SEQUENCE))
+
+// Frames are composed into one preallocated buffer and diffed against what the terminal
+// already shows, so a redraw is a single write of only the cells that changed.
+//
+// With halfBlocks every terminal cell holds two pixel rows as one of ' ', ▀, ▄ and █, so the
+// screen takes 16 lines, the height of the stat pane, and each line is drawn in one pass
+// with its stat row. Runs of equal cells are collapsed with REP.
+typedef struct {
+	int halfBlocks;
+	char * buffer;
+	size_t length;
+	// smoothed seconds a present_frame spends writing, which grows when the terminal lags
+	double writeTime;
+	int cursorRow;
+	int cursorColumn;
+	int presentedValid;
+	uint64_t presented[SCREEN_HEIGHT];
+	char presentedStats[STAT_ROW_COUNT][MAX_STAT_WIDTH];
+} Renderer;
+
+// Everything the render thread shows of one emulated frame, copied out so the emulation
+// thread can carry on while the frame is formatted and written.
+typedef struct {
+	uint64_t screen[SCREEN_HEIGHT];
+	char error[MAX_STAT_WIDTH];
+	char programName[MAX_STAT_WIDTH];
+	TraceRecord instruction;
+	int traced;
+	unsigned int cycles;
+	unsigned short int pc;
+	int keyBuffer;
+	unsigned char quirks;
+	unsigned char soundTimer;
+	int paused;
+	int turbo;
+	// machine time per wall time, smoothed
+	double speed;
+	int halted;
+	int saveSlot;
+	int lastInput;
+	int rewindEnabled;
+	RewindStats rewind;
+	double frameTime;
+	double jitter;
+	unsigned int lateFrames;
+} Frame;
+
+int initialize_renderer(Renderer * renderer, int halfBlocks);
+void free_renderer(Renderer * renderer);
+// Appends the cells of rows that differ from what the terminal already shows.
+void draw_screen(Renderer * renderer, const uint64_t * rows);
+// Appends the screen lines and stat rows that differ from what the terminal already shows,
+// in half blocks, each line together with the stat row beside it.
+void draw_half_blocks(Renderer * renderer, const uint64_t * rows, const char stats[STAT_ROW_COUNT][MAX_STAT_WIDTH]);
+void write_to_stat_pane(Renderer * renderer, const char * text, unsigned short int row);
+// Draws the screen and every stat row of a frame.
+void draw_frame(Renderer * renderer, const Frame * frame, unsigned int dropped, double refreshRate);
+// Writes out and empties the buffer, timing the write.
+void present_frame(Renderer * renderer);
+
+#endif
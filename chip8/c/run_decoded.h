@@ -0,0 +1,272 @@
+// Threaded interpreter for one quirk profile. chip8.c includes this once per profile with
+// QUIRKS defined to the profile's quirk bits, so every quirk test below folds to a constant
+// and each profile gets its own dispatch loop with no quirk branches in it.
+//
+// Same semantics as execute_instruction, but dispatched through the decode cache with
+// computed gotos. pc lives in a local and is written back before anything that reads it.
+static unsigned int RUN_DECODED_VARIANT(QUIRKS)(Chip8 * chip8, unsigned int count) {
+	static const void * handlers[INSTRUCTION_KIND_COUNT] = {
+		[INSTRUCTION_UNDECODED] = &&undecoded,
+		[INSTRUCTION_CLEAR] = &&clear,
+		[INSTRUCTION_RETURN] = &&return_from_call,
+		[INSTRUCTION_EMPTY] = &&empty,
+		[INSTRUCTION_IGNORED] = &&ignored,
+		[INSTRUCTION_JUMP] = &&jump,
+		[INSTRUCTION_CALL] = &&call,
+		[INSTRUCTION_SKIP_EQUAL_IMMEDIATE] = &&skip_equal_immediate,
+		[INSTRUCTION_SKIP_NOT_EQUAL_IMMEDIATE] = &&skip_not_equal_immediate,
+		[INSTRUCTION_SKIP_EQUAL] = &&skip_equal,
+		[INSTRUCTION_LOAD_IMMEDIATE] = &&load_immediate,
+		[INSTRUCTION_ADD_IMMEDIATE] = &&add_immediate,
+		[INSTRUCTION_MOVE] = &&move,
+		[INSTRUCTION_OR] = &&or,
+		[INSTRUCTION_AND] = &&and,
+		[INSTRUCTION_XOR] = &&xor,
+		[INSTRUCTION_ADD] = &&add,
+		[INSTRUCTION_SUBTRACT] = &&subtract,
+		[INSTRUCTION_SHIFT_RIGHT] = &&shift_right,
+		[INSTRUCTION_SUBTRACT_REVERSE] = &&subtract_reverse,
+		[INSTRUCTION_SHIFT_LEFT] = &&shift_left,
+		[INSTRUCTION_SKIP_NOT_EQUAL] = &&skip_not_equal,
+		[INSTRUCTION_LOAD_INDEX] = &&load_index,
+		[INSTRUCTION_JUMP_OFFSET] = &&jump_offset,
+		[INSTRUCTION_RANDOM] = &&random,
+		[INSTRUCTION_DRAW] = &&draw,
+		[INSTRUCTION_SKIP_KEY] = &&skip_key,
+		[INSTRUCTION_SKIP_NOT_KEY] = &&skip_not_key,
+		[INSTRUCTION_LOAD_DELAY] = &&load_delay,
+		[INSTRUCTION_SET_DELAY] = &&set_delay,
+		[INSTRUCTION_SET_SOUND] = &&set_sound,
+		[INSTRUCTION_ADD_INDEX] = &&add_index,
+		[INSTRUCTION_WAIT_KEY] = &&wait_key,
+		[INSTRUCTION_FONT] = &&font,
+		[INSTRUCTION_DECIMAL] = &&decimal,
+		[INSTRUCTION_STORE] = &&store,
+		[INSTRUCTION_LOAD] = &&load,
+		[INSTRUCTION_UNKNOWN] = &&unknown,
+	};
+
+	Machine * machine = &chip8->machine;
+	DecodedInstruction * slots = chip8->decodeCache.slots;
+	unsigned char * reg = machine->registers.reg;
+	unsigned short int pc = machine->pc;
+	unsigned int executed = 0;
+	const DecodedInstruction * instruction;
+	unsigned char reg1, reg2;
+
+#define DISPATCH() \
+	do { \
+		if (executed == count) goto done; \
+		executed++; \
+		trace_instruction(chip8, pc, machine->cycles + executed); \
+		if ((unsigned int)(pc - PROGRAM_MEMORY_SECTOR) >= DECODE_CACHE_SIZE - 1) goto interpret; \
+		instruction = &slots[pc - PROGRAM_MEMORY_SECTOR]; \
+		goto *handlers[instruction->kind]; \
+	} while (0)
+#define NEXT() do { pc += 2; DISPATCH(); } while (0)
+
+	DISPATCH();
+
+undecoded:
+	decode_instruction((DecodedInstruction *)instruction, machine->ram.mem[pc], machine->ram.mem[pc + 1]);
+	goto *handlers[instruction->kind];
+interpret:
+	machine->pc = pc;
+	execute_instruction(chip8);
+	pc = machine->pc;
+	if (machine->halted) goto done;
+	DISPATCH();
+clear:
+	memset(machine->screen.rows, 0, sizeof(machine->screen.rows));
+	NEXT();
+return_from_call:
+	if (machine->stack.sp == 0) {
+		fatal_unsafe_write_machine_error(machine, "Error: cannot return out of an empty stack");
+		goto done;
+	}
+	machine->stack.sp--;
+	pc = machine->stack.mem[machine->stack.sp];
+	NEXT();
+empty:
+	DISPATCH();
+ignored:
+	unsafe_write_machine_error(machine, "Warning: ignored instruction 0x%.2x%2.2x", instruction->x, instruction->nn);
+	NEXT();
+jump:
+	pc = instruction->nnn;
+	DISPATCH();
+call:
+	if (machine->stack.sp >= STACK_LIMIT) {
+		fatal_unsafe_write_machine_error(machine, "Error: cannot call past a full stack");
+		goto done;
+	}
+	machine->stack.mem[machine->stack.sp] = pc;
+	machine->stack.sp++;
+	pc = instruction->nnn;
+	DISPATCH();
+skip_equal_immediate:
+	if (reg[instruction->x] == instruction->nn) pc += 2;
+	NEXT();
+skip_not_equal_immediate:
+	if (reg[instruction->x] != instruction->nn) pc += 2;
+	NEXT();
+skip_equal:
+	if (reg[instruction->x] == reg[instruction->y]) pc += 2;
+	NEXT();
+load_immediate:
+	reg[instruction->x] = instruction->nn;
+	NEXT();
+add_immediate:
+	reg[instruction->x] += instruction->nn;
+	NEXT();
+move:
+	reg[instruction->x] = reg[instruction->y];
+	NEXT();
+or:
+	reg[instruction->x] |= reg[instruction->y];
+	if ((QUIRKS & QUIRK_COSMAC_VF_RESET)) reg[15] = 0;
+	NEXT();
+and:
+	reg[instruction->x] &= reg[instruction->y];
+	if ((QUIRKS & QUIRK_COSMAC_VF_RESET)) reg[15] = 0;
+	NEXT();
+xor:
+	reg[instruction->x] ^= reg[instruction->y];
+	if ((QUIRKS & QUIRK_COSMAC_VF_RESET)) reg[15] = 0;
+	NEXT();
+add:
+	reg1 = reg[instruction->x];
+	reg2 = reg[instruction->y];
+	reg[instruction->x] = reg1 + reg2;
+	reg[15] = reg1 + reg2 > 255;
+	NEXT();
+subtract:
+	reg1 = reg[instruction->x];
+	reg2 = reg[instruction->y];
+	reg[instruction->x] = reg1 - reg2;
+	reg[15] = reg1 >= reg2;
+	NEXT();
+shift_right:
+	reg1 = reg[instruction->x];
+	reg2 = reg[instruction->y];
+	if (!(QUIRKS & QUIRK_SUPER_CHIP_SHIFT)) {
+		reg[instruction->x] = reg2 >> 1;
+		reg[15] = reg2 & 1;
+	} else {
+		reg[instruction->x] = reg1 >> 1;
+		reg[15] = reg1 & 1;
+	}
+	NEXT();
+subtract_reverse:
+	reg1 = reg[instruction->x];
+	reg2 = reg[instruction->y];
+	reg[instruction->x] = reg2 - reg1;
+	reg[15] = reg2 >= reg1;
+	NEXT();
+shift_left:
+	reg1 = reg[instruction->x];
+	reg2 = reg[instruction->y];
+	if (!(QUIRKS & QUIRK_SUPER_CHIP_SHIFT)) {
+		reg[instruction->x] = reg2 << 1;
+		reg[15] = reg2 & 8;
+	} else {
+		reg[instruction->x] = reg1 << 1;
+		reg[15] = (reg1 & 8) >> 3;
+	}
+	NEXT();
+skip_not_equal:
+	if (reg[instruction->x] != reg[instruction->y]) pc += 2;
+	NEXT();
+load_index:
+	machine->regI = instruction->nnn;
+	NEXT();
+jump_offset:
+	if ((QUIRKS & QUIRK_SUPER_CHIP_JUMP)) {
+		pc = instruction->nnn + reg[instruction->x];
+	} else {
+		pc = instruction->nnn + reg[0];
+	}
+	DISPATCH();
+random:
+	reg[instruction->x] = next_random(machine) & instruction->nn;
+	NEXT();
+draw:
+	draw_sprite(machine, instruction->n, machine->regI, reg[instruction->x], reg[instruction->y]);
+	NEXT();
+skip_key:
+	if (machine->keyBuffer == (reg[instruction->x] & 15)) {
+		pc += 2;
+		machine->keyBuffer = -1;
+	}
+	NEXT();
+skip_not_key:
+	if (machine->keyBuffer != (reg[instruction->x] & 15)) {
+		pc += 2;
+	}
+	machine->keyBuffer = -1;
+	NEXT();
+load_delay:
+	reg[instruction->x] = machine->delayTimer;
+	NEXT();
+set_delay:
+	machine->delayTimer = reg[instruction->x];
+	NEXT();
+set_sound:
+	machine->soundTimer = reg[instruction->x];
+	NEXT();
+add_index:
+	machine->regI += reg[instruction->x];
+	if ((QUIRKS & QUIRK_AMIGA_INDEX_OVERFLOW)) {
+		reg[15] = machine->regI > 0x1000;
+	}
+	NEXT();
+wait_key:
+	if (machine->keyBuffer > -1) {
+		reg[instruction->x] = machine->keyBuffer;
+		machine->keyBuffer = -1;
+		NEXT();
+	}
+	DISPATCH();
+font:
+	machine->regI = FONT_MEMORY_SECTOR + (reg[instruction->x] * 5);
+	NEXT();
+decimal:
+	reg1 = reg[instruction->x];
+	machine->ram.mem[MEMORY_ADDRESS(machine->regI + 2)] = reg1 % 10;
+	machine->ram.mem[MEMORY_ADDRESS(machine->regI + 1)] = (reg1 / 10) % 10;
+	machine->ram.mem[MEMORY_ADDRESS(machine->regI)] = (reg1 / 100);
+	invalidate_code(chip8, machine->regI, 3);
+	NEXT();
+store:
+	reg1 = instruction->x;
+	for (int i = 0; i < reg1 + 1; i++) {
+		machine->ram.mem[MEMORY_ADDRESS(machine->regI + i)] = reg[i];
+	}
+	invalidate_code(chip8, machine->regI, reg1 + 1);
+	if ((QUIRKS & QUIRK_COSMAC_INDEX_INCREMENT)) {
+		machine->regI += reg1 + 1;
+	}
+	NEXT();
+load:
+	reg1 = instruction->x;
+	for (int i = 0; i < reg1 + 1; i++) {
+		reg[i] = machine->ram.mem[MEMORY_ADDRESS(machine->regI + i)];
+	}
+	if ((QUIRKS & QUIRK_COSMAC_INDEX_INCREMENT)) {
+		machine->regI += reg1 + 1;
+	}
+	NEXT();
+unknown:
+	machine->pc = pc;
+	fatal_unsafe_write_machine_error(machine, "Error: unknown instruction 0x%.2x%2.2x at address 0x%.4x", machine->ram.mem[pc], machine->ram.mem[pc + 1], pc);
+	goto done;
+
+#undef NEXT
+#undef DISPATCH
+done:
+	machine->pc = pc;
+	machine->cycles += executed;
+	return executed;
+}
+
+#undef QUIRKS
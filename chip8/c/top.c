@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "metrics.h"
+
+// chip8-top: a table of the metrics pages of running terminal clients, refreshed until
+// interrupted. Pages are only ever read, so watching costs the clients nothing.
+
+// Top Macros
+#define DEFAULT_TOP_INTERVAL 1.0
+#define TOP_CLEAR_SEQUENCE "\033[H\033[2J"
+#define TOP_STATE_SIZE 16
+
+static void usage(const char * name) {
+	fprintf(stderr, "usage: %s [--once] [--interval <seconds>] <metrics file>...\n", name);
+}
+
+// The frame time below which the given share of frames fell, in milliseconds.
+static unsigned int frame_time_percentile(const MetricsPage * page, double share) {
+	uint64_t total = 0;
+	for (int i = 0; i < METRICS_FRAME_BUCKETS; i++) total += page->frameTimes[i];
+	uint64_t seen = 0;
+	for (int i = 0; i < METRICS_FRAME_BUCKETS; i++) {
+		seen += page->frameTimes[i];
+		if (total && seen >= total * share) return i + 1;
+	}
+	return 0;
+}
+
+static void state_name(const MetricsPage * page, char * state) {
+	if (page->exited) strcpy(state, "exited");
+	// a client killed outright never marks its page
+	else if (kill(page->pid, 0) && errno == ESRCH) strcpy(state, "gone");
+	else if (page->halted) strcpy(state, "halted");
+	else if (page->paused) strcpy(state, "paused");
+	else if (page->turbo) strcpy(state, "turbo");
+	else strcpy(state, "running");
+}
+
+static void print_page(const char * path) {
+	const MetricsPage * page = metrics_open(path);
+	if (page == 0) {
+		printf("%-24.24s  no metrics page\n", path);
+		return;
+	}
+	MetricsPage snapshot;
+	int busy = metrics_read(page, &snapshot);
+	metrics_unmap(page);
+	if (busy) {
+		printf("%-24.24s  busy\n", path);
+		return;
+	}
+
+	char state[TOP_STATE_SIZE];
+	state_name(&snapshot, state);
+	snapshot.programName[METRICS_NAME_SIZE - 1] = 0;
+	snapshot.error[MAX_STAT_WIDTH - 1] = 0;
+	printf("%-24.24s %7d %-7s %12llu %12.0lf %9.2lfx 0x%.3x %.4x %3u %3u %4u/%-4u %8llu %6llu  %s\n",
+			snapshot.programName, snapshot.pid, state, (unsigned long long int)snapshot.cycles, snapshot.instructionsPerSecond,
+			snapshot.speed, snapshot.pc, snapshot.opcode, snapshot.delayTimer, snapshot.soundTimer,
+			frame_time_percentile(&snapshot, 0.5), frame_time_percentile(&snapshot, 0.99),
+			(unsigned long long int)snapshot.droppedFrames, (unsigned long long int)snapshot.lateFrames, snapshot.error);
+}
+
+int main(int argc, char * argv[]) {
+	int once = 0;
+	double interval = DEFAULT_TOP_INTERVAL;
+	int first = 1;
+	for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+		if (strcmp(argv[first], "--once") == 0) {
+			once = 1;
+		} else if (strcmp(argv[first], "--interval") == 0 && first + 1 < argc) {
+			interval = strtod(argv[++first], 0);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (first == argc || interval <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	while (1) {
+		if (!once) printf(TOP_CLEAR_SEQUENCE);
+		printf("%-24s %7s %-7s %12s %12s %10s %5s %4s %3s %3s %9s %8s %6s  %s\n",
+				"PROGRAM", "PID", "STATE", "CYCLES", "IPS", "SPEED", "PC", "OP", "DT", "ST", "FRAME MS", "DROPPED", "LATE", "ERROR");
+		for (int i = first; i < argc; i++) {
+			print_page(argv[i]);
+		}
+		fflush(stdout);
+		if (once) return 0;
+		struct timespec wait = {(time_t)interval, (long)((interval - (time_t)interval) * 1e9)};
+		nanosleep(&wait, 0);
+	}
+}
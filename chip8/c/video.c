@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "video.h"
+
+// Video Macros
+#define VIDEO_BUFFER_SIZE (4 * 1024 * 1024)
+#define VIDEO_HEADER_SIZE 64
+#define VIDEO_Y4M_FRAME_HEADER "FRAME\n"
+// luma of a lit and a dark pixel, a set bit is dark
+#define VIDEO_WHITE 255
+#define VIDEO_BLACK 0
+
+int video_parse_format(const char * name) {
+	if (strcmp(name, "y4m") == 0) return VIDEO_FORMAT_Y4M;
+	if (strcmp(name, "pbm") == 0) return VIDEO_FORMAT_PBM;
+	return -1;
+}
+
+static int write_all(int fd, const unsigned char * data, size_t size) {
+	while (size) {
+		ssize_t written = write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return 2;
+		}
+		data += written;
+		size -= written;
+	}
+	return 0;
+}
+
+static int flush_video(VideoWriter * video) {
+	int result = write_all(video->fd, video->buffer, video->length);
+	video->bytes += video->length;
+	video->length = 0;
+	return result;
+}
+
+static size_t frame_header(const VideoWriter * video, char * header) {
+	if (video->format == VIDEO_FORMAT_Y4M) {
+		return sprintf(header, "%s", VIDEO_Y4M_FRAME_HEADER);
+	}
+	return sprintf(header, "P4\n%u %u\n", SCREEN_WIDTH * video->scale, SCREEN_HEIGHT * video->scale);
+}
+
+int video_open(VideoWriter * video, const char * path, int format, unsigned int fps, unsigned int scale, int dedup, const char * timecodesPath) {
+	memset(video, 0, sizeof(*video));
+	video->format = format;
+	video->fps = fps;
+	video->scale = scale;
+	video->dedup = dedup;
+
+	char header[VIDEO_HEADER_SIZE];
+	size_t lineSize = format == VIDEO_FORMAT_Y4M ? SCREEN_WIDTH * scale : SCREEN_WIDTH * scale / 8;
+	video->frameSize = frame_header(video, header) + lineSize * SCREEN_HEIGHT * scale;
+	video->capacity = video->frameSize > VIDEO_BUFFER_SIZE ? video->frameSize : VIDEO_BUFFER_SIZE;
+	video->buffer = malloc(video->capacity);
+	if (video->buffer == 0) {
+		return 3;
+	}
+
+	video->fd = strcmp(path, "-") == 0 ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (video->fd < 0) {
+		free(video->buffer);
+		return 1;
+	}
+	if (timecodesPath) {
+		video->timecodes = fopen(timecodesPath, "w");
+		if (video->timecodes == 0) {
+			if (video->fd != STDOUT_FILENO) close(video->fd);
+			free(video->buffer);
+			return 1;
+		}
+		fprintf(video->timecodes, "# timestamp format v2\n");
+	}
+
+	// the stream header goes out with the first frames
+	if (format == VIDEO_FORMAT_Y4M) {
+		video->length = sprintf((char *)video->buffer, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 Cmono\n", SCREEN_WIDTH * scale, SCREEN_HEIGHT * scale, fps);
+	}
+	return 0;
+}
+
+// Each row is scaled into its first output line, which is then copied for the rest.
+static void encode_frame(VideoWriter * video, const uint64_t * rows, unsigned char * out) {
+	char header[VIDEO_HEADER_SIZE];
+	size_t headerSize = frame_header(video, header);
+	memcpy(out, header, headerSize);
+	out += headerSize;
+
+	unsigned int scale = video->scale;
+	size_t lineSize = video->format == VIDEO_FORMAT_Y4M ? SCREEN_WIDTH * scale : SCREEN_WIDTH * scale / 8;
+	for (int y = 0; y < SCREEN_HEIGHT; y++) {
+		uint64_t row = rows[y];
+		unsigned char * line = out;
+		if (video->format == VIDEO_FORMAT_Y4M) {
+			for (int x = 0; x < SCREEN_WIDTH; x++) {
+				memset(line + x * scale, row & SCREEN_BIT(x) ? VIDEO_BLACK : VIDEO_WHITE, scale);
+			}
+		} else {
+			// PBM packs 1 for black from the most significant bit, like the rows themselves
+			memset(line, 0, lineSize);
+			unsigned int bit = 0;
+			for (int x = 0; x < SCREEN_WIDTH; x++) {
+				if (row & SCREEN_BIT(x)) {
+					for (unsigned int s = 0; s < scale; s++, bit++) line[bit >> 3] |= 0x80 >> (bit & 7);
+				} else bit += scale;
+			}
+		}
+		for (unsigned int s = 1; s < scale; s++) {
+			memcpy(line + s * lineSize, line, lineSize);
+		}
+		out += lineSize * scale;
+	}
+}
+
+int video_write_frame(VideoWriter * video, const uint64_t * rows) {
+	unsigned int frame = video->frames++;
+	if (video->dedup && video->hasLast && memcmp(video->last, rows, sizeof(video->last)) == 0) {
+		return 0;
+	}
+	memcpy(video->last, rows, sizeof(video->last));
+	video->hasLast = 1;
+
+	if (video->length + video->frameSize > video->capacity && flush_video(video)) {
+		return 2;
+	}
+	encode_frame(video, rows, video->buffer + video->length);
+	video->length += video->frameSize;
+	video->written++;
+	if (video->timecodes) {
+		fprintf(video->timecodes, "%.3lf\n", frame * 1000.0 / video->fps);
+	}
+	return 0;
+}
+
+int video_close(VideoWriter * video) {
+	int result = flush_video(video);
+	if (video->fd != STDOUT_FILENO && close(video->fd)) result = 2;
+	if (video->timecodes && (ferror(video->timecodes) | fclose(video->timecodes))) result = 2;
+	free(video->buffer);
+	video->buffer = 0;
+	return result;
+}
@@ -0,0 +1,46 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include "chip8.h"
+
+// Video export: frames of the screen as a YUV4MPEG2 stream (one grey plane) or as raw PBM
+// images back to back, scaled up by whole pixels, for ffmpeg, mpv or the netpbm tools.
+// Frames are gathered in a large buffer and written out in few big writes.
+
+enum {
+	VIDEO_FORMAT_Y4M,
+	VIDEO_FORMAT_PBM
+};
+
+typedef struct {
+	int fd;
+	int format;
+	unsigned int fps;
+	unsigned int scale;
+	int dedup;
+	unsigned char * buffer;
+	size_t length;
+	size_t capacity;
+	size_t frameSize;
+	uint64_t last[SCREEN_HEIGHT];
+	int hasLast;
+	unsigned int frames;
+	unsigned int written;
+	unsigned long long int bytes;
+	FILE * timecodes;
+} VideoWriter;
+
+// Returns -1 for an unknown format name.
+int video_parse_format(const char * name);
+
+// path "-" writes to stdout. With dedup a frame equal to the one before is left out; the
+// timecodes file, if given, keeps the time of every frame written (mkvmerge format v2) so the
+// original timing can be put back. Returns 1 if a file cannot be opened and 3 when out of
+// memory.
+int video_open(VideoWriter * video, const char * path, int format, unsigned int fps, unsigned int scale, int dedup, const char * timecodesPath);
+// Returns 2 on a write error.
+int video_write_frame(VideoWriter * video, const uint64_t * rows);
+// Flushes what is left and closes the files. Returns 2 on a write error.
+int video_close(VideoWriter * video);
+
+#endif